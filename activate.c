@@ -0,0 +1,160 @@
+/*
+ * activate.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "activate.h"
+#include "log.h"
+
+/*
+ * Take listening sockets passed by the service manager. Control socket
+ * is a local socket, the other one is L2CAP. Sockets that were not
+ * passed are left at -1. Must be called before the process forks,
+ * LISTEN_PID is checked. Returns number of sockets taken or -1.
+ */
+
+int32_t
+activate_listen_fds(int32_t *unsock, int32_t *l2sock)
+{
+	struct sockaddr_storage	 sa;
+	socklen_t		 size;
+	char const		*env = NULL;
+	char			*ep = NULL;
+	int32_t			 n, fd, listening;
+
+	*unsock = *l2sock = -1;
+
+	env = getenv("LISTEN_PID");
+	if (env == NULL || strtol(env, &ep, 10) != getpid() || *ep != '\0')
+		return (0);
+
+	env = getenv("LISTEN_FDS");
+	if (env == NULL)
+		return (0);
+
+	n = strtol(env, &ep, 10);
+	if (*ep != '\0' || n < 0 || n > 2) {
+		log_crit("Could not use LISTEN_FDS=%s", env);
+		return (-1);
+	}
+
+	/* Descriptors are ours now, do not pass them on */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	for (fd = ACTIVATE_FDS_START; fd < ACTIVATE_FDS_START + n; fd ++) {
+		memset(&sa, 0, sizeof(sa));
+		size = sizeof(sa);
+		if (getsockname(fd, (struct sockaddr *) &sa, &size) < 0) {
+			log_crit("Could not get address of socket %d. %s (%d)",
+				fd, strerror(errno), errno);
+			return (-1);
+		}
+
+		size = sizeof(listening);
+		if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+				&size) < 0 || !listening) {
+			log_crit("Socket %d is not listening", fd);
+			return (-1);
+		}
+
+		if (sa.ss_family == AF_LOCAL && *unsock < 0)
+			*unsock = fd;
+		else if (sa.ss_family == AF_BLUETOOTH && *l2sock < 0)
+			*l2sock = fd;
+		else {
+			log_crit("Socket %d is not a control or L2CAP socket",
+				fd);
+			return (-1);
+		}
+
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+		    fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+			log_crit("Could not set up socket %d. %s (%d)",
+				fd, strerror(errno), errno);
+			return (-1);
+		}
+	}
+
+	return (n);
+}
+
+/*
+ * Tell the service manager that the server is ready. Process that took
+ * over on SIGHUP reports its own pid as the main one.
+ */
+
+void
+activate_ready(void)
+{
+	struct sockaddr_un	 un;
+	char const		*env = getenv("NOTIFY_SOCKET");
+	char			 msg[64];
+	int32_t			 s, len;
+
+	if (env == NULL || (env[0] != '/' && env[0] != '@') ||
+	    strlen(env) >= sizeof(un.sun_path))
+		return;
+
+	memset(&un, 0, sizeof(un));
+	un.sun_len = sizeof(un);
+	un.sun_family = AF_LOCAL;
+	strlcpy(un.sun_path, env, sizeof(un.sun_path));
+
+	/* Abstract socket namespace */
+	if (un.sun_path[0] == '@')
+		un.sun_path[0] = '\0';
+
+	s = socket(PF_LOCAL, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (s < 0) {
+		log_warning("Could not create notify socket. %s (%d)",
+			strerror(errno), errno);
+		return;
+	}
+
+	len = snprintf(msg, sizeof(msg), "READY=1\nMAINPID=%d\n", getpid());
+
+	if (sendto(s, msg, len, 0, (struct sockaddr *) &un,
+			offsetof(struct sockaddr_un, sun_path) +
+			strlen(env)) != len)
+		log_warning("Could not notify service manager. %s (%d)",
+			strerror(errno), errno);
+
+	close(s);
+}
@@ -0,0 +1,303 @@
+/*
+ * arena.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "arena.h"
+
+struct arena_page
+{
+	LIST_ENTRY(arena_page)	 page_next;	/* pages of the class */
+	void			*free;		/* free blocks */
+	int32_t			 cls;		/* size class */
+	int32_t			 used;		/* blocks in use */
+	int32_t			 listed;	/* page is on a list */
+	int32_t			 draining;	/* page is being emptied */
+};
+
+typedef struct arena_page	arena_page_t;
+typedef struct arena_page *	arena_page_p;
+
+LIST_HEAD(arena_page_list, arena_page);
+
+struct arena_class
+{
+	struct arena_page_list	 partial;	/* pages with free blocks */
+	struct arena_page_list	 draining;	/* pages being emptied */
+	arena_page_p		 spare;		/* empty page kept around */
+};
+
+static struct arena_class	classes[ARENA_CLASSES];
+static uint32_t			pages = 0;
+
+/* Blocks start after the page header, aligned to the smallest block */
+#define	ARENA_HDR_SIZE \
+	((sizeof(arena_page_t) + ARENA_MIN_SIZE - 1) & ~(ARENA_MIN_SIZE - 1))
+
+#define	arena_page(p) \
+	((arena_page_p) ((uintptr_t) (p) & ~((uintptr_t) ARENA_PAGE_SIZE - 1)))
+#define	arena_block_size(cls) \
+	(ARENA_MIN_SIZE << (cls))
+
+static int32_t		arena_class_of	(uint32_t size);
+static arena_page_p	arena_page_new	(int32_t cls);
+static void		arena_page_put	(arena_page_p page);
+
+/*
+ * Return size class for the given size or -1 if it is too big
+ */
+
+static int32_t
+arena_class_of(uint32_t size)
+{
+	int32_t	cls;
+
+	for (cls = 0; cls < ARENA_CLASSES; cls ++)
+		if (size <= arena_block_size(cls))
+			return (cls);
+
+	return (-1);
+}
+
+/*
+ * Return block size used for the given size (0 if not in the arena)
+ */
+
+uint32_t
+arena_size(uint32_t size)
+{
+	int32_t	cls = arena_class_of(size);
+
+	return ((cls < 0)? 0 : arena_block_size(cls));
+}
+
+/*
+ * Get empty page for the given class
+ */
+
+static arena_page_p
+arena_page_new(int32_t cls)
+{
+	arena_page_p	page = classes[cls].spare;
+	uint8_t		*b = NULL;
+	void		*p = NULL;
+
+	if (page != NULL) {
+		classes[cls].spare = NULL;
+		return (page);
+	}
+
+	if (posix_memalign(&p, ARENA_PAGE_SIZE, ARENA_PAGE_SIZE) != 0)
+		return (NULL);
+
+	page = (arena_page_p) p;
+	page->free = NULL;
+	page->cls = cls;
+	page->used = 0;
+	page->listed = 0;
+	page->draining = 0;
+
+	/* Link blocks, so the lowest block is the first to go */
+	for (b = (uint8_t *) p + ARENA_PAGE_SIZE - arena_block_size(cls);
+	     b >= (uint8_t *) p + ARENA_HDR_SIZE;
+	     b -= arena_block_size(cls)) {
+		*(void **) b = page->free;
+		page->free = b;
+	}
+
+	pages ++;
+
+	return (page);
+}
+
+/*
+ * Empty page is no longer needed. Keep one per class for the next time.
+ */
+
+static void
+arena_page_put(arena_page_p page)
+{
+	struct arena_class	*c = &classes[page->cls];
+
+	assert(page->used == 0);
+
+	if (page->listed) {
+		LIST_REMOVE(page, page_next);
+		page->listed = 0;
+	}
+
+	page->draining = 0;
+
+	if (c->spare == NULL)
+		c->spare = page;
+	else {
+		free(page);
+		pages --;
+	}
+}
+
+/*
+ * Allocate block for size bytes
+ */
+
+void *
+arena_alloc(uint32_t size)
+{
+	int32_t		cls = arena_class_of(size);
+	arena_page_p	page = NULL;
+	void		*b = NULL;
+
+	if (cls < 0)
+		return (NULL);
+
+	page = LIST_FIRST(&classes[cls].partial);
+	if (page == NULL) {
+		page = arena_page_new(cls);
+		if (page == NULL)
+			return (NULL);
+
+		LIST_INSERT_HEAD(&classes[cls].partial, page, page_next);
+		page->listed = 1;
+	}
+
+	b = page->free;
+	page->free = *(void **) b;
+	page->used ++;
+
+	if (page->free == NULL) {
+		LIST_REMOVE(page, page_next);
+		page->listed = 0;
+	}
+
+	return (b);
+}
+
+/*
+ * Free block
+ */
+
+void
+arena_free(void *p)
+{
+	arena_page_p	page = arena_page(p);
+
+	assert(page->used > 0);
+
+	*(void **) p = page->free;
+	page->free = p;
+	page->used --;
+
+	if (page->used == 0)
+		arena_page_put(page);
+	else if (!page->listed) {
+		LIST_INSERT_HEAD(&classes[page->cls].partial, page, page_next);
+		page->listed = 1;
+	}
+}
+
+/*
+ * Check if block is in a page that is being emptied
+ */
+
+int32_t
+arena_draining(void const *p)
+{
+	return (arena_page(p)->draining);
+}
+
+/*
+ * Start compaction. Pages that are used to a quarter or less are taken
+ * off the partial list, except the fullest of them, which is where the
+ * moved blocks go.
+ */
+
+void
+arena_compact_begin(void)
+{
+	arena_page_p	page = NULL, next = NULL, keep = NULL;
+	int32_t		cls, blocks;
+
+	for (cls = 0; cls < ARENA_CLASSES; cls ++) {
+		blocks = (ARENA_PAGE_SIZE - ARENA_HDR_SIZE) /
+				arena_block_size(cls);
+		keep = NULL;
+
+		LIST_FOREACH(page, &classes[cls].partial, page_next)
+			if (page->used * 4 <= blocks &&
+			    (keep == NULL || keep->used < page->used))
+				keep = page;
+
+		for (page = LIST_FIRST(&classes[cls].partial);
+		     page != NULL;
+		     page = next) {
+			next = LIST_NEXT(page, page_next);
+
+			if (page == keep || page->used * 4 > blocks)
+				continue;
+
+			LIST_REMOVE(page, page_next);
+			LIST_INSERT_HEAD(&classes[cls].draining, page,
+				page_next);
+			page->draining = 1;
+		}
+	}
+}
+
+/*
+ * Finish compaction. Pages that still have blocks are used again.
+ */
+
+void
+arena_compact_end(void)
+{
+	arena_page_p	page = NULL;
+	int32_t		cls;
+
+	for (cls = 0; cls < ARENA_CLASSES; cls ++) {
+		while ((page = LIST_FIRST(&classes[cls].draining)) != NULL) {
+			LIST_REMOVE(page, page_next);
+			LIST_INSERT_HEAD(&classes[cls].partial, page,
+				page_next);
+			page->draining = 0;
+		}
+	}
+}
+
+/*
+ * Return number of bytes taken from the system
+ */
+
+uint32_t
+arena_bytes(void)
+{
+	return (pages * ARENA_PAGE_SIZE);
+}
+
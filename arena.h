@@ -0,0 +1,63 @@
+/*
+ * arena.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+/*
+ * Size classed arena for profile data. Memory is taken from the system
+ * in pages of ARENA_PAGE_SIZE bytes, aligned to the page size, so the
+ * page of a block is found from the block address. Every page holds
+ * blocks of one size class only. Blocks are ARENA_MIN_SIZE bytes and up,
+ * in powers of two. Anything bigger than ARENA_MAX_SIZE is not handled
+ * by the arena.
+ *
+ * Compaction empties sparsely used pages. arena_compact_begin() stops
+ * allocations from such pages, the owner of the data then moves every
+ * block for which arena_draining() is true and arena_compact_end() puts
+ * back pages that could not be emptied.
+ */
+
+#define	ARENA_PAGE_SHIFT	14
+#define	ARENA_PAGE_SIZE		(1 << ARENA_PAGE_SHIFT)
+#define	ARENA_MIN_SHIFT		6
+#define	ARENA_MIN_SIZE		(1 << ARENA_MIN_SHIFT)
+#define	ARENA_CLASSES		6
+#define	ARENA_MAX_SIZE		(ARENA_MIN_SIZE << (ARENA_CLASSES - 1))
+
+void *		arena_alloc		(uint32_t size);
+void		arena_free		(void *p);
+uint32_t	arena_size		(uint32_t size);
+int32_t		arena_draining		(void const *p);
+void		arena_compact_begin	(void);
+void		arena_compact_end	(void);
+uint32_t	arena_bytes		(void);
+
+#endif /* ndef _ARENA_H_ */
+
@@ -0,0 +1,246 @@
+/*
+ * capture.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/endian.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "capture.h"
+#include "log.h"
+
+/*
+ * Capture ring. Server thread is the only producer and the writer
+ * thread is the only consumer, so head and tail are enough to keep
+ * them apart. Records that do not fit are dropped and counted, server
+ * never waits for the disk.
+ */
+
+static struct {
+	uint8_t			buf[CAPTURE_RING_SIZE];
+	_Atomic uint64_t	head;		/* written by server */
+	_Atomic uint64_t	tail;		/* written by writer */
+	_Atomic int32_t		stop;		/* writer must exit */
+	uint32_t		drops;		/* records dropped so far */
+	int32_t			fd;		/* capture file */
+	pthread_t		writer;
+} ring;
+
+int32_t	capture_on = 0;
+
+static void *	capture_writer	(void *arg);
+
+/*
+ * Start capture into file
+ */
+
+int32_t
+capture_start(char const *path)
+{
+	struct capture_file	hdr;
+	int32_t			error;
+
+	if (capture_on)
+		return (0);
+
+	ring.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (ring.fd < 0) {
+		log_err("Could not open(%s). %s (%d)",
+			path, strerror(errno), errno);
+		return (-1);
+	}
+
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	be32enc(&hdr.version, CAPTURE_VERSION);
+	be32enc(&hdr.datalink, CAPTURE_DATALINK);
+
+	if (write(ring.fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		log_err("Could not write capture header to %s", path);
+		close(ring.fd);
+		return (-1);
+	}
+
+	atomic_store(&ring.head, 0);
+	atomic_store(&ring.tail, 0);
+	atomic_store(&ring.stop, 0);
+	ring.drops = 0;
+
+	error = pthread_create(&ring.writer, NULL, capture_writer, NULL);
+	if (error != 0) {
+		log_err("Could not start capture writer. %s (%d)",
+			strerror(error), error);
+		close(ring.fd);
+		return (-1);
+	}
+
+	capture_on = 1;
+	log_info("Capturing PDUs to %s", path);
+
+	return (0);
+}
+
+/*
+ * Stop capture. Whatever is in the ring is written out first.
+ */
+
+void
+capture_stop(void)
+{
+	if (!capture_on)
+		return;
+
+	capture_on = 0;
+
+	atomic_store(&ring.stop, 1);
+	pthread_join(ring.writer, NULL);
+	close(ring.fd);
+
+	log_info("Capture stopped, %u records dropped", ring.drops);
+}
+
+/*
+ * Copy bytes into the ring at given position
+ */
+
+static void
+capture_copy(uint64_t pos, void const *data, uint32_t len)
+{
+	uint32_t	off = pos & (CAPTURE_RING_SIZE - 1);
+	uint32_t	n = CAPTURE_RING_SIZE - off;
+
+	if (n > len)
+		n = len;
+
+	memcpy(ring.buf + off, data, n);
+	memcpy(ring.buf, (uint8_t const *) data + n, len - n);
+}
+
+/*
+ * Put PDU into the ring. Called by the server only if capture_on is set.
+ */
+
+void
+capture_pdu(int32_t recv, uint64_t peer, uint64_t local, uint16_t omtu,
+		uint8_t flags, struct iovec const *iov, int32_t iovcnt)
+{
+	struct capture_rec	rec;
+	struct capture_pkt	pkt;
+	struct timeval		tv;
+	uint64_t		head, tail;
+	uint32_t		len, i;
+
+	for (i = 0, len = sizeof(pkt); i < iovcnt; i ++)
+		len += iov[i].iov_len;
+
+	head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+
+	if (sizeof(rec) + len > CAPTURE_RING_SIZE - (head - tail)) {
+		ring.drops ++;
+		return;
+	}
+
+	gettimeofday(&tv, NULL);
+
+	be32enc(&rec.orig_len, len);
+	be32enc(&rec.incl_len, len);
+	be32enc(&rec.flags, recv? CAPTURE_FLAG_RECV : 0);
+	be32enc(&rec.drops, ring.drops);
+	be64enc(&rec.ts, CAPTURE_EPOCH +
+		(uint64_t) tv.tv_sec * 1000000 + tv.tv_usec);
+
+	be64enc(&pkt.peer, peer);
+	be64enc(&pkt.local, local);
+	be16enc(&pkt.omtu, omtu);
+	pkt.flags = flags;
+	pkt.reserved = 0;
+
+	capture_copy(head, &rec, sizeof(rec));
+	head += sizeof(rec);
+	capture_copy(head, &pkt, sizeof(pkt));
+	head += sizeof(pkt);
+
+	for (i = 0; i < iovcnt; i ++) {
+		capture_copy(head, iov[i].iov_base, iov[i].iov_len);
+		head += iov[i].iov_len;
+	}
+
+	atomic_store_explicit(&ring.head, head, memory_order_release);
+}
+
+/*
+ * Writer thread. Moves records from the ring to the file.
+ */
+
+static void *
+capture_writer(void *arg)
+{
+	struct timespec	ts = { 0, CAPTURE_WRITER_SLEEP * 1000000 };
+	uint64_t	head, tail;
+	uint32_t	off, n;
+	int32_t		size;
+
+	for (;;) {
+		head = atomic_load_explicit(&ring.head, memory_order_acquire);
+		tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+
+		if (head == tail) {
+			if (atomic_load(&ring.stop))
+				break;
+
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		off = tail & (CAPTURE_RING_SIZE - 1);
+		n = CAPTURE_RING_SIZE - off;
+		if (n > head - tail)
+			n = head - tail;
+
+		do {
+			size = write(ring.fd, ring.buf + off, n);
+		} while (size < 0 && errno == EINTR);
+
+		/* Can not write, throw it away so server is not stuck */
+		if (size <= 0)
+			size = n;
+
+		atomic_store_explicit(&ring.tail, tail + size,
+			memory_order_release);
+	}
+
+	return (NULL);
+}
@@ -0,0 +1,95 @@
+/*
+ * capture.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+/*
+ * PDU capture file. The file is in btsnoop format: file header followed
+ * by records, all fields are big-endian. Datalink type is private, every
+ * record carries capture_pkt header followed by the SDP PDU as it was
+ * received or sent.
+ */
+
+#define	CAPTURE_MAGIC		"btsnoop"	/* incl. '\0' */
+#define	CAPTURE_VERSION		1
+#define	CAPTURE_DATALINK	2001		/* sdpd PDU */
+
+/* Microseconds between 0000-01-01 and 1970-01-01 */
+#define	CAPTURE_EPOCH		0x00dcddb30f2f8000ULL
+
+struct capture_file
+{
+	uint8_t		magic[8];
+	uint32_t	version;
+	uint32_t	datalink;
+} __attribute__ ((packed));
+
+struct capture_rec
+{
+	uint32_t	orig_len;	/* original length */
+	uint32_t	incl_len;	/* included length */
+	uint32_t	flags;		/* CAPTURE_FLAG_xxx */
+	uint32_t	drops;		/* records dropped before */
+	uint64_t	ts;		/* usec since CAPTURE_EPOCH */
+} __attribute__ ((packed));
+
+#define	CAPTURE_FLAG_RECV	(1 << 0)	/* received, i.e. request */
+
+struct capture_pkt
+{
+	uint64_t	peer;		/* peer key (see peer.h) */
+	uint64_t	local;		/* local BD_ADDR (packed) */
+	uint16_t	omtu;		/* outgoing MTU */
+	uint8_t		flags;		/* CAPTURE_PKT_xxx */
+	uint8_t		reserved;
+} __attribute__ ((packed));
+
+#define	CAPTURE_PKT_CONTROL	(1 << 0)	/* control socket */
+#define	CAPTURE_PKT_PRIV	(1 << 1)	/* privileged client */
+
+/*
+ * Capture writer. PDUs are queued in a ring and written to the file by
+ * a separate thread, so capture does not block the server.
+ */
+
+#define	CAPTURE_RING_SIZE	(1 << 20)	/* bytes, power of 2 */
+#define	CAPTURE_WRITER_SLEEP	10		/* msec, when ring is empty */
+
+struct iovec;
+
+extern int32_t	capture_on;
+
+int32_t	capture_start	(char const *path);
+void	capture_stop	(void);
+void	capture_pdu	(int32_t recv, uint64_t peer, uint64_t local,
+			 uint16_t omtu, uint8_t flags,
+			 struct iovec const *iov, int32_t iovcnt);
+
+#endif /* ndef _CAPTURE_H_ */
@@ -0,0 +1,251 @@
+/*
+ * de.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <bluetooth.h>
+#include <sdp.h>
+#include <string.h>
+#include "de.h"
+#include "uuid-private.h"
+
+/*
+ * Request parameters
+ */
+
+#define	DE_END		0	/* end of request */
+#define	DE_HANDLE	1	/* value32 */
+#define	DE_LIMIT	2	/* value16, must not be 0 */
+#define	DE_UUID_SEQ	3	/* sequence of UUIDs */
+#define	DE_ATTR_SEQ	4	/* sequence of attribute ids and ranges */
+#define	DE_CS		5	/* continuation state */
+
+static uint8_t const	de_ss[] = {
+	DE_UUID_SEQ, DE_LIMIT, DE_CS, DE_END
+};
+static uint8_t const	de_sa[] = {
+	DE_HANDLE, DE_LIMIT, DE_ATTR_SEQ, DE_CS, DE_END
+};
+static uint8_t const	de_ssa[] = {
+	DE_UUID_SEQ, DE_LIMIT, DE_ATTR_SEQ, DE_CS, DE_END
+};
+
+/*
+ * Data elements. Size is payload size for plain elements and minus size
+ * of the length field for sequences. Class tells what sequence element
+ * may appear in.
+ */
+
+#define	DE_C_UUID	(1 << 0)
+#define	DE_C_ATTR	(1 << 1)
+
+struct de_type
+{
+	int8_t		size;
+	uint8_t		class;
+};
+
+static struct de_type const	de_types[256] = {
+	[SDP_DATA_UINT16]	= {  2, DE_C_ATTR },
+	[SDP_DATA_UINT32]	= {  4, DE_C_ATTR },
+	[SDP_DATA_UUID16]	= {  2, DE_C_UUID },
+	[SDP_DATA_UUID32]	= {  4, DE_C_UUID },
+	[SDP_DATA_UUID128]	= { 16, DE_C_UUID },
+	[SDP_DATA_SEQ8]		= { -1, 0 },
+	[SDP_DATA_SEQ16]	= { -2, 0 },
+	[SDP_DATA_SEQ32]	= { -4, 0 },
+};
+
+/*
+ * Check sequence of elements of given class. Returns number of elements
+ * or -1 if sequence is invalid or empty.
+ */
+
+static int32_t
+de_parse_seq(uint8_t const **ptr, uint8_t const *end, uint8_t class,
+		uint8_t const **seq, uint8_t const **seq_end)
+{
+	uint8_t const	*p = *ptr;
+	uint32_t	 len;
+	int32_t		 n, size;
+
+	if (p == end)
+		return (-1);
+
+	size = - de_types[*p ++].size;
+	if (size <= 0 || end - p < size)
+		return (-1);
+
+	for (len = 0; size > 0; size --)
+		len = (len << 8) | *p ++;
+
+	if (len == 0 || len > (uint32_t)(end - p))
+		return (-1);
+
+	*seq = p;
+	*seq_end = end = p + len;
+
+	for (n = 0; p < end; n ++) {
+		struct de_type const	*t = &de_types[*p ++];
+
+		if (!(t->class & class) || end - p < t->size)
+			return (-1);
+
+		p += t->size;
+	}
+
+	*ptr = p;
+
+	return (n);
+}
+
+/*
+ * Check request with given PDU ID and fill in request parameters.
+ * Returns 0 or SDP error code.
+ */
+
+int32_t
+de_parse(uint8_t pid, uint8_t const *req, uint8_t const *req_end,
+		de_req_p r)
+{
+	uint8_t const	*layout = NULL;
+	int32_t		 n;
+
+	switch (pid) {
+	case SDP_PDU_SERVICE_SEARCH_REQUEST:
+		layout = de_ss;
+		break;
+
+	case SDP_PDU_SERVICE_ATTRIBUTE_REQUEST:
+		layout = de_sa;
+		break;
+
+	case SDP_PDU_SERVICE_SEARCH_ATTRIBUTE_REQUEST:
+		layout = de_ssa;
+		break;
+
+	default:
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+		/* NOT REACHED */
+	}
+
+	memset(r, 0, sizeof(*r));
+
+	for (; *layout != DE_END; layout ++) {
+		switch (*layout) {
+		case DE_HANDLE:
+			if (req_end - req < 4)
+				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+			SDP_GET32(r->handle, req);
+			break;
+
+		case DE_LIMIT:
+			if (req_end - req < 2)
+				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+			SDP_GET16(r->limit, req);
+			if (r->limit <= 0)
+				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+			break;
+
+		case DE_UUID_SEQ:
+			n = de_parse_seq(&req, req_end, DE_C_UUID,
+					&r->ssp, &r->ssp_end);
+			if (n <= 0)
+				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+			r->nuuids = n;
+			break;
+
+		case DE_ATTR_SEQ:
+			n = de_parse_seq(&req, req_end, DE_C_ATTR,
+					&r->aid, &r->aid_end);
+			if (n <= 0)
+				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+			break;
+
+		case DE_CS:
+			if (req_end - req < 1)
+				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+			switch (*req ++) {
+			case 0:
+				r->cs = 0;
+				break;
+
+			case 2:
+				if (req_end - req != 2)
+					return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+				SDP_GET16(r->cs, req);
+				r->cslen = 2;
+				break;
+
+			default:
+				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+				/* NOT REACHED */
+			}
+			break;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Get next UUID from ServiceSearchPattern checked by de_parse()
+ */
+
+void
+de_get_uuid(uint8_t const **ptr, uint128_t *uuid)
+{
+	uint8_t const	*p = *ptr;
+
+	switch (*p ++) {
+	case SDP_DATA_UUID16:
+		memcpy(uuid, &uuid_base, sizeof(*uuid));
+		uuid->b[2] = *p ++;
+		uuid->b[3] = *p ++;
+		break;
+
+	case SDP_DATA_UUID32:
+		memcpy(uuid, &uuid_base, sizeof(*uuid));
+		uuid->b[0] = *p ++;
+		uuid->b[1] = *p ++;
+		uuid->b[2] = *p ++;
+		uuid->b[3] = *p ++;
+		break;
+
+	default:
+		memcpy(uuid->b, p, 16);
+		p += 16;
+		break;
+	}
+
+	*ptr = p;
+}
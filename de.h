@@ -0,0 +1,60 @@
+/*
+ * de.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _DE_H_
+#define _DE_H_
+
+/*
+ * SDP request decoder. Request parameters are described by a table and
+ * the whole request is checked in one pass before any of it is used.
+ * The result points into the request buffer, nothing is copied. Cost is
+ * linear in the request size, which is bounded by the MTU.
+ */
+
+struct de_req
+{
+	uint32_t		 handle;	/* ServiceRecordHandle */
+	int32_t			 limit;		/* Maximum*Count */
+	uint8_t const		*ssp;		/* ServiceSearchPattern */
+	uint8_t const		*ssp_end;
+	int32_t			 nuuids;	/* UUIDs in the pattern */
+	uint8_t const		*aid;		/* AttributeIDList */
+	uint8_t const		*aid_end;
+	int32_t			 cs;		/* ContinuationState */
+	int32_t			 cslen;		/* ContinuationState size */
+};
+
+typedef struct de_req	de_req_t;
+typedef struct de_req *	de_req_p;
+
+int32_t	de_parse	(uint8_t pid, uint8_t const *req,
+			 uint8_t const *req_end, de_req_p r);
+void	de_get_uuid	(uint8_t const **ptr, uint128_t *uuid);
+
+#endif /* ndef _DE_H_ */
@@ -0,0 +1,563 @@
+/*
+ * handoff.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sdp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "handoff.h"
+#include "lease.h"
+#include "log.h"
+#include "peer.h"
+#include "profile.h"
+#include "provider.h"
+#include "publish.h"
+#include "timer.h"
+#include "server.h"
+
+static int32_t	handoff_send		(server_p srv, int32_t sock);
+static int32_t	handoff_send_fd		(server_p srv, int32_t sock,
+					 int32_t fd);
+static int32_t	handoff_send_rec	(server_p srv, int32_t sock,
+					 provider_p provider);
+static int32_t	handoff_recv		(int32_t sock, void *buf,
+					 int32_t size, int32_t *fd);
+
+/* Handoff in progress in the new process */
+static struct handoff_hdr	hdr;
+static int32_t			hsock = -1;
+
+/*
+ * Start new copy of the server and hand everything over to it. argv is
+ * the command line the server was started with. Returns 0 if the new
+ * process has taken over and this one should exit, or -1 if this one
+ * should keep serving.
+ */
+
+int32_t
+handoff_exec(server_p srv, char * const *argv)
+{
+	struct timeval	  tv;
+	char		**args = NULL;
+	char		  fdstr[16];
+	int32_t		  s[2], size, argc, n;
+	pid_t		  pid;
+	char		  ack;
+
+	/* Same command line with -H (from the last handoff, if any) last */
+	for (argc = 0; argv[argc] != NULL; argc ++)
+		;
+
+	args = (char **) calloc(argc + 3, sizeof(args[0]));
+	if (args == NULL) {
+		log_err("Could not allocate handoff arguments");
+		return (-1);
+	}
+
+	for (argc = 0, n = 0; argv[argc] != NULL; argc ++) {
+		if (strcmp(argv[argc], "-H") == 0 && argv[argc + 1] != NULL) {
+			argc ++;
+			continue;
+		}
+
+		args[n ++] = argv[argc];
+	}
+
+	snprintf(fdstr, sizeof(fdstr), "%d", HANDOFF_FD);
+	args[n ++] = "-H";
+	args[n ++] = fdstr;
+	args[n] = NULL;
+
+	if (socketpair(PF_LOCAL, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, s) < 0) {
+		log_err("Could not create handoff socket. %s (%d)",
+			strerror(errno), errno);
+		free(args);
+		return (-1);
+	}
+
+	/* Descriptor and response buffers go as one message */
+	size = HANDOFF_BUFSIZE;
+	tv.tv_sec = HANDOFF_TIMEOUT;
+	tv.tv_usec = 0;
+
+	if (setsockopt(s[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0 ||
+	    setsockopt(s[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0 ||
+	    setsockopt(s[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0 ||
+	    setsockopt(s[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		log_err("Could not set up handoff socket. %s (%d)",
+			strerror(errno), errno);
+		close(s[0]);
+		close(s[1]);
+		free(args);
+		return (-1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		log_err("Could not fork new server. %s (%d)",
+			strerror(errno), errno);
+		close(s[0]);
+		close(s[1]);
+		free(args);
+		return (-1);
+	}
+
+	if (pid == 0) {
+		/* New process gets the handoff socket and nothing else */
+		if (s[1] == HANDOFF_FD)
+			fcntl(s[1], F_SETFD, 0);
+		else if (dup2(s[1], HANDOFF_FD) < 0)
+			_exit(127);
+
+		closefrom(HANDOFF_FD + 1);
+		execvp(args[0], args);
+		_exit(127);
+	}
+
+	close(s[1]);
+	free(args);
+
+	log_notice("Handing over to new server, pid %d", pid);
+
+	if (handoff_send(srv, s[0]) == 0) {
+		do {
+			n = recv(s[0], &ack, sizeof(ack), 0);
+		} while (n < 0 && errno == EINTR);
+
+		if (n == sizeof(ack)) {
+			close(s[0]);
+			log_notice("New server, pid %d, has taken over", pid);
+
+			/* New server publishes in place of our file */
+			publish_keep();
+
+			return (0);
+		}
+
+		if (n < 0)
+			log_err("Could not receive handoff reply. %s (%d)",
+				strerror(errno), errno);
+	}
+
+	log_err("Handoff to new server, pid %d, has failed. Still serving",
+		pid);
+
+	close(s[0]);
+	kill(pid, SIGKILL);
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+		;
+
+	return (-1);
+}
+
+/*
+ * Send server state: header, every descriptor in the index and every
+ * record
+ */
+
+static int32_t
+handoff_send(server_p srv, int32_t sock)
+{
+	provider_p	provider = NULL;
+	int32_t		fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HANDOFF_MAGIC, sizeof(hdr.magic));
+	hdr.version = HANDOFF_VERSION;
+	hdr.imtu = srv->imtu;
+	hdr.change_state = provider_get_change_state();
+	hdr.handle = provider_get_last_handle();
+	memcpy(hdr.stats, srv->stats, sizeof(srv->stats));
+
+	for (fd = 0; fd < srv->maxfd + 1; fd ++) {
+		if (!srv->fdidx[fd].valid)
+			continue;
+
+		/* Partially sent dump or event must not be cut in half */
+		if (srv->fdidx[fd].dump != NULL &&
+		    server_flush_dump(srv, fd, 1) < 0)
+			return (-1);
+		if (srv->fdidx[fd].events != NULL)
+			server_flush_events(srv, fd, 1);
+
+		hdr.nfds ++;
+	}
+
+	/* Service Discovery records belong to the server itself */
+	for (provider = provider_get_first();
+	     provider != NULL;
+	     provider = provider_get_next(provider))
+		if (provider->handle > 1)
+			hdr.nrecs ++;
+
+	if (send(sock, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		log_err("Could not send handoff header. %s (%d)",
+			strerror(errno), errno);
+		return (-1);
+	}
+
+	for (fd = 0; fd < srv->maxfd + 1; fd ++)
+		if (srv->fdidx[fd].valid &&
+		    handoff_send_fd(srv, sock, fd) < 0)
+			return (-1);
+
+	for (provider = provider_get_first();
+	     provider != NULL;
+	     provider = provider_get_next(provider))
+		if (provider->handle > 1 &&
+		    handoff_send_rec(srv, sock, provider) < 0)
+			return (-1);
+
+	return (0);
+}
+
+/*
+ * Send one descriptor with its state
+ */
+
+static int32_t
+handoff_send_fd(server_p srv, int32_t sock, int32_t fd)
+{
+	fd_idx_p		 idx = &srv->fdidx[fd];
+	struct handoff_fd	 h;
+	struct iovec		 iov[3];
+	struct msghdr		 msg;
+	struct cmsghdr		*cmsg = NULL;
+	union {
+		struct cmsghdr	 hdr;
+		uint8_t		 buf[CMSG_SPACE(sizeof(int))];
+	}			 ctl;
+	int32_t			 len;
+
+	memset(&h, 0, sizeof(h));
+	h.fd = fd;
+	h.flags = (idx->server? HANDOFF_FD_SERVER : 0) |
+		  (idx->control? HANDOFF_FD_CONTROL : 0) |
+		  (idx->priv? HANDOFF_FD_PRIV : 0) |
+		  (idx->events != NULL? HANDOFF_FD_EVENTS : 0);
+	h.omtu = idx->omtu;
+	h.ilen = idx->ilen;
+	h.rsp_size = idx->rsp_size;
+	h.rsp_limit = idx->rsp_limit;
+	h.rsp_cs = idx->rsp_cs;
+	h.local = idx->local;
+	h.key = (idx->peer != NULL)? idx->peer->key : 0;
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = idx->ibuf;
+	iov[1].iov_len = idx->ilen;
+	iov[2].iov_base = idx->rsp;
+	iov[2].iov_len = idx->rsp_size;
+
+	memset(&ctl, 0, sizeof(ctl));
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	do {
+		len = sendmsg(sock, &msg, 0);
+	} while (len < 0 && errno == EINTR);
+
+	if (len != sizeof(h) + h.ilen + h.rsp_size) {
+		log_err("Could not send descriptor %d. %s (%d)",
+			fd, strerror(errno), errno);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Send one record
+ */
+
+static int32_t
+handoff_send_rec(server_p srv, int32_t sock, provider_p provider)
+{
+	struct handoff_rec	h;
+	struct iovec		iov[2];
+	int32_t			len;
+
+	memset(&h, 0, sizeof(h));
+	h.handle = provider->handle;
+	h.fd = provider->fd;
+	h.ttl = lease_left(&srv->timers, provider->handle);
+	h.datalen = provider->datalen;
+	h.uuid = provider->profile->uuid;
+	memcpy(&h.bdaddr, &provider->bdaddr, sizeof(h.bdaddr));
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = provider->data;
+	iov[1].iov_len = provider->datalen;
+
+	do {
+		len = writev(sock, iov, 2);
+	} while (len < 0 && errno == EINTR);
+
+	if (len != sizeof(h) + h.datalen) {
+		log_err("Could not send record 0x%x. %s (%d)",
+			h.handle, strerror(errno), errno);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Receive handoff header and initialize server. Called in the new
+ * process before options are applied.
+ */
+
+int32_t
+handoff_init(server_p srv, int32_t sock)
+{
+	int32_t	len;
+
+	len = handoff_recv(sock, &hdr, sizeof(hdr), NULL);
+	if (len != (int32_t) sizeof(hdr) ||
+	    memcmp(hdr.magic, HANDOFF_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != HANDOFF_VERSION ||
+	    hdr.imtu > NG_L2CAP_MTU_MAXIMUM) {
+		log_crit("Could not receive handoff from old server");
+		return (-1);
+	}
+
+	if (server_init_handoff(srv, hdr.imtu) < 0)
+		return (-1);
+
+	memcpy(srv->stats, hdr.stats, sizeof(srv->stats));
+	hsock = sock;
+
+	return (0);
+}
+
+/*
+ * Receive descriptors and records, then tell the old process to go
+ */
+
+int32_t
+handoff_resume(server_p srv)
+{
+	struct handoff_fd	*h = NULL;
+	struct handoff_rec	*r = NULL;
+	profile_p		 profile = NULL;
+	int32_t			*fds = NULL;
+	uint8_t			*buf = NULL;
+	int32_t			 size, len, fd, owner, i;
+	char			 ack = 0;
+
+	size = sizeof(*h) + srv->imtu + NG_L2CAP_MTU_MAXIMUM;
+
+	buf = (uint8_t *) malloc(size);
+	fds = (int32_t *) malloc(FD_SETSIZE * sizeof(fds[0]));
+	if (buf == NULL || fds == NULL) {
+		log_crit("Could not allocate handoff buffers");
+		goto fail;
+	}
+
+	/* Descriptor numbers change, records refer to the old ones */
+	for (i = 0; i < FD_SETSIZE; i ++)
+		fds[i] = -1;
+
+	for (i = 0; i < hdr.nfds; i ++) {
+		h = (struct handoff_fd *) buf;
+
+		len = handoff_recv(hsock, buf, size, &fd);
+		if (len < (int32_t) sizeof(*h) || fd < 0 ||
+		    len != sizeof(*h) + h->ilen + h->rsp_size ||
+		    h->fd < 0 || h->fd >= FD_SETSIZE) {
+			log_crit("Could not receive descriptor from old " \
+				"server");
+			if (fd >= 0)
+				close(fd);
+			goto fail;
+		}
+
+		if (server_adopt_fd(srv, fd, h, (uint8_t *) (h + 1),
+				(uint8_t *) (h + 1) + h->ilen) < 0) {
+			log_crit("Could not take over descriptor %d", h->fd);
+			close(fd);
+			goto fail;
+		}
+
+		fds[h->fd] = fd;
+	}
+
+	for (i = 0; i < hdr.nrecs; i ++) {
+		r = (struct handoff_rec *) buf;
+
+		len = handoff_recv(hsock, buf, size, NULL);
+		if (len < (int32_t) sizeof(*r) ||
+		    len != sizeof(*r) + r->datalen) {
+			log_crit("Could not receive record from old server");
+			goto fail;
+		}
+
+		if (r->fd >= FD_SETSIZE || (r->fd >= 0 && fds[r->fd] < 0)) {
+			log_crit("Record 0x%x has unknown owner", r->handle);
+			goto fail;
+		}
+
+		owner = (r->fd >= 0)? fds[r->fd] : r->fd;
+
+		profile = profile_get_descriptor(r->uuid);
+		if (profile == NULL ||
+		    provider_restore(profile, &r->bdaddr, owner,
+				r->handle, (uint8_t const *) (r + 1),
+				r->datalen) == NULL) {
+			log_crit("Could not take over record 0x%x", r->handle);
+			goto fail;
+		}
+
+		if (r->ttl > 0 &&
+		    lease_set(&srv->timers, r->handle, r->ttl) < 0) {
+			log_crit("Could not take over lease of record 0x%x",
+				r->handle);
+			goto fail;
+		}
+	}
+
+	/* Clients see the same database, in the same state */
+	provider_set_change_state(hdr.change_state);
+	provider_set_last_handle(hdr.handle);
+	provider_set_notify(server_notify, srv);
+
+	/* Old server goes away on reply, be ready to serve */
+	server_warm_up(srv);
+
+	if (send(hsock, &ack, sizeof(ack), 0) != sizeof(ack)) {
+		log_crit("Could not send handoff reply. %s (%d)",
+			strerror(errno), errno);
+		goto fail;
+	}
+
+	log_notice("Took over %d descriptors and %d records from old server",
+		hdr.nfds, hdr.nrecs);
+
+	close(hsock);
+	hsock = -1;
+	free(fds);
+	free(buf);
+
+	return (0);
+fail:
+	close(hsock);
+	hsock = -1;
+	free(fds);
+	free(buf);
+
+	return (-1);
+}
+
+/*
+ * Receive one message and descriptor passed with it (if any). Returns
+ * message size or -1.
+ */
+
+static int32_t
+handoff_recv(int32_t sock, void *buf, int32_t size, int32_t *fd)
+{
+	struct iovec		 iov;
+	struct msghdr		 msg;
+	struct cmsghdr		*cmsg = NULL;
+	union {
+		struct cmsghdr	 hdr;
+		uint8_t		 buf[CMSG_SPACE(sizeof(int))];
+	}			 ctl;
+	int32_t			 len;
+
+	if (fd != NULL)
+		*fd = -1;
+
+	iov.iov_base = buf;
+	iov.iov_len = size;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	do {
+		len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0) {
+		log_crit("Could not receive handoff message. %s (%d)",
+			strerror(errno), errno);
+		return (-1);
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS ||
+		    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+			continue;
+
+		if (fd != NULL)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		else {
+			memcpy(&len, CMSG_DATA(cmsg), sizeof(int));
+			close(len);
+			return (-1);
+		}
+	}
+
+	if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+		if (fd != NULL && *fd >= 0)
+			close(*fd);
+
+		return (-1);
+	}
+
+	return (len);
+}
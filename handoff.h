@@ -0,0 +1,105 @@
+/*
+ * handoff.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+/*
+ * Handoff of the running server to a new process. On SIGHUP the server
+ * starts a new copy of itself with "-H fd", where fd is one end of a
+ * local SOCK_SEQPACKET socket pair, and sends it every descriptor in the
+ * index together with the service database. Descriptors go as
+ * SCM_RIGHTS, one message per descriptor. The new process answers with
+ * a single byte when it is ready to serve and the old one exits. If
+ * anything goes wrong the old process keeps serving.
+ *
+ * Messages are in host byte order, both ends are on the same machine.
+ *
+ *	handoff_hdr
+ *	handoff_fd	[ ibuf ] [ rsp ]	- nfds times
+ *	handoff_rec	data			- nrecs times
+ */
+
+#define	HANDOFF_MAGIC		"sdpdhand"	/* 8 bytes, no '\0' */
+#define	HANDOFF_VERSION		1
+#define	HANDOFF_FD		3		/* descriptor in new process */
+#define	HANDOFF_TIMEOUT		10		/* sec. to wait for new process */
+#define	HANDOFF_BUFSIZE		(256 * 1024)	/* socket buffers */
+#define	HANDOFF_STAT_MAX	32		/* >= SERVER_STAT_MAX */
+
+struct handoff_hdr
+{
+	uint8_t		magic[8];	/* HANDOFF_MAGIC */
+	uint32_t	version;	/* HANDOFF_VERSION */
+	uint32_t	imtu;		/* incoming MTU */
+	uint32_t	change_state;	/* database change state */
+	uint32_t	handle;		/* last record handle given out */
+	uint32_t	nfds;		/* number of descriptors */
+	uint32_t	nrecs;		/* number of records */
+	uint32_t	stats[HANDOFF_STAT_MAX]; /* statistics */
+};
+
+#define	HANDOFF_FD_SERVER	(1 << 0)	/* listening */
+#define	HANDOFF_FD_CONTROL	(1 << 1)	/* control socket */
+#define	HANDOFF_FD_PRIV		(1 << 2)	/* privileged */
+#define	HANDOFF_FD_EVENTS	(1 << 3)	/* subscribed to changes */
+
+struct handoff_fd
+{
+	int32_t		fd;		/* descriptor in old process */
+	uint32_t	flags;		/* HANDOFF_FD_xxx */
+	uint16_t	omtu;		/* outgoing MTU */
+	uint16_t	ilen;		/* incoming data size (control) */
+	uint16_t	rsp_size;	/* response size */
+	uint16_t	rsp_limit;	/* response limit */
+	uint16_t	rsp_cs;		/* response continuation state */
+	uint16_t	pad;
+	uint64_t	local;		/* local BD_ADDR (packed) */
+	uint64_t	key;		/* peer key */
+	/* ilen bytes of incoming data and rsp_size bytes of response follow */
+};
+
+struct handoff_rec
+{
+	uint32_t	handle;		/* record handle */
+	int32_t		fd;		/* owner in old process */
+	uint32_t	ttl;		/* lease left (sec), 0 - none */
+	uint32_t	datalen;	/* profile data size */
+	uint16_t	uuid;		/* profile UUID */
+	bdaddr_t	bdaddr;		/* provider's BD_ADDR */
+	/* profile data follows */
+};
+
+struct server;
+
+int32_t	handoff_exec	(struct server *srv, char * const *argv);
+int32_t	handoff_init	(struct server *srv, int32_t sock);
+int32_t	handoff_resume	(struct server *srv);
+
+#endif /* ndef _HANDOFF_H_ */
@@ -0,0 +1,152 @@
+/*
+ * lease.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <bluetooth.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "lease.h"
+#include "profile.h"
+#include "provider.h"
+#include "timer.h"
+
+struct lease
+{
+	uint32_t		 handle;	/* record handle */
+	struct timer		 timer;		/* expiry timer */
+	LIST_ENTRY(lease)	 lease_next;	/* leases in hash bucket */
+};
+
+typedef struct lease	lease_t;
+typedef struct lease *	lease_p;
+
+static LIST_HEAD(, lease)	leases[LEASE_HASH_SIZE];
+
+static timer_cb_t		lease_timeout;
+
+static lease_p
+lease_find(uint32_t handle)
+{
+	lease_p	lease = NULL;
+
+	LIST_FOREACH(lease, &leases[handle % LEASE_HASH_SIZE], lease_next)
+		if (lease->handle == handle)
+			break;
+
+	return (lease);
+}
+
+/*
+ * Set or renew lease of the record for ttl seconds. Zero ttl cancels
+ * the lease, so the record stays until its owner goes away.
+ */
+
+int32_t
+lease_set(struct timer_wheel *w, uint32_t handle, uint32_t ttl)
+{
+	lease_p	lease = lease_find(handle);
+
+	if (ttl == 0) {
+		lease_drop(w, handle);
+		return (0);
+	}
+
+	if (lease == NULL) {
+		lease = (lease_p) calloc(1, sizeof(*lease));
+		if (lease == NULL)
+			return (-1);
+
+		lease->handle = handle;
+		timer_init(&lease->timer, lease_timeout, w);
+
+		LIST_INSERT_HEAD(&leases[handle % LEASE_HASH_SIZE], lease,
+			lease_next);
+	}
+
+	timer_add(w, &lease->timer, ttl * 1000);
+
+	return (0);
+}
+
+/*
+ * Forget lease of the record. Called when the record goes away.
+ */
+
+void
+lease_drop(struct timer_wheel *w, uint32_t handle)
+{
+	lease_p	lease = lease_find(handle);
+
+	if (lease == NULL)
+		return;
+
+	timer_del(w, &lease->timer);
+	LIST_REMOVE(lease, lease_next);
+	free(lease);
+}
+
+/*
+ * Return seconds left on the lease of the record (rounded up) or 0 if
+ * the record has no lease
+ */
+
+uint32_t
+lease_left(struct timer_wheel *w, uint32_t handle)
+{
+	lease_p		lease = lease_find(handle);
+	uint64_t	ms;
+
+	if (lease == NULL || !lease->timer.pending ||
+	    lease->timer.expires <= w->now)
+		return (lease != NULL);
+
+	ms = (lease->timer.expires - w->now) * TIMER_TICK_MS;
+
+	return ((ms + 999) / 1000);
+}
+
+/*
+ * Lease has run out. Remove the record, that drops the lease as well.
+ */
+
+static void
+lease_timeout(timer_p t, void *arg)
+{
+	lease_p		lease = (lease_p) ((uint8_t *) t -
+				offsetof(lease_t, timer));
+	uint32_t	handle = lease->handle;
+	provider_p	provider = provider_by_handle(handle);
+
+	if (provider != NULL)
+		provider_unregister(provider);
+
+	/* Lease is gone if the server was told about the record */
+	lease_drop((struct timer_wheel *) arg, handle);
+}
@@ -29,6 +29,8 @@
  * $FreeBSD: head/usr.sbin/bluetooth/sdpd/main.c 124758 2004-01-20 20:48:26Z emax $
  */
 
+#include <sys/param.h>
+#include <sys/queue.h>
 #include <sys/select.h>
 #include <bluetooth.h>
 #include <errno.h>
@@ -40,22 +42,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "activate.h"
+#include "capture.h"
+#include "handoff.h"
 #include "log.h"
+#include "publish.h"
+#include "timer.h"
 #include "server.h"
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/queue.h>
 #include "profile.h"
 #include "provider.h"
+#include "replay.h"
 
 #define	SDPD			"sdpd"
 
 static int32_t 	drop_root	(char const *user, char const *group);
 static void	sighandler	(int32_t s);
+static void	sigcapture	(int32_t s);
+static void	sigreload	(int32_t s);
 static void	usage		(void);
 
 static int32_t	done;
+static int32_t	toggle;
+static int32_t	reload;
 
 /*
  * Bluetooth Service Discovery Procotol (SDP) daemon
@@ -65,13 +76,31 @@ int
 main(int argc, char *argv[])
 {
 	server_t		 server;
-	char const		*control = SDP_LOCAL_PATH;
+	char			 path[PATH_MAX];
+	char const		*control = SDP_LOCAL_PATH, *replay = NULL;
+	char const		*capture = NULL, *snapshot = NULL;
+	char const		*publish = NULL;
 	char const		*user = "nobody", *group = "nobody";
-	int32_t			 detach = 1, opt;
+	int32_t			 detach = 1, backlog = 10, opt;
+	int32_t			 control_idle = 0, l2cap_idle = SERVER_L2CAP_IDLE;
+	int32_t			 cs_idle = SERVER_CS_IDLE;
+	int32_t			 peer_rate = SERVER_PEER_RATE, loops = 1;
+	int32_t			 grace = SERVER_ORPHAN_GRACE, handoff = -1;
+	int32_t			 unsock = -1, l2sock = -1;
 	struct sigaction	 sa;
 
-	while ((opt = getopt(argc, argv, "c:dg:hu:")) != -1) {
+	while ((opt = getopt(argc, argv, "b:C:c:dg:H:hI:i:m:n:R:r:S:s:t:u:")) != -1) {
 		switch (opt) {
+		case 'b': /* listen backlog */
+			backlog = atoi(optarg);
+			if (backlog <= 0)
+				usage();
+			break;
+
+		case 'C': /* capture file */
+			capture = optarg;
+			break;
+
 		case 'c': /* control */
 			control = optarg;
 			break;
@@ -84,6 +113,60 @@ main(int argc, char *argv[])
 			group = optarg;
 			break;
 
+		case 'H': /* handoff from old server (internal) */
+			handoff = atoi(optarg);
+			if (handoff < 0)
+				usage();
+			break;
+
+		case 'I': /* control idle timeout */
+			control_idle = atoi(optarg);
+			if (control_idle < 0)
+				usage();
+			break;
+
+		case 'i': /* L2CAP idle timeout */
+			l2cap_idle = atoi(optarg);
+			if (l2cap_idle < 0)
+				usage();
+			break;
+
+		case 'm': /* publish service database */
+			publish = optarg;
+			break;
+
+		case 'n': /* replay passes */
+			loops = atoi(optarg);
+			if (loops <= 0)
+				usage();
+			break;
+
+		case 'R': /* replay capture file */
+			replay = optarg;
+			break;
+
+		case 'r': /* per-peer work rate */
+			peer_rate = atoi(optarg);
+			if (peer_rate < 0)
+				usage();
+			break;
+
+		case 'S': /* grace period for restored records */
+			grace = atoi(optarg);
+			if (grace < 0)
+				usage();
+			break;
+
+		case 's': /* service database snapshot */
+			snapshot = optarg;
+			break;
+
+		case 't': /* continuation state timeout */
+			cs_idle = atoi(optarg);
+			if (cs_idle < 0)
+				usage();
+			break;
+
 		case 'u': /* user */
 			user = optarg;
 			break;
@@ -95,10 +178,27 @@ main(int argc, char *argv[])
 		}
 	}
 
+	/* Replay runs in the foreground and does not touch any sockets */
+	if (replay != NULL) {
+		log_open(SDPD, 1);
+		opt = replay_run(replay, loops);
+		log_close();
+
+		return ((opt < 0)? 1 : 0);
+	}
+
+	/* New server is started from the same binary on SIGHUP */
+	if (strchr(argv[0], '/') != NULL && realpath(argv[0], path) != NULL)
+		argv[0] = path;
+
 	log_open(SDPD, !detach);
 
-	/* Become daemon if required */
-	if (detach && daemon(0, 0) < 0) {
+	/* Service manager may have opened the sockets, check before fork */
+	if (handoff < 0 && activate_listen_fds(&unsock, &l2sock) < 0)
+		exit(1);
+
+	/* Become daemon if required. Old server has done it on handoff */
+	if (detach && handoff < 0 && daemon(0, 0) < 0) {
 		log_crit("Could not become daemon. %s (%d)",
 			strerror(errno), errno);
 		exit(1);
@@ -109,13 +209,26 @@ main(int argc, char *argv[])
 	sa.sa_handler = sighandler;
 
 	if (sigaction(SIGTERM, &sa, NULL) < 0 ||
-	    sigaction(SIGHUP,  &sa, NULL) < 0 ||
 	    sigaction(SIGINT,  &sa, NULL) < 0) {
 		log_crit("Could not install signal handlers. %s (%d)",
 			strerror(errno), errno); 
 		exit(1);
 	}
 
+	sa.sa_handler = sigreload;
+	if (sigaction(SIGHUP, &sa, NULL) < 0) {
+		log_crit("Could not install signal handlers. %s (%d)",
+			strerror(errno), errno); 
+		exit(1);
+	}
+
+	sa.sa_handler = sigcapture;
+	if (capture != NULL && sigaction(SIGUSR1, &sa, NULL) < 0) {
+		log_crit("Could not install signal handlers. %s (%d)",
+			strerror(errno), errno); 
+		exit(1);
+	}
+
 	sa.sa_handler = SIG_IGN;
 	if (sigaction(SIGPIPE, &sa, NULL) < 0) {
 		log_crit("Could not install signal handlers. %s (%d)",
@@ -123,18 +236,60 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	/* Initialize server */
-	if (server_init(&server, control) < 0)
+	/* Initialize server, or take it over from the old one */
+	if (handoff >= 0)
+		opt = handoff_init(&server, handoff);
+	else
+		opt = server_init(&server, control, backlog, unsock, l2sock);
+	if (opt < 0)
 		exit(1);
 
+	server.control_idle = control_idle;
+	server.l2cap_idle = l2cap_idle;
+	server.cs_idle = cs_idle;
+	server.peer_rate = peer_rate;
+	server.peer_burst = peer_rate * (SERVER_PEER_BURST / SERVER_PEER_RATE);
+
 	if ((user != NULL || group != NULL) && drop_root(user, group) < 0)
 		exit(1);
 
+	if (handoff >= 0 && handoff_resume(&server) < 0)
+		exit(1);
+
+	if (snapshot != NULL && server_restore(&server, snapshot, grace) < 0)
+		exit(1);
+
+	/* Handed over server has warmed up before the old one went away */
+	if (handoff < 0)
+		server_warm_up(&server);
+
+	if (publish != NULL && publish_open(publish) < 0)
+		exit(1);
+
+	activate_ready();
+
 	for (done = 0; !done; ) {
 		if (server_do(&server) != 0)
 			done ++;
+
+		if (toggle) {
+			toggle = 0;
+
+			if (capture_on)
+				capture_stop();
+			else
+				capture_start(capture);
+		}
+
+		if (reload) {
+			reload = 0;
+
+			if (handoff_exec(&server, argv) == 0)
+				done ++;
+		}
 	}
 
+	capture_stop();
 	server_shutdown(&server);
 	log_close();
 
@@ -214,6 +369,26 @@ sighandler(int32_t s)
 		s, ++ done);
 }
 
+/*
+ * SIGUSR1 starts and stops PDU capture
+ */
+
+static void
+sigcapture(int32_t s)
+{
+	toggle = 1;
+}
+
+/*
+ * SIGHUP hands the server over to a new process
+ */
+
+static void
+sigreload(int32_t s)
+{
+	reload = 1;
+}
+
 /*
  * Display usage information and quit
  */
@@ -224,12 +399,25 @@ usage(void)
 	fprintf(stderr,
 "Usage: %s [options]\n" \
 "Where options are:\n" \
+"	-b num	specify listen backlog (default 10)\n" \
+"	-C file	capture PDUs to file, toggled with SIGUSR1\n" \
 "	-c	specify control socket name (default %s)\n" \
 "	-d	do not detach (run in foreground)\n" \
 "	-g grp	specify group\n" \
+"	-H fd	take over from old server (used on SIGHUP)\n" \
 "	-h	display usage and exit\n" \
+"	-I sec	control connection idle timeout (default 0 - none)\n" \
+"	-i sec	L2CAP connection idle timeout (default %d)\n" \
+"	-m file	publish service database for local readers in file\n" \
+"	-n num	replay capture num times (default 1)\n" \
+"	-R file	replay capture file and print statistics\n" \
+"	-r num	per-peer work units per second (default %d, 0 - no limit)\n" \
+"	-S sec	keep restored records for sec seconds (default %d)\n" \
+"	-s file	keep service database snapshot in file\n" \
+"	-t sec	continuation state timeout (default %d)\n" \
 "	-u usr	specify user\n",
-		SDPD, SDP_LOCAL_PATH);
+		SDPD, SDP_LOCAL_PATH, SERVER_L2CAP_IDLE, SERVER_PEER_RATE,
+		SERVER_ORPHAN_GRACE, SERVER_CS_IDLE);
 	exit(255);
 }
 
@@ -0,0 +1,138 @@
+/*
+ * match.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include "match.h"
+
+#if defined(__amd64__) || defined(__x86_64__) || defined(__i386__)
+#define	MATCH_X86	1
+#include <immintrin.h>
+#endif
+
+typedef int32_t	(match_u32_t)(uint32_t const *col, int32_t from, int32_t n,
+			uint32_t value);
+
+static match_u32_t	match_u32_scalar;
+static match_u32_t	match_u32_init;
+#ifdef MATCH_X86
+static match_u32_t	match_u32_sse2;
+static match_u32_t	match_u32_avx2;
+#endif
+
+static match_u32_t	*match_u32_impl = match_u32_init;
+
+/*
+ * Find first element equal to the value, starting at from. Returns n
+ * if there is no such element.
+ */
+
+int32_t
+match_u32(uint32_t const *col, int32_t from, int32_t n, uint32_t value)
+{
+	return ((*match_u32_impl)(col, from, n, value));
+}
+
+/*
+ * Pick implementation according to the CPU
+ */
+
+void
+match_init(void)
+{
+	match_u32_impl = match_u32_scalar;
+
+#ifdef MATCH_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		match_u32_impl = match_u32_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		match_u32_impl = match_u32_sse2;
+#endif
+}
+
+/*
+ * Pick implementation on the first call if match_init() was not called
+ */
+
+static int32_t
+match_u32_init(uint32_t const *col, int32_t from, int32_t n, uint32_t value)
+{
+	match_init();
+
+	return ((*match_u32_impl)(col, from, n, value));
+}
+
+static int32_t
+match_u32_scalar(uint32_t const *col, int32_t from, int32_t n, uint32_t value)
+{
+	for (; from < n; from ++)
+		if (col[from] == value)
+			break;
+
+	return (from);
+}
+
+#ifdef MATCH_X86
+__attribute__((target("sse2")))
+static int32_t
+match_u32_sse2(uint32_t const *col, int32_t from, int32_t n, uint32_t value)
+{
+	__m128i	v = _mm_set1_epi32(value);
+	int32_t	mask;
+
+	for (; from + 4 <= n; from += 4) {
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v,
+			_mm_loadu_si128((__m128i const *) (col + from)))));
+		if (mask != 0)
+			return (from + __builtin_ctz(mask));
+	}
+
+	return (match_u32_scalar(col, from, n, value));
+}
+
+__attribute__((target("avx2")))
+static int32_t
+match_u32_avx2(uint32_t const *col, int32_t from, int32_t n, uint32_t value)
+{
+	__m256i	v = _mm256_set1_epi32(value);
+	int32_t	mask;
+
+	for (; from + 8 <= n; from += 8) {
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpeq_epi32(v, _mm256_loadu_si256(
+				(__m256i const *) (col + from)))));
+		if (mask != 0)
+			return (from + __builtin_ctz(mask));
+	}
+
+	return (match_u32_scalar(col, from, n, value));
+}
+#endif
+
@@ -0,0 +1,176 @@
+/*
+ * peer.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "peer.h"
+#include "timer.h"
+
+static LIST_HEAD(, peer)	peers[PEER_HASH_SIZE];
+static LIST_HEAD(, peer)	idle = LIST_HEAD_INITIALIZER(idle);
+
+#define	peer_hash(key)	\
+	(((key) ^ ((key) >> 16) ^ ((key) >> 32)) % PEER_HASH_SIZE)
+
+/*
+ * Find peer by the key and take a reference. New peers start with a
+ * full bucket, idle peers keep what they had left.
+ */
+
+peer_p
+peer_get(uint64_t key, int32_t burst)
+{
+	peer_p	peer = NULL;
+
+	LIST_FOREACH(peer, &peers[peer_hash(key)], peer_next)
+		if (peer->key == key)
+			break;
+
+	if (peer == NULL) {
+		peer = (peer_p) calloc(1, sizeof(*peer));
+		if (peer == NULL)
+			return (NULL);
+
+		peer->key = key;
+		peer->tokens = burst;
+		peer->stamp = timer_now();
+
+		LIST_INSERT_HEAD(&peers[peer_hash(key)], peer, peer_next);
+	} else if (peer->refs == 0)
+		LIST_REMOVE(peer, idle_next);
+
+	peer->refs ++;
+
+	return (peer);
+}
+
+/*
+ * Drop reference. Peer that is still in debt or below the burst stays
+ * idle until the bucket would be full again, peer with a full bucket is
+ * forgotten with its last connection.
+ */
+
+void
+peer_put(peer_p peer, int32_t rate, int32_t burst)
+{
+	int64_t	ms;
+
+	assert(peer->refs > 0);
+
+	if (-- peer->refs > 0)
+		return;
+
+	if (rate > 0) {
+		peer_wait(peer, rate, burst);
+
+		if (peer->tokens < burst) {
+			ms = ((int64_t) burst - peer->tokens) * 1000 / rate;
+			peer->expires = peer->stamp + ms / TIMER_TICK_MS + 1;
+			LIST_INSERT_HEAD(&idle, peer, idle_next);
+			return;
+		}
+	}
+
+	LIST_REMOVE(peer, peer_next);
+	free(peer);
+}
+
+/*
+ * Free idle peers whose bucket is full again. Returns number of peers
+ * freed.
+ */
+
+int32_t
+peer_expire(void)
+{
+	peer_p		peer = NULL, peer_next = NULL;
+	uint64_t	now = timer_now();
+	int32_t		n = 0;
+
+	for (peer = LIST_FIRST(&idle); peer != NULL; peer = peer_next) {
+		peer_next = LIST_NEXT(peer, idle_next);
+
+		if (peer->expires > now)
+			continue;
+
+		LIST_REMOVE(peer, idle_next);
+		LIST_REMOVE(peer, peer_next);
+		free(peer);
+		n ++;
+	}
+
+	return (n);
+}
+
+/*
+ * Refill the bucket and return number of milliseconds the peer has to
+ * wait until it can be served again (0 - can be served now)
+ */
+
+int32_t
+peer_wait(peer_p peer, int32_t rate, int32_t burst)
+{
+	uint64_t	now = timer_now();
+	int64_t		add;
+
+	assert(rate > 0);
+
+	/* Keep the stamp until at least one unit is earned */
+	add = (int64_t) (now - peer->stamp) * TIMER_TICK_MS * rate / 1000;
+	if (add > 0) {
+		add += peer->tokens;
+		peer->tokens = (add > burst)? burst : add;
+		peer->stamp = now;
+	}
+
+	if (peer->tokens > 0)
+		return (0);
+
+	return (((1 - (int64_t) peer->tokens) * 1000 + rate - 1) / rate);
+}
+
+/*
+ * Charge peer for the work done. Bucket may go negative, the debt is
+ * paid by waiting.
+ */
+
+void
+peer_charge(peer_p peer, uint32_t units)
+{
+	if (units > INT32_MAX / 2)
+		units = INT32_MAX / 2;
+
+	if (peer->tokens < INT32_MIN / 2 + (int32_t) units)
+		peer->tokens = INT32_MIN / 2;
+	else
+		peer->tokens -= units;
+}
+
@@ -0,0 +1,76 @@
+/*
+ * peer.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PEER_H_
+#define _PEER_H_
+
+/*
+ * Per-peer request accounting. A peer is a remote BD_ADDR on L2CAP or
+ * a user id on the control socket, so one device (or user) gets one
+ * budget no matter how many connections it opens.
+ *
+ * Work is counted in units: one per request, one per attribute encoded
+ * and one per PEER_UNIT_BYTES bytes of response produced. Every peer
+ * has a token bucket that is refilled at "rate" units per second up to
+ * "burst" units. A peer that went below zero is not served until the
+ * bucket is positive again.
+ *
+ * A peer outlives its last connection until its bucket is full again,
+ * so reconnecting does not buy a fresh burst. Such idle peers are
+ * freed by peer_expire().
+ */
+
+#define	PEER_HASH_SIZE		64
+#define	PEER_UNIT_BYTES		64
+
+#define	PEER_KEY_UID		(1ULL << 63)	/* key is a uid */
+
+struct peer
+{
+	uint64_t		 key;		/* BD_ADDR or uid */
+	int32_t			 refs;		/* connections */
+	int32_t			 tokens;	/* work units left */
+	uint64_t		 stamp;		/* last refill tick */
+	uint32_t		 pass;		/* last served in this pass */
+	uint64_t		 expires;	/* idle until this tick */
+	LIST_ENTRY(peer)	 peer_next;	/* peers in the bucket */
+	LIST_ENTRY(peer)	 idle_next;	/* peers without connections */
+};
+
+typedef struct peer	peer_t;
+typedef struct peer *	peer_p;
+
+peer_p	peer_get	(uint64_t key, int32_t burst);
+void	peer_put	(peer_p peer, int32_t rate, int32_t burst);
+int32_t	peer_wait	(peer_p peer, int32_t rate, int32_t burst);
+void	peer_charge	(peer_p peer, uint32_t units);
+int32_t	peer_expire	(void);
+
+#endif /* ndef _PEER_H_ */
+
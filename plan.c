@@ -0,0 +1,303 @@
+/*
+ * plan.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <bluetooth.h>
+#include <sdp.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plan.h"
+#include "profile.h"
+
+static plan_t	cache[PLAN_CACHE_SIZE];
+static int32_t	cache_next = 0;
+static plan_t	scratch;	/* for lists that are too long to cache */
+
+static uint32_t
+plan_hash(uint8_t const *p, int32_t len)
+{
+	uint32_t	h = 2166136261U;
+
+	while (len -- > 0)
+		h = (h ^ *p ++) * 16777619U;
+
+	return (h);
+}
+
+static int
+plan_range_cmp(void const *a, void const *b)
+{
+	return (((struct plan_range const *) a)->lo -
+		((struct plan_range const *) b)->lo);
+}
+
+/*
+ * Sort ranges and merge overlapping and adjacent ones. Returns number of
+ * ranges left.
+ */
+
+static int32_t
+plan_merge(struct plan_range *r, int32_t n)
+{
+	int32_t	i, m;
+
+	/* Lists are supposed to be sorted, but do not count on it */
+	qsort(r, n, sizeof(r[0]), plan_range_cmp);
+
+	for (i = 1, m = (n > 0); i < n; i ++) {
+		if (r[i].lo <= r[m - 1].hi + 1) {
+			if (r[i].hi > r[m - 1].hi)
+				r[m - 1].hi = r[i].hi;
+		} else
+			r[m ++] = r[i];
+	}
+
+	return (m);
+}
+
+/*
+ * Parse AttributeIDList into plan. Returns 0 on success, -1 otherwise.
+ * List that does not fit PLAN_RANGES_MAX ranges even after merge is
+ * only checked, plan_has() then walks the list itself.
+ *
+ * uint16 value16	- 3 bytes (attribute)
+ * uint32 value32	- 5 bytes (range of attributes)
+ */
+
+static int32_t
+plan_compile(plan_p plan, uint8_t const *req, uint8_t const *req_end)
+{
+	struct plan_range	*r = plan->ranges;
+	uint8_t const		*list = req;
+	int32_t			 type, lo, hi, n, full;
+
+	for (n = 0, full = 0; req < req_end; ) {
+		SDP_GET8(type, req);
+
+		switch (type) {
+		case SDP_DATA_UINT16:
+			if (req + 2 > req_end)
+				return (-1);
+
+			SDP_GET16(lo, req);
+			hi = lo;
+			break;
+
+		case SDP_DATA_UINT32:
+			if (req + 4 > req_end)
+				return (-1);
+
+			SDP_GET16(lo, req);
+			SDP_GET16(hi, req);
+			break;
+
+		default:
+			return (-1);
+			/* NOT REACHED */
+		}
+
+		if (lo > hi || full)
+			continue;
+
+		/* Merge right away with the previous range if possible */
+		if (n > 0 && lo >= r[n - 1].lo && lo <= r[n - 1].hi + 1) {
+			if (hi > r[n - 1].hi)
+				r[n - 1].hi = hi;
+			continue;
+		}
+
+		if (n == PLAN_RANGES_MAX)
+			n = plan_merge(r, n);
+		if (n == PLAN_RANGES_MAX) {
+			full = 1;
+			continue;
+		}
+
+		r[n].lo = lo;
+		r[n].hi = hi;
+		n ++;
+	}
+
+	if (full) {
+		plan->list = list;
+		plan->list_end = req_end;
+		plan->nranges = 0;
+	} else {
+		plan->list = plan->list_end = NULL;
+		plan->nranges = plan_merge(r, n);
+	}
+
+	plan->nviews = 0;
+	plan->next = 0;
+
+	return (0);
+}
+
+/*
+ * Get compiled AttributeIDList. Returns NULL if list is invalid. The
+ * plan is valid until the next call.
+ */
+
+plan_p
+plan_get(uint8_t const *req, uint8_t const *req_end)
+{
+	plan_p		plan = NULL;
+	int32_t		len = req_end - req, i;
+	uint32_t	hash;
+
+	if (len > PLAN_RAW_MAX) {
+		if (plan_compile(&scratch, req, req_end) < 0)
+			return (NULL);
+
+		return (&scratch);
+	}
+
+	hash = plan_hash(req, len);
+
+	for (i = 0; i < PLAN_CACHE_SIZE; i ++) {
+		plan = &cache[i];
+
+		if (plan->hash == hash && plan->rawlen == len &&
+		    memcmp(plan->raw, req, len) == 0)
+			return (plan);
+	}
+
+	plan = &cache[cache_next];
+	plan->hash = 0; /* in case it does not compile */
+	plan->rawlen = 0;
+
+	if (plan_compile(plan, req, req_end) < 0)
+		return (NULL);
+
+	plan->hash = hash;
+	plan->rawlen = len;
+	memcpy(plan->raw, req, len);
+
+	cache_next = (cache_next + 1) % PLAN_CACHE_SIZE;
+
+	return (plan);
+}
+
+/*
+ * Check if attribute is in the raw list. The list was checked by
+ * plan_compile().
+ */
+
+static int32_t
+plan_has_list(plan_p plan, uint16_t attr)
+{
+	uint8_t const	*req = plan->list;
+	int32_t		 type, first, last;
+
+	while (req < plan->list_end) {
+		SDP_GET8(type, req);
+		SDP_GET16(first, req);
+		last = first;
+		if (type == SDP_DATA_UINT32)
+			SDP_GET16(last, req);
+
+		if (first <= attr && attr <= last)
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Check if attribute is in the plan
+ */
+
+int32_t
+plan_has(plan_p plan, uint16_t attr)
+{
+	int32_t	lo, hi, i;
+
+	if (plan->list != NULL)
+		return (plan_has_list(plan, attr));
+
+	for (lo = 0, hi = plan->nranges - 1; lo <= hi; ) {
+		i = (lo + hi) / 2;
+
+		if (attr < plan->ranges[i].lo)
+			hi = i - 1;
+		else if (attr > plan->ranges[i].hi)
+			lo = i + 1;
+		else
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Get attributes of the profile selected by the plan. Returns NULL if
+ * profile has too many attributes, caller should use plan_has() then.
+ */
+
+plan_view_p
+plan_view(plan_p plan, profile_p profile)
+{
+	attr_t const	*attrs = profile->attrs;
+	plan_view_p	 view = NULL;
+	int32_t		 i, j;
+	uint8_t		 a;
+
+	for (i = 0; i < plan->nviews; i ++)
+		if (plan->views[i].profile == profile)
+			return (&plan->views[i]);
+
+	for (i = 0; attrs[i].create != NULL; i ++)
+		if (i == PLAN_ATTRS_MAX)
+			return (NULL);
+
+	if (plan->nviews < PLAN_PROFILES)
+		view = &plan->views[plan->nviews ++];
+	else {
+		view = &plan->views[plan->next];
+		plan->next = (plan->next + 1) % PLAN_PROFILES;
+	}
+
+	view->profile = profile;
+	view->n = 0;
+
+	for (i = 0; attrs[i].create != NULL; i ++) {
+		if (!plan_has(plan, attrs[i].attr))
+			continue;
+
+		/* Keep attributes sorted by id */
+		for (j = view->n ++, a = i;
+		     j > 0 && attrs[view->attrs[j - 1]].attr > attrs[a].attr;
+		     j --)
+			view->attrs[j] = view->attrs[j - 1];
+
+		view->attrs[j] = a;
+	}
+
+	return (view);
+}
+
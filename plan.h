@@ -0,0 +1,92 @@
+/*
+ * plan.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PLAN_H_
+#define _PLAN_H_
+
+/*
+ * Compiled AttributeIDList. The list is parsed once into sorted and
+ * merged ranges. Compiled lists are cached by the raw bytes of the list,
+ * so clients that send the same list over and over do not get it parsed
+ * again. For every profile the list is used with, the plan also keeps
+ * the profile attributes that fall into the list, sorted by attribute
+ * id, so selecting attributes of a record is a lookup.
+ *
+ * List with more than PLAN_RANGES_MAX disjoint ranges is never cached.
+ * Its plan points to the list in the request and is only good while
+ * the request is being served.
+ */
+
+#define	PLAN_CACHE_SIZE		16	/* plans in the cache */
+#define	PLAN_RAW_MAX		64	/* longest list that is cached */
+#define	PLAN_RANGES_MAX		256	/* max. ranges after merge */
+#define	PLAN_PROFILES		8	/* profiles per plan */
+#define	PLAN_ATTRS_MAX		32	/* max. attributes per profile */
+
+struct profile;
+
+struct plan_range
+{
+	uint16_t		 lo;		/* first attribute */
+	uint16_t		 hi;		/* last attribute */
+};
+
+struct plan_view
+{
+	struct profile		*profile;	/* profile */
+	int32_t			 n;		/* number of attributes */
+	uint8_t			 attrs[PLAN_ATTRS_MAX]; /* index in profile */
+};
+
+typedef struct plan_view	plan_view_t;
+typedef struct plan_view *	plan_view_p;
+
+struct plan
+{
+	uint32_t		 hash;		/* hash of the raw list */
+	uint16_t		 rawlen;	/* raw list size */
+	uint8_t			 raw[PLAN_RAW_MAX]; /* raw list */
+	uint8_t const		*list;		/* raw list if too many ranges */
+	uint8_t const		*list_end;	/* end of the raw list */
+	int32_t			 nranges;	/* number of ranges */
+	struct plan_range	 ranges[PLAN_RANGES_MAX];
+	int32_t			 nviews;	/* number of views */
+	int32_t			 next;		/* view to replace next */
+	plan_view_t		 views[PLAN_PROFILES];
+};
+
+typedef struct plan	plan_t;
+typedef struct plan *	plan_p;
+
+plan_p		plan_get	(uint8_t const *req, uint8_t const *req_end);
+plan_view_p	plan_view	(plan_p plan, struct profile *profile);
+int32_t		plan_has	(plan_p plan, uint16_t attr);
+
+#endif /* ndef _PLAN_H_ */
+
@@ -0,0 +1,68 @@
+/*
+ * probes.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Static tracepoints. Build with -DSDPD_USDT to get USDT probes of the
+ * "sdpd" provider (see sdpd.d), otherwise probes compile to nothing.
+ * With systemtap's <sys/sdt.h> (Linux) no extra step is needed, with
+ * DTrace the objects must be run through "dtrace -G -s sdpd.d" before
+ * linking.
+ *
+ * SDPD_PROBE_ENABLED is a constant, so arguments that are costly to get
+ * (i.e. timestamps) can be skipped when probes are compiled out. Probes
+ * that are compiled out do not evaluate their arguments.
+ */
+
+#ifdef SDPD_USDT
+#include <sys/sdt.h>
+
+#define	SDPD_PROBE_ENABLED		1
+#define	SDPD_PROBE1(n, a)		DTRACE_PROBE1(sdpd, n, a)
+#define	SDPD_PROBE2(n, a, b)		DTRACE_PROBE2(sdpd, n, a, b)
+#define	SDPD_PROBE3(n, a, b, c)		DTRACE_PROBE3(sdpd, n, a, b, c)
+#define	SDPD_PROBE4(n, a, b, c, d)	DTRACE_PROBE4(sdpd, n, a, b, c, d)
+#define	SDPD_PROBE5(n, a, b, c, d, e)	DTRACE_PROBE5(sdpd, n, a, b, c, d, e)
+#else
+#define	SDPD_PROBE_ENABLED		0
+#define	SDPD_PROBE1(n, a) \
+	do { (void) sizeof(a); } while (0)
+#define	SDPD_PROBE2(n, a, b) \
+	do { (void) sizeof((a) + (b)); } while (0)
+#define	SDPD_PROBE3(n, a, b, c) \
+	do { (void) sizeof((a) + (b) + (c)); } while (0)
+#define	SDPD_PROBE4(n, a, b, c, d) \
+	do { (void) sizeof((a) + (b) + (c) + (d)); } while (0)
+#define	SDPD_PROBE5(n, a, b, c, d, e) \
+	do { (void) sizeof((a) + (b) + (c) + (d) + (e)); } while (0)
+#endif /* SDPD_USDT */
+
+#endif /* ndef _PROBES_H_ */
@@ -31,15 +31,432 @@
 
 #include <sys/queue.h>
 #include <bluetooth.h>
+#include <sdp.h>
 #include <string.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include "arena.h"
+#include "match.h"
+#include "probes.h"
 #include "profile.h"
 #include "provider.h"
+#include "uuid-private.h"
 
 static TAILQ_HEAD(, provider)	providers = TAILQ_HEAD_INITIALIZER(providers);
+static provider_view_t		view_any = {
+	PROVIDER_KEY_ANY,
+	TAILQ_HEAD_INITIALIZER(view_any.providers),
+};
+static LIST_HEAD(, provider_view) views = LIST_HEAD_INITIALIZER(views);
+
+/*
+ * Provider table. Slot is live when its generation is odd. Free slots
+ * are linked through the "next" array. Published slots are hashed by
+ * record handle, slots with the same hash are linked through the
+ * "hnext" array.
+ */
+
+static struct {
+	provider_p	*chunks;	/* chunks of providers */
+	int32_t		 nchunks;	/* number of chunks */
+	int32_t		 nslots;	/* slots ever used */
+	int32_t		 free;		/* first free slot or -1 */
+	int32_t		*next;		/* next free slot */
+	uint32_t	*gen;		/* slot generation */
+	uint32_t	*handle;	/* record handle */
+	uint32_t	*uuid;		/* profile UUID id */
+	uint64_t	*key;		/* packed BDADDR */
+	int32_t		*hnext;		/* next slot with the same hash */
+	int32_t		*buckets;	/* first slot by handle hash */
+	int32_t		 nbuckets;	/* number of hash buckets */
+} table = { NULL, 0, 0, -1, };
+
+#define	PROVIDER_UNHASHED	(-2)	/* slot is not in the hash */
+
+#define	provider_slot(s) \
+	(&table.chunks[(s) >> PROVIDER_CHUNK_SHIFT][(s) & PROVIDER_CHUNK_MASK])
+#define	provider_live(s) \
+	(table.gen[(s)] & 1)
+#define	provider_bucket(h) \
+	(table.buckets[(h) % table.nbuckets])
+
+/* Where profile data lives depends only on its size */
+#define	provider_data_inline(len) \
+	((len) <= PROVIDER_INLINE_SIZE)
+#define	provider_data_arena(len) \
+	(!provider_data_inline(len) && (len) <= ARENA_MAX_SIZE)
+
+static uint32_t			records = 0;
+static uint32_t			data_bytes = 0;
+
+static void	provider_data_free	(provider_p provider);
+
+/*
+ * Make one hash bucket per slot and hash published slots again
+ */
+
+static int32_t
+provider_rehash(int32_t n)
+{
+	int32_t	*buckets = NULL;
+	int32_t	 slot;
+
+	buckets = realloc(table.buckets, n * sizeof(buckets[0]));
+	if (buckets == NULL)
+		return (-1);
+
+	table.buckets = buckets;
+	table.nbuckets = n;
+
+	for (slot = 0; slot < n; slot ++)
+		buckets[slot] = -1;
+
+	for (slot = 0; slot < table.nslots; slot ++) {
+		if (table.hnext[slot] == PROVIDER_UNHASHED)
+			continue;
+
+		table.hnext[slot] = provider_bucket(table.handle[slot]);
+		provider_bucket(table.handle[slot]) = slot;
+	}
+
+	return (0);
+}
+
+/*
+ * Add one more chunk to the provider table
+ */
+
+static int32_t
+provider_grow(void)
+{
+	provider_p	*chunks = NULL;
+	int32_t		 n = (table.nchunks + 1) * PROVIDER_CHUNK_SIZE;
+	void		*p = NULL;
+
+#define	provider_grow_array(a) \
+	do { \
+		if ((p = realloc(table.a, n * sizeof(table.a[0]))) == NULL) \
+			return (-1); \
+		table.a = p; \
+	} while (0)
+
+	provider_grow_array(next);
+	provider_grow_array(gen);
+	provider_grow_array(handle);
+	provider_grow_array(uuid);
+	provider_grow_array(key);
+	provider_grow_array(hnext);
+
+#undef	provider_grow_array
+
+	chunks = realloc(table.chunks, (table.nchunks + 1) * sizeof(chunks[0]));
+	if (chunks == NULL)
+		return (-1);
+	table.chunks = chunks;
+
+	chunks[table.nchunks] = calloc(PROVIDER_CHUNK_SIZE, sizeof(provider_t));
+	if (chunks[table.nchunks] == NULL)
+		return (-1);
+
+	memset(table.gen + table.nchunks * PROVIDER_CHUNK_SIZE, 0,
+		PROVIDER_CHUNK_SIZE * sizeof(table.gen[0]));
+	table.nchunks ++;
+
+	return (provider_rehash(n));
+}
+
+/*
+ * Take free slot from the table
+ */
+
+static provider_p
+provider_alloc(void)
+{
+	provider_p	provider = NULL;
+	int32_t		slot;
+
+	if (table.free >= 0) {
+		slot = table.free;
+		table.free = table.next[slot];
+	} else {
+		if (table.nslots == table.nchunks * PROVIDER_CHUNK_SIZE &&
+		    provider_grow() < 0)
+			return (NULL);
+
+		slot = table.nslots ++;
+	}
+
+	table.gen[slot] ++;
+	records ++;
+	table.handle[slot] = 0;
+	table.uuid[slot] = 0;
+	table.key[slot] = 0;
+	table.hnext[slot] = PROVIDER_UNHASHED;
+
+	provider = provider_slot(slot);
+	memset(provider, 0, sizeof(*provider));
+	provider->slot = slot;
+
+	return (provider);
+}
+
+/*
+ * Return slot to the table
+ */
+
+static void
+provider_free(provider_p provider)
+{
+	int32_t	slot = provider->slot, *prev = NULL;
+
+	provider_data_free(provider);
+
+	if (table.hnext[slot] != PROVIDER_UNHASHED) {
+		for (prev = &provider_bucket(table.handle[slot]);
+		     *prev != slot;
+		     prev = &table.hnext[*prev])
+			;
+
+		*prev = table.hnext[slot];
+	}
+
+	table.gen[slot] ++;
+	records --;
+	table.next[slot] = table.free;
+	table.free = slot;
+}
+
+/*
+ * Release profile data
+ */
+
+static void
+provider_data_free(provider_p provider)
+{
+	if (provider->data == NULL)
+		return;
+
+	if (provider_data_arena(provider->datalen))
+		arena_free(provider->data);
+	else if (!provider_data_inline(provider->datalen))
+		free(provider->data);
+
+	data_bytes -= provider->datalen;
+	provider->data = NULL;
+	provider->datalen = 0;
+}
+
+/*
+ * Set profile data. Small data is kept in the provider, bigger data in
+ * the arena and only really big data goes to malloc(). Existing arena
+ * block is reused if new data needs a block of the same size.
+ */
+
+static int32_t
+provider_data_set(provider_p provider, uint8_t const *data, uint32_t datalen)
+{
+	uint8_t	*new_data = NULL;
+
+	if (provider_data_inline(datalen))
+		new_data = provider->idata.b;
+	else if (provider->data != NULL &&
+		 provider_data_arena(provider->datalen) &&
+		 arena_size(provider->datalen) == arena_size(datalen))
+		new_data = provider->data;
+	else if (provider_data_arena(datalen))
+		new_data = (uint8_t *) arena_alloc(datalen);
+	else
+		new_data = (uint8_t *) malloc(datalen);
+
+	if (new_data == NULL)
+		return (-1);
+
+	memcpy(new_data, data, datalen);
+
+	if (provider->data != new_data)
+		provider_data_free(provider);
+	else
+		data_bytes -= provider->datalen;
+
+	provider->data = new_data;
+	provider->datalen = datalen;
+	data_bytes += datalen;
+
+	return (0);
+}
+
+/*
+ * Allocate storage for profile data ahead of a change that must not
+ * fail. Inline data needs no storage, buf is NULL then.
+ */
+
+static int32_t
+provider_data_stage(uint32_t datalen, uint8_t **buf)
+{
+	*buf = NULL;
+
+	if (provider_data_inline(datalen))
+		return (0);
+
+	if (provider_data_arena(datalen))
+		*buf = (uint8_t *) arena_alloc(datalen);
+	else
+		*buf = (uint8_t *) malloc(datalen);
+
+	return ((*buf == NULL)? -1 : 0);
+}
+
+static void
+provider_data_unstage(uint8_t *buf, uint32_t datalen)
+{
+	if (buf == NULL)
+		return;
+
+	if (provider_data_arena(datalen))
+		arena_free(buf);
+	else
+		free(buf);
+}
+
+/*
+ * Replace profile data with the staged copy
+ */
+
+static void
+provider_data_commit(provider_p provider, uint8_t *buf, uint8_t const *data,
+	uint32_t datalen)
+{
+	provider_data_free(provider);
+
+	if (buf == NULL)
+		buf = provider->idata.b;
+
+	memcpy(buf, data, datalen);
+
+	provider->data = buf;
+	provider->datalen = datalen;
+	data_bytes += datalen;
+}
+
+/*
+ * Copy hot fields into the table and hash the slot by handle
+ */
+
+static void
+provider_publish(provider_p provider)
+{
+	int32_t	slot = provider->slot;
+
+	table.handle[slot] = provider->handle;
+	table.uuid[slot] = provider->uuid;
+	table.key[slot] = provider->key;
+
+	table.hnext[slot] = provider_bucket(provider->handle);
+	provider_bucket(provider->handle) = slot;
+}
+
 static uint32_t			change_state = 0;		
 static uint32_t			handle = 0;
+static int32_t			orphans = 0;
+static int32_t			batch = 0;
+static int32_t			batch_changed = 0;
+static provider_notify_p	notify = NULL;
+static void			*notify_arg = NULL;
+
+/*
+ * Journal of recent changes, oldest entry first. Every entry carries the
+ * change state the database had after the change. Changes up to (and
+ * including) journal_lost are no longer in the journal.
+ */
+
+static provider_change_t	journal[PROVIDER_JOURNAL_SIZE];
+static int32_t			journal_head = 0;
+static int32_t			journal_count = 0;
+static uint32_t			journal_lost = 0;
+
+/*
+ * Note that service database has changed. Inside a batch the change
+ * state is only bumped once, when the batch ends.
+ */
+
+static void
+provider_changed(int32_t event, uint32_t handle)
+{
+	provider_change_p	c = NULL;
+
+	if (batch > 0)
+		batch_changed = 1;
+	else
+		change_state ++;
+
+	if (journal_count == PROVIDER_JOURNAL_SIZE) {
+		journal_lost = journal[journal_head].state;
+		journal_head = (journal_head + 1) % PROVIDER_JOURNAL_SIZE;
+		journal_count --;
+	}
+
+	c = &journal[(journal_head + journal_count) % PROVIDER_JOURNAL_SIZE];
+	c->state = (batch > 0)? change_state + 1 : change_state;
+	c->event = event;
+	c->handle = handle;
+	journal_count ++;
+
+	if (notify != NULL)
+		(*notify)(event, handle, notify_arg);
+}
+
+/*
+ * Find view for the given key. Optionally create new one.
+ */
+
+static provider_view_p
+provider_view(uint64_t key, int32_t create)
+{
+	provider_view_p	view = NULL;
+
+	if (key == PROVIDER_KEY_ANY)
+		return (&view_any);
+
+	LIST_FOREACH(view, &views, view_next)
+		if (view->key == key)
+			return (view);
+
+	if (create) {
+		view = calloc(1, sizeof(*view));
+		if (view != NULL) {
+			view->key = key;
+			TAILQ_INIT(&view->providers);
+			LIST_INSERT_HEAD(&views, view, view_next);
+		}
+	}
+
+	return (view);
+}
+
+/*
+ * Pack BD_ADDR into 64 bit key
+ */
+
+uint64_t
+provider_bdaddr_key(bdaddr_p const bdaddr)
+{
+	uint64_t	key = 0;
+
+	memcpy(&key, bdaddr, sizeof(*bdaddr));
+
+	return (key);
+}
+
+/*
+ * Set function to be called on every change in service database
+ */
+
+void
+provider_set_notify(provider_notify_p cb, void *arg)
+{
+	notify = cb;
+	notify_arg = arg;
+}
 
 /*
  * Register Service Discovery provider.
@@ -52,71 +469,108 @@ provider_register_sd(int32_t fd)
 	extern profile_t	sd_profile_descriptor;
 	extern profile_t	bgd_profile_descriptor;
 
-	provider_p		sd = calloc(1, sizeof(*sd));
-	provider_p		bgd = calloc(1, sizeof(*bgd));
+	provider_p		sd = provider_alloc();
+	provider_p		bgd = provider_alloc();
 
 	if (sd == NULL || bgd == NULL) {
 		if (sd != NULL)
-			free(sd);
+			provider_free(sd);
 
 		if (bgd != NULL)
-			free(bgd);
+			provider_free(bgd);
 
 		return (-1);
 	}
 
 	sd->profile = &sd_profile_descriptor;
+	sd->uuid = uuid_intern16(sd->profile->uuid);
+	bgd->profile = &bgd_profile_descriptor;
+	bgd->uuid = uuid_intern16(bgd->profile->uuid);
+
+	if (sd->uuid == UUID_ID_NONE || bgd->uuid == UUID_ID_NONE) {
+		provider_free(sd);
+		provider_free(bgd);
+
+		return (-1);
+	}
+
 	bgd->handle = 0;
 	sd->fd = fd;
+	sd->view = &view_any;
 	TAILQ_INSERT_HEAD(&providers, sd, provider_next);
+	TAILQ_INSERT_HEAD(&view_any.providers, sd, view_next);
 
-	bgd->profile = &bgd_profile_descriptor;
 	bgd->handle = 1;
 	sd->fd = fd;
+	bgd->view = &view_any;
 	TAILQ_INSERT_AFTER(&providers, sd, bgd, provider_next);
+	TAILQ_INSERT_AFTER(&view_any.providers, sd, bgd, view_next);
+
+	provider_publish(sd);
+	provider_publish(bgd);
 	
 	change_state ++;
+	journal_lost = change_state;
 
 	return (0);
 }
 
 /*
- * Register new provider for a given profile, bdaddr and session.
+ * Put new provider into the database. Handle 0 means next free handle.
  */
 
-provider_p
-provider_register(profile_p const profile, bdaddr_p const bdaddr, int32_t fd,
-	uint8_t const *data, uint32_t datalen)
+static provider_p
+provider_insert(profile_p const profile, bdaddr_p const bdaddr, int32_t fd,
+	uint32_t h, uint8_t const *data, uint32_t datalen)
 {
-	//syslog(LOG_ERR, "get provider");
-	provider_p	provider = calloc(1, sizeof(*provider));
+	provider_p	provider = provider_alloc();
 
-	//syslog(LOG_ERR, "have provider");
-	
 	if (provider != NULL) {
-		provider->data = malloc(datalen);
-		if (provider->data != NULL) {
+		provider->key = provider_bdaddr_key(bdaddr);
+		provider->view = provider_view(provider->key, 1);
+		provider->uuid = uuid_intern16(profile->uuid);
+
+		if (provider->view != NULL &&
+		    provider->uuid != UUID_ID_NONE &&
+		    provider_data_set(provider, data, datalen) == 0) {
 			provider->profile = profile;
-			memcpy(provider->data, data, datalen);
 
 			/*
 			 * Record handles 0x0 and 0x1 are reserved
 			 * for SDP itself
 			 */
 
-			if (++ handle <= 1)
-				handle = 2;
+			if (h == 0) {
+				if (++ handle <= 1)
+					handle = 2;
+
+				h = handle;
+			} else if (h > handle)
+				handle = h;
 
-			provider->handle = handle;
+			provider->handle = h;
 
 			memcpy(&provider->bdaddr, bdaddr,
 				sizeof(provider->bdaddr));
 			provider->fd = fd;
+			provider_publish(provider);
 
 			TAILQ_INSERT_TAIL(&providers, provider, provider_next);
-			change_state ++;
+			TAILQ_INSERT_TAIL(&provider->view->providers, provider,
+				view_next);
+			provider_changed(PROVIDER_EVENT_ADDED, provider->handle);
+
+			SDPD_PROBE3(provider__register, provider->handle, fd,
+				datalen);
 		} else {
-			free(provider);
+			if (provider->view != NULL &&
+			    provider->view != &view_any &&
+			    TAILQ_EMPTY(&provider->view->providers)) {
+				LIST_REMOVE(provider->view, view_next);
+				free(provider->view);
+			}
+
+			provider_free(provider);
 			provider = NULL;
 		}
 	}
@@ -124,6 +578,209 @@ provider_register(profile_p const profile, bdaddr_p const bdaddr, int32_t fd,
 	return (provider);
 }
 
+/*
+ * Register new provider for a given profile, bdaddr and session. If
+ * the same service was restored from the snapshot and its owner has not
+ * come back yet, the new session takes the old record over and the
+ * record keeps its handle.
+ */
+
+/*
+ * Find restored record of the service that nobody has taken over yet.
+ * Records already taken by the first count entries are skipped.
+ */
+
+static provider_p
+provider_find_orphan(profile_p const profile, bdaddr_p const bdaddr,
+	provider_entry_p entries, int32_t count)
+{
+	provider_p	provider = NULL;
+	uint64_t	key;
+	int32_t		i;
+
+	if (orphans == 0)
+		return (NULL);
+
+	key = provider_bdaddr_key(bdaddr);
+
+	TAILQ_FOREACH(provider, &providers, provider_next) {
+		if (provider->fd != PROVIDER_FD_ORPHAN ||
+		    provider->profile != profile || provider->key != key)
+			continue;
+
+		for (i = 0; i < count; i ++)
+			if (entries[i].adopt && entries[i].provider == provider)
+				break;
+
+		if (i == count)
+			return (provider);
+	}
+
+	return (NULL);
+}
+
+provider_p
+provider_register(profile_p const profile, bdaddr_p const bdaddr, int32_t fd,
+	uint8_t const *data, uint32_t datalen)
+{
+	provider_p	provider = NULL;
+
+	if (orphans > 0) {
+		provider = provider_find_orphan(profile, bdaddr, NULL, 0);
+		if (provider != NULL) {
+			if (provider->datalen != datalen ||
+			    memcmp(provider->data, data, datalen) != 0) {
+				if (provider_update(provider, data, datalen) < 0)
+					return (NULL);
+			}
+
+			provider->fd = fd;
+			orphans --;
+
+			return (provider);
+		}
+	}
+
+	return (provider_insert(profile, bdaddr, fd, 0, data, datalen));
+}
+
+/*
+ * Register group of providers for the session, all or none. New records
+ * are inserted first, so they are the only thing to undo if memory runs
+ * out. Restored records are taken over last, when nothing can fail.
+ * Returns 0 and the records in entries, or -1.
+ */
+
+int32_t
+provider_register_batch(int32_t fd, provider_entry_p entries, int32_t count)
+{
+	provider_entry_p	e = NULL;
+	int32_t			i;
+
+	for (i = 0; i < count; i ++) {
+		e = &entries[i];
+		e->buf = NULL;
+		e->provider = provider_find_orphan(e->profile,
+				(bdaddr_p) e->bdaddr, entries, i);
+		e->adopt = (e->provider != NULL);
+	}
+
+	/* Stage data of restored records that change */
+	for (i = 0; i < count; i ++) {
+		e = &entries[i];
+		if (!e->adopt || (e->provider->datalen == e->datalen &&
+		    memcmp(e->provider->data, e->data, e->datalen) == 0))
+			continue;
+
+		if (provider_data_stage(e->datalen, &e->buf) < 0)
+			goto fail;
+	}
+
+	provider_batch_begin();
+
+	for (i = 0; i < count; i ++) {
+		e = &entries[i];
+		if (e->adopt)
+			continue;
+
+		e->provider = provider_insert(e->profile, (bdaddr_p) e->bdaddr,
+				fd, 0, e->data, e->datalen);
+		if (e->provider == NULL) {
+			while (i -- > 0)
+				if (!entries[i].adopt)
+					provider_unregister(entries[i].provider);
+
+			provider_batch_end();
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < count; i ++) {
+		e = &entries[i];
+		if (!e->adopt)
+			continue;
+
+		if (e->provider->datalen != e->datalen ||
+		    memcmp(e->provider->data, e->data, e->datalen) != 0) {
+			provider_data_commit(e->provider, e->buf, e->data,
+				e->datalen);
+			provider_changed(PROVIDER_EVENT_UPDATED,
+				e->provider->handle);
+		}
+
+		e->provider->fd = fd;
+		orphans --;
+	}
+
+	provider_batch_end();
+
+	return (0);
+fail:
+	for (i = 0; i < count; i ++) {
+		provider_data_unstage(entries[i].buf, entries[i].datalen);
+		entries[i].buf = NULL;
+	}
+
+	return (-1);
+}
+
+/*
+ * Restore provider with the given handle, from the snapshot or from the
+ * old process. Record restored from the snapshot (fd is
+ * PROVIDER_FD_ORPHAN) has no owner until one registers the same service
+ * again.
+ */
+
+provider_p
+provider_restore(profile_p const profile, bdaddr_p const bdaddr, int32_t fd,
+	uint32_t h, uint8_t const *data, uint32_t datalen)
+{
+	provider_p	provider = NULL;
+
+	if (h <= 1 || provider_by_handle(h) != NULL)
+		return (NULL);
+
+	provider = provider_insert(profile, bdaddr, fd, h, data, datalen);
+	if (provider != NULL && fd == PROVIDER_FD_ORPHAN)
+		orphans ++;
+
+	return (provider);
+}
+
+/*
+ * Remove restored records whose owners did not come back. Returns number
+ * of records removed.
+ */
+
+int32_t
+provider_expire_orphans(void)
+{
+	provider_p	provider = NULL, provider_next = NULL;
+	int32_t		n = 0;
+
+	if (orphans == 0)
+		return (0);
+
+	provider_batch_begin();
+
+	for (provider = TAILQ_FIRST(&providers);
+	     provider != NULL;
+	     provider = provider_next) {
+		provider_next = TAILQ_NEXT(provider, provider_next);
+
+		if (provider->fd == PROVIDER_FD_ORPHAN) {
+			provider_unregister(provider);
+			n ++;
+		}
+	}
+
+	provider_batch_end();
+
+	orphans = 0;
+
+	return (n);
+}
+
 /*
  * Unregister provider
  */
@@ -131,11 +788,20 @@ provider_register(profile_p const profile, bdaddr_p const bdaddr, int32_t fd,
 void
 provider_unregister(provider_p provider)
 {
+	provider_view_p	view = provider->view;
+	uint32_t	h = provider->handle;
+
+	SDPD_PROBE2(provider__unregister, h, provider->fd);
+
 	TAILQ_REMOVE(&providers, provider, provider_next);
-	if (provider->data != NULL)
-		free(provider->data);
-	free(provider);
-	change_state ++;
+	TAILQ_REMOVE(&view->providers, provider, view_next);
+	if (view != &view_any && TAILQ_EMPTY(&view->providers)) {
+		LIST_REMOVE(view, view_next);
+		free(view);
+	}
+
+	provider_free(provider);
+	provider_changed(PROVIDER_EVENT_REMOVED, h);
 }
 
 /*
@@ -145,17 +811,75 @@ provider_unregister(provider_p provider)
 int32_t
 provider_update(provider_p provider, uint8_t const *data, uint32_t datalen)
 {
-	uint8_t	*new_data = (uint8_t *) realloc(provider->data, datalen);
-
-	if (new_data == NULL)
+	if (provider_data_set(provider, data, datalen) < 0)
 		return (-1);
 
-	memcpy(new_data, data, datalen);
-	provider->data = new_data;
+	provider_changed(PROVIDER_EVENT_UPDATED, provider->handle);
+
+	SDPD_PROBE2(provider__update, provider->handle, datalen);
+
+	return (0);
+}
+
+/*
+ * Update group of providers, all or none. Memory for every new data is
+ * allocated before any record is changed.
+ */
+
+int32_t
+provider_update_batch(provider_entry_p entries, int32_t count)
+{
+	provider_entry_p	e = NULL;
+	int32_t			i;
+
+	for (i = 0; i < count; i ++) {
+		if (provider_data_stage(entries[i].datalen,
+				&entries[i].buf) < 0) {
+			while (i -- > 0)
+				provider_data_unstage(entries[i].buf,
+					entries[i].datalen);
+
+			return (-1);
+		}
+	}
+
+	provider_batch_begin();
+
+	for (i = 0; i < count; i ++) {
+		e = &entries[i];
+
+		provider_data_commit(e->provider, e->buf, e->data, e->datalen);
+		provider_changed(PROVIDER_EVENT_UPDATED, e->provider->handle);
+
+		SDPD_PROBE2(provider__update, e->provider->handle, e->datalen);
+	}
+
+	provider_batch_end();
 
 	return (0);
 }
 
+/*
+ * Group several register/unregister/update calls so that the whole
+ * group results in a single change state increment
+ */
+
+void
+provider_batch_begin(void)
+{
+	if (batch ++ == 0)
+		batch_changed = 0;
+}
+
+void
+provider_batch_end(void)
+{
+	if (-- batch == 0 && batch_changed) {
+		batch_changed = 0;
+		change_state ++;
+	}
+}
+
 /*
  * Get a provider for given record handle
  */
@@ -163,13 +887,49 @@ provider_update(provider_p provider, uint8_t const *data, uint32_t datalen)
 provider_p
 provider_by_handle(uint32_t handle)
 {
-	provider_p	provider = NULL;
+	int32_t	slot;
 
-	TAILQ_FOREACH(provider, &providers, provider_next)
-		if (provider->handle == handle)
-			break;
+	if (table.nbuckets == 0)
+		return (NULL);
 
-	return (provider);
+	for (slot = provider_bucket(handle); slot >= 0; slot = table.hnext[slot])
+		if (table.handle[slot] == handle)
+			return (provider_slot(slot));
+
+	return (NULL);
+}
+
+/*
+ * Find next record, starting at the given slot, that is seen on the
+ * adapter with the given key and has the given profile UUID (or any if
+ * uuid is PROVIDER_UUID_ANY). Slot is advanced past the returned record.
+ */
+
+provider_p
+provider_scan(uint64_t key, uint32_t uuid, int32_t *slot)
+{
+	int32_t	s;
+
+	for (s = *slot; s < table.nslots; s ++) {
+		if (uuid != PROVIDER_UUID_ANY) {
+			s = match_u32(table.uuid, s, table.nslots, uuid);
+			if (s == table.nslots)
+				break;
+		}
+		if (key != PROVIDER_KEY_ANY && table.key[s] != key &&
+		    table.key[s] != PROVIDER_KEY_ANY)
+			continue;
+		if (!provider_live(s))
+			continue;
+
+		*slot = s + 1;
+
+		return (provider_slot(s));
+	}
+
+	*slot = s;
+
+	return (NULL);
 }
 
 /*
@@ -188,6 +948,119 @@ provider_get_next(provider_p provider)
 	return (TAILQ_NEXT(provider, provider_next));
 }
 
+/*
+ * Cursor access to providers seen on the adapter with the given key,
+ * "any" view first. Key of PROVIDER_KEY_ANY means all providers.
+ */
+
+provider_p
+provider_get_first_on(uint64_t key)
+{
+	provider_view_p	view = NULL;
+	provider_p	provider = NULL;
+
+	if (key == PROVIDER_KEY_ANY)
+		return (TAILQ_FIRST(&providers));
+
+	provider = TAILQ_FIRST(&view_any.providers);
+	if (provider == NULL && (view = provider_view(key, 0)) != NULL)
+		provider = TAILQ_FIRST(&view->providers);
+
+	return (provider);
+}
+
+provider_p
+provider_get_next_on(provider_p provider, uint64_t key)
+{
+	provider_view_p	view = NULL;
+	provider_p	next = NULL;
+
+	if (key == PROVIDER_KEY_ANY)
+		return (TAILQ_NEXT(provider, provider_next));
+
+	next = TAILQ_NEXT(provider, view_next);
+	if (next == NULL && provider->view == &view_any &&
+	    (view = provider_view(key, 0)) != NULL)
+		next = TAILQ_FIRST(&view->providers);
+
+	return (next);
+}
+
+/*
+ * Get changes made after given change state, oldest first. Returns number
+ * of changes or -1 if some of them are no longer in the journal.
+ */
+
+int32_t
+provider_get_changes(uint32_t state, provider_change_p changes, int32_t max)
+{
+	provider_change_p	c = NULL;
+	int32_t			i, n;
+
+	if (state < journal_lost || state > change_state)
+		return (-1);
+
+	for (i = 0, n = 0; i < journal_count; i ++) {
+		c = &journal[(journal_head + i) % PROVIDER_JOURNAL_SIZE];
+
+		if (c->state <= state)
+			continue;
+		if (n == max)
+			return (-1);
+
+		memcpy(&changes[n ++], c, sizeof(*c));
+	}
+
+	return (n);
+}
+
+/*
+ * Move profile data out of sparsely used arena pages, so the pages can
+ * be given back
+ */
+
+void
+provider_compact(void)
+{
+	provider_p	provider = NULL;
+	void		*p = NULL;
+	int32_t		slot;
+
+	arena_compact_begin();
+
+	for (slot = 0; slot < table.nslots; slot ++) {
+		if (!provider_live(slot))
+			continue;
+
+		provider = provider_slot(slot);
+		if (!provider_data_arena(provider->datalen) ||
+		    !arena_draining(provider->data))
+			continue;
+
+		if ((p = arena_alloc(provider->datalen)) == NULL)
+			break;
+
+		memcpy(p, provider->data, provider->datalen);
+		arena_free(provider->data);
+		provider->data = p;
+	}
+
+	arena_compact_end();
+}
+
+/*
+ * Return memory used by the service database
+ */
+
+void
+provider_get_memory(provider_memory_p memory)
+{
+	memory->records = records;
+	memory->slots = table.nchunks * PROVIDER_CHUNK_SIZE;
+	memory->data = data_bytes;
+	memory->arena = arena_bytes();
+}
+
 /*
  * Return change state
  */
@@ -198,3 +1071,39 @@ provider_get_change_state(void)
 	return (change_state);
 }
 
+/*
+ * Set change state (restored from the snapshot or handed over). Changes
+ * made before are not in the journal.
+ */
+
+void
+provider_set_change_state(uint32_t state)
+{
+	change_state = state;
+	journal_lost = state;
+	journal_head = 0;
+	journal_count = 0;
+}
+
+/*
+ * Return last record handle given out
+ */
+
+uint32_t
+provider_get_last_handle(void)
+{
+	return (handle);
+}
+
+/*
+ * Set last record handle given out (handed over), so handles of
+ * removed records are not given out again
+ */
+
+void
+provider_set_last_handle(uint32_t h)
+{
+	if (h > handle)
+		handle = h;
+}
+
@@ -36,40 +36,176 @@
  * Provider of service
  */
 
+/*
+ * Providers live in a table of fixed size chunks, so a provider never
+ * moves and its slot number stays the same while it is registered. The
+ * fields used to match records (handle, interned profile UUID, packed
+ * BDADDR) are also kept in dense per-slot arrays, so searches do not
+ * have to touch the providers themselves. Profile data of up to PROVIDER_INLINE_SIZE
+ * bytes is stored in the provider.
+ */
+
+#define		PROVIDER_CHUNK_SHIFT		8
+#define		PROVIDER_CHUNK_SIZE		(1 << PROVIDER_CHUNK_SHIFT)
+#define		PROVIDER_CHUNK_MASK		(PROVIDER_CHUNK_SIZE - 1)
+#define		PROVIDER_INLINE_SIZE		32
+
+#define		PROVIDER_UUID_ANY		0xffffffff
+
 struct profile;
+struct provider_view;
 
 struct provider
 {
 	struct profile 		*profile;		/* profile */
 	void			*data;			/* profile data */
+	uint32_t		 datalen;		/* profile data size */
 	uint32_t		 handle;		/* record handle */
+	uint32_t		 uuid;			/* interned UUID */
 	bdaddr_t		 bdaddr;		/* provider's BDADDR */
+	uint64_t		 key;			/* packed BDADDR */
 	int32_t			 fd;			/* session descriptor */
+	int32_t			 slot;			/* slot in the table */
+	struct provider_view	*view;			/* adapter view */
 	TAILQ_ENTRY(provider)	 provider_next;		/* all providers */
+	TAILQ_ENTRY(provider)	 view_next;		/* view providers */
+	union {
+		uint8_t		 b[PROVIDER_INLINE_SIZE];
+		uint64_t	 align;
+	}			 idata;			/* inline data */
 };
 
 typedef struct provider		provider_t;
 typedef struct provider	*	provider_p;
 
-#define		provider_match_bdaddr(p, b) \
-	(memcmp(b, NG_HCI_BDADDR_ANY, sizeof(bdaddr_t)) == 0 || \
-	 memcmp(&(p)->bdaddr, NG_HCI_BDADDR_ANY, sizeof(bdaddr_t)) == 0 || \
-	 memcmp(&(p)->bdaddr, b, sizeof(bdaddr_t)) == 0)
-	
+/*
+ * Service database change notification
+ */
+
+#define		PROVIDER_EVENT_ADDED		1
+#define		PROVIDER_EVENT_REMOVED		2
+#define		PROVIDER_EVENT_UPDATED		3
+
+typedef void	(provider_notify_t)(int32_t event, uint32_t handle, void *arg);
+typedef provider_notify_t *	provider_notify_p;
+
+/*
+ * Service database change journal entry
+ */
+
+#define		PROVIDER_JOURNAL_SIZE		256
+
+struct provider_change
+{
+	uint32_t		 state;			/* change state after */
+	uint32_t		 handle;		/* record handle */
+	int32_t			 event;			/* PROVIDER_EVENT_xxx */
+};
+
+typedef struct provider_change	provider_change_t;
+typedef struct provider_change *provider_change_p;
+
+/*
+ * Every provider is also kept in a view of its adapter. Providers
+ * registered for BDADDR_ANY are in the "any" view and are seen on every
+ * adapter. A view is looked up by the BD_ADDR packed into 64 bits, the
+ * key of BDADDR_ANY is 0.
+ */
+
+struct provider_view
+{
+	uint64_t			 key;		/* packed BDADDR */
+	TAILQ_HEAD(, provider)		 providers;	/* providers */
+	LIST_ENTRY(provider_view)	 view_next;	/* all views */
+};
+
+typedef struct provider_view	provider_view_t;
+typedef struct provider_view *	provider_view_p;
+
+/*
+ * Memory used by the service database
+ */
+
+struct provider_memory
+{
+	uint32_t		 records;		/* live records */
+	uint32_t		 slots;			/* slots in the table */
+	uint32_t		 data;			/* profile data bytes */
+	uint32_t		 arena;			/* arena bytes */
+};
+
+typedef struct provider_memory	provider_memory_t;
+typedef struct provider_memory *provider_memory_p;
+
+/*
+ * Entry of a group of changes that is made all at once or not at all
+ * (see provider_register_batch() and provider_update_batch()). Memory
+ * for the whole group is allocated before anything is changed.
+ */
+
+struct provider_entry
+{
+	struct profile		*profile;		/* profile (register) */
+	bdaddr_t const		*bdaddr;		/* BDADDR (register) */
+	uint8_t const		*data;			/* new profile data */
+	uint32_t		 datalen;		/* new data size */
+	struct provider		*provider;		/* record */
+	uint8_t			*buf;			/* staged data */
+	int32_t			 adopt;			/* orphan taken over */
+};
+
+typedef struct provider_entry	provider_entry_t;
+typedef struct provider_entry *	provider_entry_p;
+
+#define		PROVIDER_KEY_ANY		0
+
+/* Session descriptor of records restored from the snapshot */
+#define		PROVIDER_FD_ORPHAN		(-2)
+
 int32_t		provider_register_sd		(int32_t fd);
 provider_p	provider_register		(profile_p const profile,
 						 bdaddr_p const bdaddr,
 						 int32_t fd,
 						 uint8_t const *data,
 						 uint32_t datalen);
+provider_p	provider_restore		(profile_p const profile,
+						 bdaddr_p const bdaddr,
+						 int32_t fd,
+						 uint32_t handle,
+						 uint8_t const *data,
+						 uint32_t datalen);
+int32_t		provider_register_batch		(int32_t fd,
+						 provider_entry_p entries,
+						 int32_t count);
+int32_t		provider_expire_orphans		(void);
 
 void		provider_unregister		(provider_p provider);
 int32_t		provider_update			(provider_p provider,
 						 uint8_t const *data,
 						 uint32_t datalen);
+int32_t		provider_update_batch		(provider_entry_p entries,
+						 int32_t count);
+void		provider_batch_begin		(void);
+void		provider_batch_end		(void);
 provider_p	provider_by_handle		(uint32_t handle);
+provider_p	provider_scan			(uint64_t key, uint32_t uuid,
+						 int32_t *slot);
 provider_p	provider_get_first		(void);
 provider_p	provider_get_next		(provider_p provider);
+provider_p	provider_get_first_on		(uint64_t key);
+provider_p	provider_get_next_on		(provider_p provider,
+						 uint64_t key);
+uint64_t	provider_bdaddr_key		(bdaddr_p const bdaddr);
+int32_t		provider_get_changes		(uint32_t state,
+						 provider_change_p changes,
+						 int32_t max);
 uint32_t	provider_get_change_state	(void);
+void		provider_set_change_state	(uint32_t state);
+uint32_t	provider_get_last_handle	(void);
+void		provider_set_last_handle	(uint32_t h);
+void		provider_set_notify		(provider_notify_p notify,
+						 void *arg);
+void		provider_compact		(void);
+void		provider_get_memory		(provider_memory_p memory);
 
 #endif /* ndef _PROVIDER_H_ */
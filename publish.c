@@ -0,0 +1,416 @@
+/*
+ * publish.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sdp.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "plan.h"
+#include "profile.h"
+#include "provider.h"
+#include "publish.h"
+#include "sdpshm.h"
+
+/* from sar.c */
+int32_t server_prepare_attr_list_plan(provider_p const provider, plan_p plan,
+		uint8_t *rsp, uint8_t const * const rsp_end);
+
+#define	publish_align(n)	(((n) + 63) & ~63)
+
+static struct {
+	char		*path;		/* published file */
+	int32_t		 fd;		/* open published file */
+	uint8_t		*base;		/* mapped file */
+	uint32_t	 size;		/* mapped size */
+	uint32_t	 gen;		/* publish generation */
+	int32_t		 dirty;		/* database has changed */
+	int32_t		 keep;		/* leave the file on close */
+} pub = { NULL, -1, NULL, 0, 0, 0, 0 };
+
+#define	publish_hdr()	((struct sdpshm_hdr *) pub.base)
+
+static int32_t
+publish_rec_cmp(void const *a, void const *b)
+{
+	uint32_t	ha = ((struct sdpshm_rec const *) a)->handle;
+	uint32_t	hb = ((struct sdpshm_rec const *) b)->handle;
+
+	return ((ha > hb) - (ha < hb));
+}
+
+static int32_t
+publish_key_cmp(void const *a, void const *b)
+{
+	uint64_t	ka = *(uint64_t const *) a;
+	uint64_t	kb = *(uint64_t const *) b;
+
+	return ((ka > kb) - (ka < kb));
+}
+
+/*
+ * Write the database into the buffer. Returns 0, -1 if it does not fit
+ * or -2 on other errors.
+ */
+
+static int32_t
+publish_fill(uint8_t *buf, uint32_t size)
+{
+	static uint8_t const	 all[] = {
+		SDP_DATA_UINT32, 0x00, 0x00, 0xff, 0xff
+	};
+
+	struct sdpshm_db	*db = (struct sdpshm_db *) buf;
+	struct sdpshm_rec	*recs = (struct sdpshm_rec *) (db + 1);
+	uint32_t		*idx = NULL;
+	uint64_t		*keys = NULL;
+	provider_p		 provider = NULL;
+	plan_p			 plan = NULL;
+	uint8_t			*ptr = NULL, *end = buf + size;
+	uint32_t		 nrecs = 0, i;
+	int32_t			 len;
+
+	plan = plan_get(all, all + sizeof(all));
+	if (plan == NULL)
+		return (-2);
+
+	for (provider = provider_get_first();
+	     provider != NULL;
+	     provider = provider_get_next(provider))
+		nrecs ++;
+
+	if (nrecs > (size - sizeof(*db)) / (sizeof(*recs) + sizeof(*idx)))
+		return (-1);
+
+	idx = (uint32_t *) (recs + nrecs);
+	ptr = (uint8_t *) (idx + nrecs);
+
+	for (provider = provider_get_first(), i = 0;
+	     provider != NULL;
+	     provider = provider_get_next(provider), i ++) {
+		len = server_prepare_attr_list_plan(provider, plan, ptr, end);
+		if (len < 0)
+			return (-1);
+
+		recs[i].handle = provider->handle;
+		recs[i].uuid = provider->profile->uuid;
+		recs[i].pad = 0;
+		recs[i].off = ptr - buf;
+		recs[i].len = len;
+		recs[i].key = provider->key;
+
+		ptr += len;
+	}
+
+	qsort(recs, nrecs, sizeof(recs[0]), publish_rec_cmp);
+
+	/* Records are sorted by handle, so (UUID, index) sorts by handle too */
+	if (nrecs > 0) {
+		keys = (uint64_t *) malloc(nrecs * sizeof(keys[0]));
+		if (keys == NULL)
+			return (-2);
+
+		for (i = 0; i < nrecs; i ++)
+			keys[i] = ((uint64_t) recs[i].uuid << 32) | i;
+
+		qsort(keys, nrecs, sizeof(keys[0]), publish_key_cmp);
+
+		for (i = 0; i < nrecs; i ++)
+			idx[i] = (uint32_t) keys[i];
+
+		free(keys);
+	}
+
+	db->gen = pub.gen;
+	db->change_state = provider_get_change_state();
+	db->nrecs = nrecs;
+	db->used = ptr - buf;
+
+	return (0);
+}
+
+/*
+ * Mark old file moved, so readers open the path again
+ */
+
+static void
+publish_moved(int32_t fd)
+{
+	struct sdpshm_hdr	*hdr = NULL;
+	struct stat		 st;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr))
+		return;
+
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return;
+
+	if (memcmp(hdr->magic, SDPSHM_MAGIC, sizeof(hdr->magic)) == 0)
+		atomic_store_explicit(&hdr->moved, 1, memory_order_release);
+
+	munmap(hdr, sizeof(*hdr));
+}
+
+/*
+ * Publish the database in a new file with given buffer size. The new
+ * file replaces the old one only when it is complete. Returns 0, -1 if
+ * the database does not fit or -2 on other errors.
+ */
+
+static int32_t
+publish_create(uint32_t buf_size)
+{
+	struct sdpshm_hdr	*hdr = NULL;
+	uint8_t			*base = NULL;
+	uint32_t		 size;
+	int32_t			 fd, old, n = -2;
+	char			 tmp[PATH_MAX];
+
+	snprintf(tmp, sizeof(tmp), "%s.new", pub.path);
+	size = publish_align(sizeof(*hdr)) + 2 * buf_size;
+
+	fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_err("Could not create %s. %s (%d)",
+			tmp, strerror(errno), errno);
+		return (-2);
+	}
+
+	if (fchmod(fd, 0644) < 0 || ftruncate(fd, size) < 0 ||
+	    (base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0))
+			== MAP_FAILED) {
+		log_err("Could not map %s. %s (%d)",
+			tmp, strerror(errno), errno);
+		base = NULL;
+		goto fail;
+	}
+
+	hdr = (struct sdpshm_hdr *) base;
+	memcpy(hdr->magic, SDPSHM_MAGIC, sizeof(hdr->magic));
+	hdr->version = SDPSHM_VERSION;
+	hdr->size = size;
+	hdr->buf_off[0] = publish_align(sizeof(*hdr));
+	hdr->buf_off[1] = hdr->buf_off[0] + buf_size;
+	hdr->buf_size = buf_size;
+
+	/* Nobody reads the file yet */
+	n = publish_fill(base + hdr->buf_off[0], buf_size);
+	if (n < 0)
+		goto fail;
+
+	atomic_store_explicit(&hdr->current, 0, memory_order_release);
+
+	old = open(pub.path, O_RDWR|O_CLOEXEC);
+
+	if (rename(tmp, pub.path) < 0) {
+		log_err("Could not rename %s. %s (%d)",
+			tmp, strerror(errno), errno);
+		if (old >= 0)
+			close(old);
+		n = -2;
+		goto fail;
+	}
+
+	if (old >= 0) {
+		publish_moved(old);
+		close(old);
+	}
+
+	if (pub.base != NULL)
+		munmap(pub.base, pub.size);
+	if (pub.fd >= 0)
+		close(pub.fd);
+
+	pub.fd = fd;
+	pub.base = base;
+	pub.size = size;
+
+	return (0);
+fail:
+	if (base != NULL)
+		munmap(base, size);
+
+	close(fd);
+	unlink(tmp);
+
+	return (n);
+}
+
+/*
+ * Publish the database. Inactive buffer is rewritten and made current,
+ * if the database does not fit the file is replaced with a bigger one.
+ */
+
+static int32_t
+publish_write(void)
+{
+	struct sdpshm_hdr	*hdr = publish_hdr();
+	uint32_t		 b, seq, size = PUBLISH_MIN_SIZE;
+	int32_t			 n;
+
+	pub.gen ++;
+
+	if (hdr != NULL) {
+		b = !atomic_load_explicit(&hdr->current, memory_order_relaxed);
+		seq = atomic_load_explicit(&hdr->seq[b], memory_order_relaxed);
+
+		atomic_store_explicit(&hdr->seq[b], seq + 1,
+			memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+
+		n = publish_fill(pub.base + hdr->buf_off[b], hdr->buf_size);
+
+		atomic_store_explicit(&hdr->seq[b], seq + 2,
+			memory_order_release);
+
+		if (n == 0) {
+			atomic_store_explicit(&hdr->current, b,
+				memory_order_release);
+
+			return (0);
+		}
+		if (n < -1)
+			goto fail;
+
+		size = hdr->buf_size * 2;
+	}
+
+	for (; size <= PUBLISH_MAX_SIZE; size *= 2) {
+		n = publish_create(size);
+		if (n == 0)
+			return (0);
+		if (n < -1)
+			goto fail;
+	}
+
+	log_err("Service database does not fit in %d bytes", PUBLISH_MAX_SIZE);
+fail:
+	log_err("Could not publish service database in %s", pub.path);
+
+	return (-1);
+}
+
+/*
+ * Start publishing the database in file
+ */
+
+int32_t
+publish_open(char const *path)
+{
+	pub.path = strdup(path);
+	if (pub.path == NULL) {
+		log_err("Could not allocate publish path");
+		return (-1);
+	}
+
+	if (publish_write() < 0) {
+		publish_close();
+		return (-1);
+	}
+
+	log_info("Publishing service database in %s", path);
+
+	return (0);
+}
+
+/*
+ * Stop publishing the database. The file is removed, unless it has
+ * been replaced already (i.e. by the new server on handoff) or has to
+ * stay for the new server to replace, and readers are told it has gone.
+ */
+
+void
+publish_close(void)
+{
+	struct sdpshm_hdr	*hdr = publish_hdr();
+	struct stat		 st, st2;
+
+	if (hdr != NULL && !pub.keep && stat(pub.path, &st) == 0 &&
+	    fstat(pub.fd, &st2) == 0 &&
+	    st.st_dev == st2.st_dev && st.st_ino == st2.st_ino) {
+		unlink(pub.path);
+		atomic_store_explicit(&hdr->moved, 1, memory_order_release);
+	}
+
+	if (pub.base != NULL)
+		munmap(pub.base, pub.size);
+	if (pub.fd >= 0)
+		close(pub.fd);
+
+	free(pub.path);
+
+	memset(&pub, 0, sizeof(pub));
+	pub.fd = -1;
+}
+
+/*
+ * Database has changed, publish it on the next flush
+ */
+
+void
+publish_changed(void)
+{
+	pub.dirty = 1;
+}
+
+/*
+ * Leave the file in place when publishing stops. The new server has
+ * taken over and will replace the file, until then readers keep using
+ * this one, so it is brought up to date first.
+ */
+
+void
+publish_keep(void)
+{
+	publish_flush();
+	pub.keep = 1;
+}
+
+/*
+ * Publish the database if it has changed
+ */
+
+void
+publish_flush(void)
+{
+	if (pub.dirty && pub.base != NULL) {
+		pub.dirty = 0;
+		publish_write();
+	}
+}
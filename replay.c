@@ -0,0 +1,333 @@
+/*
+ * replay.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/endian.h>
+#include <sys/queue.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc_np.h>
+#include <sdp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "capture.h"
+#include "log.h"
+#include "profile.h"
+#include "provider.h"
+#include "replay.h"
+#include "timer.h"
+#include "server.h"
+
+/*
+ * Offline replay. Requests from a capture file are fed through the
+ * request handlers without sockets and responses are dropped. Records
+ * from control clients (i.e. registrations) are replayed on the first
+ * pass only, L2CAP requests are replayed on every pass. Results are
+ * printed per PDU ID.
+ */
+
+struct replay_rec
+{
+	uint8_t const	*pdu;		/* request PDU */
+	int32_t		 len;		/* PDU length */
+	int32_t		 fd;		/* replay client */
+	int32_t		 control;	/* from control client */
+};
+
+struct replay_client
+{
+	uint64_t	 peer;
+	uint64_t	 local;
+	uint16_t	 omtu;
+	uint8_t		 flags;
+};
+
+struct replay_stat
+{
+	uint64_t	 count;		/* requests */
+	uint64_t	 nsec;		/* time spent */
+	uint64_t	 cycles;	/* CPU cycles spent */
+	uint64_t	 bytes;		/* response bytes */
+	uint64_t	 alloc;		/* bytes allocated */
+};
+
+static uint64_t
+replay_nsec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static uint64_t
+replay_cycles(void)
+{
+#if defined(__amd64__) || defined(__i386__)
+	return (__builtin_ia32_rdtsc());
+#else
+	return (0);
+#endif
+}
+
+static uint64_t
+replay_allocated(void)
+{
+	uint64_t	allocated = 0;
+	size_t		size = sizeof(allocated);
+
+	if (mallctl("thread.allocated", &allocated, &size, NULL, 0) != 0)
+		return (0);
+
+	return (allocated);
+}
+
+/*
+ * Read whole file into memory
+ */
+
+static uint8_t *
+replay_load(char const *path, int32_t *len)
+{
+	struct stat	 st;
+	uint8_t		*buf = NULL;
+	int32_t		 fd, off, n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_err("Could not open(%s). %s (%d)",
+			path, strerror(errno), errno);
+		return (NULL);
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size > INT32_MAX) {
+		log_err("Could not stat(%s)", path);
+		close(fd);
+		return (NULL);
+	}
+
+	buf = malloc(st.st_size + 1);
+	if (buf == NULL) {
+		log_err("Could not allocate capture buffer");
+		close(fd);
+		return (NULL);
+	}
+
+	for (off = 0; off < st.st_size; off += n) {
+		n = read(fd, buf + off, st.st_size - off);
+		if (n <= 0) {
+			log_err("Could not read(%s). %s (%d)",
+				path, strerror(errno), errno);
+			free(buf);
+			close(fd);
+			return (NULL);
+		}
+	}
+
+	close(fd);
+	*len = off;
+
+	return (buf);
+}
+
+/*
+ * Parse capture and set up replay clients. Returns number of requests
+ * or -1 if capture is invalid.
+ */
+
+static int32_t
+replay_parse(server_p srv, uint8_t const *buf, int32_t len,
+		struct replay_rec *recs)
+{
+	struct capture_file const	*hdr = (struct capture_file const *) buf;
+	struct capture_rec const	*rec = NULL;
+	struct capture_pkt const	*pkt = NULL;
+	struct replay_client		 clients[FD_SETSIZE];
+	uint8_t const			*ptr = buf + sizeof(*hdr);
+	uint8_t const			*end = buf + len;
+	int32_t				 n, nclients, incl, fd;
+
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    be32dec(&hdr->version) != CAPTURE_VERSION ||
+	    be32dec(&hdr->datalink) != CAPTURE_DATALINK) {
+		log_err("Not a capture file");
+		return (-1);
+	}
+
+	for (n = 0, nclients = 0; ptr < end; ptr += incl) {
+		rec = (struct capture_rec const *) ptr;
+		if (end - ptr < sizeof(*rec))
+			return (-1);
+
+		ptr += sizeof(*rec);
+		incl = be32dec(&rec->incl_len);
+		if (incl > end - ptr || incl < sizeof(*pkt))
+			return (-1);
+
+		/* Responses are only there to look at */
+		if (!(be32dec(&rec->flags) & CAPTURE_FLAG_RECV))
+			continue;
+
+		/* Truncated request can not be replayed */
+		if (incl != be32dec(&rec->orig_len))
+			continue;
+
+		pkt = (struct capture_pkt const *) ptr;
+
+		for (fd = 0; fd < nclients; fd ++)
+			if (clients[fd].peer == be64dec(&pkt->peer) &&
+			    clients[fd].local == be64dec(&pkt->local) &&
+			    clients[fd].omtu == be16dec(&pkt->omtu) &&
+			    clients[fd].flags == pkt->flags)
+				break;
+
+		if (fd == nclients) {
+			if (nclients == FD_SETSIZE)
+				return (-1);
+
+			clients[fd].peer = be64dec(&pkt->peer);
+			clients[fd].local = be64dec(&pkt->local);
+			clients[fd].omtu = be16dec(&pkt->omtu);
+			clients[fd].flags = pkt->flags;
+
+			if (server_replay_client(srv, fd,
+					pkt->flags & CAPTURE_PKT_CONTROL,
+					pkt->flags & CAPTURE_PKT_PRIV,
+					clients[fd].local, clients[fd].omtu) < 0)
+				return (-1);
+
+			nclients ++;
+		}
+
+		recs[n].pdu = ptr + sizeof(*pkt);
+		recs[n].len = incl - sizeof(*pkt);
+		recs[n].fd = fd;
+		recs[n].control = pkt->flags & CAPTURE_PKT_CONTROL;
+		n ++;
+	}
+
+	return (n);
+}
+
+/*
+ * Replay capture file loops times and print results
+ */
+
+int32_t
+replay_run(char const *path, int32_t loops)
+{
+	server_t		 srv;
+	struct replay_rec	*recs = NULL;
+	struct replay_stat	*stats = NULL, total;
+	uint8_t			*buf = NULL;
+	uint64_t		 nsec, cycles, sink, alloc;
+	int32_t			 len, n, loop, i, pid, error = 0;
+
+	if ((buf = replay_load(path, &len)) == NULL)
+		return (-1);
+
+	if (server_init_replay(&srv) < 0) {
+		free(buf);
+		return (-1);
+	}
+
+	/* Every record has at least both headers */
+	stats = calloc(256, sizeof(stats[0]));
+	recs = calloc(len / (sizeof(struct capture_rec) +
+			sizeof(struct capture_pkt)) + 1, sizeof(recs[0]));
+	if (stats == NULL || recs == NULL ||
+	    (n = replay_parse(&srv, buf, len, recs)) < 0) {
+		log_err("Could not load capture %s", path);
+		error = -1;
+		goto out;
+	}
+
+	for (loop = 0; loop < loops; loop ++) {
+		for (i = 0; i < n; i ++) {
+			if (recs[i].control && loop > 0)
+				continue;
+
+			pid = recs[i].pdu[0];
+			sink = srv.sink;
+			alloc = replay_allocated();
+			cycles = replay_cycles();
+			nsec = replay_nsec();
+
+			server_replay_pdu(&srv, recs[i].fd,
+					recs[i].pdu, recs[i].len);
+
+			stats[pid].nsec += replay_nsec() - nsec;
+			stats[pid].cycles += replay_cycles() - cycles;
+			stats[pid].alloc += replay_allocated() - alloc;
+			stats[pid].bytes += srv.sink - sink;
+			stats[pid].count ++;
+		}
+	}
+
+	memset(&total, 0, sizeof(total));
+
+	printf("%4s %10s %10s %10s %10s %10s %10s\n", "pid", "requests",
+		"req/sec", "nsec/req", "cycles/req", "bytes/req", "alloc/req");
+
+	for (pid = 0; pid < 256; pid ++) {
+		if (stats[pid].count == 0)
+			continue;
+
+		printf("0x%02x %10ju %10ju %10ju %10ju %10ju %10ju\n", pid,
+			(uintmax_t) stats[pid].count,
+			(uintmax_t) (stats[pid].count * 1000000000ULL /
+				(stats[pid].nsec + 1)),
+			(uintmax_t) (stats[pid].nsec / stats[pid].count),
+			(uintmax_t) (stats[pid].cycles / stats[pid].count),
+			(uintmax_t) (stats[pid].bytes / stats[pid].count),
+			(uintmax_t) (stats[pid].alloc / stats[pid].count));
+
+		total.count += stats[pid].count;
+		total.nsec += stats[pid].nsec;
+	}
+
+	printf("%4s %10ju %10ju\n", "all", (uintmax_t) total.count,
+		(uintmax_t) (total.count * 1000000000ULL / (total.nsec + 1)));
+
+out:
+	server_shutdown(&srv);
+	free(recs);
+	free(stats);
+	free(buf);
+
+	return (error);
+}
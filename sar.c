@@ -38,13 +38,20 @@
 #include <errno.h>
 #include <sdp.h>
 #include <stdio.h> /* for NULL */
+#include "de.h"
+#include "plan.h"
+#include "probes.h"
 #include "profile.h"
 #include "provider.h"
+#include "timer.h"
 #include "server.h"
 
+/* Number of attributes encoded so far. Used to charge peers for work */
+uint32_t	server_attrs_encoded = 0;
+
 /*
- * Prepare SDP attr/value pair. Check if profile implements the attribute
- * and if so call the attribute value function.
+ * Prepare SDP attr/value pair. Call the attribute value function of the
+ * profile.
  *
  * uint16 value16	- 3 bytes (attribute)
  * value		- N bytes (value)
@@ -52,25 +59,24 @@
 
 static int32_t
 server_prepare_attr_value_pair(
-		provider_p const provider, uint16_t attr,
+		provider_p const provider, attr_t const *attr,
 		uint8_t *buf, uint8_t const * const eob)
 {
-	profile_attr_create_p	cf = profile_get_attr(provider->profile, attr);
-	int32_t			len;
-
-	if (cf == NULL)
-		return (0); /* no attribute */
+	int32_t	len;
 
 	if (buf + 3 > eob)
 		return (-1);
 
 	SDP_PUT8(SDP_DATA_UINT16, buf);
-	SDP_PUT16(attr, buf);
+	SDP_PUT16(attr->attr, buf);
 
-	len = cf(buf, eob, (uint8_t const *) provider, sizeof(*provider));
+	len = attr->create(buf, eob, (uint8_t const *) provider,
+			sizeof(*provider));
 	if (len < 0)
 		return (-1);
 
+	server_attrs_encoded ++;
+
 	return (3 + len);
 }
 
@@ -78,46 +84,38 @@ server_prepare_attr_value_pair(
  * seq16 value16	- 3 bytes
  *	attr value	- 3+ bytes
  *	[ attr value ]
+ *
+ * Attributes go out sorted by id, once each.
  */
 
 int32_t
-server_prepare_attr_list(provider_p const provider,
-		uint8_t const *req, uint8_t const * const req_end,
+server_prepare_attr_list_plan(provider_p const provider, plan_p plan,
 		uint8_t *rsp, uint8_t const * const rsp_end)
 {
-	uint8_t	*ptr = rsp + 3;
-	int32_t	 type, hi, lo, len;
+	attr_t const	*attrs = provider->profile->attrs;
+	plan_view_p	 view = plan_view(plan, provider->profile);
+	uint8_t		*ptr = rsp + 3;
+	int32_t		 i, len;
 
 	if (ptr > rsp_end)
 		return (-1);
 
-	while (req < req_end) {
-		SDP_GET8(type, req);
-
-		switch (type) {
-		case SDP_DATA_UINT16:
-			if (req + 2 > req_end)
-				return (-1);
-
-			SDP_GET16(lo, req);
-			hi = lo;
-			break;
-
-		case SDP_DATA_UINT32:
-			if (req + 4 > req_end)
+	if (view != NULL) {
+		for (i = 0; i < view->n; i ++) {
+			len = server_prepare_attr_value_pair(provider,
+					&attrs[view->attrs[i]], ptr, rsp_end);
+			if (len < 0)
 				return (-1);
 
-			SDP_GET16(lo, req);
-			SDP_GET16(hi, req);
-			break;
-
-		default:
-			return (-1);
-			/* NOT REACHED */
+			ptr += len;
 		}
+	} else {
+		for (i = 0; attrs[i].create != NULL; i ++) {
+			if (!plan_has(plan, attrs[i].attr))
+				continue;
 
-		for (; lo <= hi; lo ++) {
-			len = server_prepare_attr_value_pair(provider, lo, ptr, rsp_end);
+			len = server_prepare_attr_value_pair(provider,
+					&attrs[i], ptr, rsp_end);
 			if (len < 0)
 				return (-1);
 
@@ -127,6 +125,8 @@ server_prepare_attr_list(provider_p const provider,
 
 	len = ptr - rsp; /* we put this much bytes in rsp */
 
+	SDPD_PROBE2(attr__list, provider->handle, len);
+
 	/* Fix SEQ16 header for the rsp */
 	SDP_PUT8(SDP_DATA_SEQ16, rsp);
 	SDP_PUT16(len - 3, rsp);
@@ -134,6 +134,23 @@ server_prepare_attr_list(provider_p const provider,
 	return (len);
 }
 
+/*
+ * Same as above, but AttributeIDList is compiled first
+ */
+
+int32_t
+server_prepare_attr_list(provider_p const provider,
+		uint8_t const *req, uint8_t const * const req_end,
+		uint8_t *rsp, uint8_t const * const rsp_end)
+{
+	plan_p	plan = plan_get(req, req_end);
+
+	if (plan == NULL)
+		return (-1);
+
+	return (server_prepare_attr_list_plan(provider, plan, rsp, rsp_end));
+}
+
 /*
  * Prepare SDP Service Attribute Response
  */
@@ -146,13 +163,12 @@ server_prepare_service_attribute_response(server_p srv, int32_t fd)
 	uint8_t		*rsp = srv->fdidx[fd].rsp;
 	uint8_t const	*rsp_end = rsp + NG_L2CAP_MTU_MAXIMUM;
 
-	uint8_t		*ptr = NULL;
 	provider_t	*provider = NULL;
-	uint32_t	 handle;
-	int32_t		 type, rsp_limit, aidlen, cslen, cs;
+	int32_t		 cs, error;
+	de_req_t	 r;
 
 	/*
-	 * Minimal Service Attribute Request request
+	 * Service Attribute Request
 	 *
 	 * value32		- 4 bytes ServiceRecordHandle
 	 * value16		- 2 bytes MaximumAttributeByteCount
@@ -161,57 +177,18 @@ server_prepare_service_attribute_response(server_p srv, int32_t fd)
 	 * value8		- 1 byte  ContinuationState
 	 */
 
-	if (req_end - req < 12)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	/* Get ServiceRecordHandle and MaximumAttributeByteCount */
-	SDP_GET32(handle, req);
-	SDP_GET16(rsp_limit, req);
-	if (rsp_limit <= 0)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	/* Get size of AttributeIDList */
-	aidlen = 0;
-	SDP_GET8(type, req);
-	switch (type) {
-	case SDP_DATA_SEQ8:
-		SDP_GET8(aidlen, req);
-		break;
-
-	case SDP_DATA_SEQ16:
-		SDP_GET16(aidlen, req);
-		break;
-
-	case SDP_DATA_SEQ32:
-		SDP_GET32(aidlen, req);
- 		break;
-	}
-	if (aidlen <= 0)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	ptr = (uint8_t *) req + aidlen;
-
-	/* Get ContinuationState */
-	if (ptr + 1 > req_end)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-		
-	SDP_GET8(cslen, ptr);
-	if (cslen != 0) {
-		if (cslen != 2 || req_end - ptr != 2)
-			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-		SDP_GET16(cs, ptr);
-	} else
-		cs = 0;
+	error = de_parse(SDP_PDU_SERVICE_ATTRIBUTE_REQUEST, req, req_end, &r);
+	if (error != 0)
+		return (error);
 
 	/* Process the request. First, check continuation state */
-	if (srv->fdidx[fd].rsp_cs != cs)
+	if (srv->fdidx[fd].rsp_cs != r.cs)
 		return (SDP_ERROR_CODE_INVALID_CONTINUATION_STATE);
 	if (srv->fdidx[fd].rsp_size > 0)
 		return (0);
 
 	/* Lookup record handle */
-	if ((provider = provider_by_handle(handle)) == NULL)
+	if ((provider = provider_by_handle(r.handle)) == NULL)
 		return (SDP_ERROR_CODE_INVALID_SERVICE_RECORD_HANDLE);
 
 	/*
@@ -223,14 +200,14 @@ server_prepare_service_attribute_response(server_p srv, int32_t fd)
 	 *	[ attr value ]
 	 */
 
-	cs = server_prepare_attr_list(provider, req, req+aidlen, rsp, rsp_end);
+	cs = server_prepare_attr_list(provider, r.aid, r.aid_end, rsp, rsp_end);
 	if (cs < 0)
 		return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
 
 	/* Set reply size (not counting PDU header and continuation state) */
 	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t) - 2;
-	if (srv->fdidx[fd].rsp_limit > rsp_limit)
-		srv->fdidx[fd].rsp_limit = rsp_limit;
+	if (srv->fdidx[fd].rsp_limit > r.limit)
+		srv->fdidx[fd].rsp_limit = r.limit;
 
 	srv->fdidx[fd].rsp_size = cs;
 	srv->fdidx[fd].rsp_cs = 0;
@@ -301,9 +278,7 @@ server_send_service_attribute_response(server_p srv, int32_t fd)
 	iov[3].iov_base = cs;
 	iov[3].iov_len = 1 + cs[0];
 
-	do {
-		size = writev(fd, (struct iovec const *) &iov, sizeof(iov)/sizeof(iov[0]));
-	} while (size < 0 && errno == EINTR);
+	size = server_writev(srv, fd, iov, sizeof(iov)/sizeof(iov[0]));
 
 	/* Check if we have sent (or failed to sent) last response chunk */
 	if (srv->fdidx[fd].rsp_cs == srv->fdidx[fd].rsp_size) {
@@ -0,0 +1,303 @@
+/*
+ * sbr.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <sdp.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+#include "provider.h"
+#include "timer.h"
+#include "server.h"
+
+/*
+ * Prepare Service Register Batch response. The whole batch is checked
+ * before anything is registered, so either all records are registered
+ * or none of them.
+ */
+
+int32_t
+server_prepare_service_register_batch_response(server_p srv, int32_t fd)
+{
+	uint8_t const	*req = srv->req + sizeof(sdp_pdu_t);
+	uint8_t const	*req_end = req + ((sdp_pdu_p)(srv->req))->len;
+	uint8_t		*rsp = srv->fdidx[fd].rsp;
+
+	uint8_t const	*ptr = NULL;
+	provider_entry_p entries = NULL;
+	bdaddr_p	 bdaddr = NULL;
+	int32_t		 count, i, uuid, datalen;
+
+	/*
+	 * Minimal Service Register Batch Request
+	 *
+	 * value16	- count 2 bytes
+	 *	value16	- uuid 2 bytes
+	 *	bdaddr	- BD_ADDR 6 bytes
+	 *	value16	- data length 2 bytes
+	 *	data	- data length bytes
+	 *	[ uuid bdaddr length data ]
+	 */
+
+	if (!srv->fdidx[fd].control ||
+	    !srv->fdidx[fd].priv || req_end - req < 12)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	SDP_GET16(count, req);
+	if (count == 0)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	/* Make sure all handles will fit into the reply */
+	if (4 + 4 * count >= srv->fdidx[fd].omtu - sizeof(sdp_pdu_t))
+		return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+
+	/* Check every entry first */
+	for (i = 0, ptr = req; i < count; i ++) {
+		if (req_end - ptr < 10)
+			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+		SDP_GET16(uuid, ptr);
+		ptr += sizeof(*bdaddr);
+		SDP_GET16(datalen, ptr);
+
+		if (req_end - ptr < datalen ||
+		    profile_get_descriptor(uuid) == NULL)
+			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+		ptr += datalen;
+	}
+	if (ptr != req_end)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	/*
+	 * Service Register Batch Response format
+	 *
+	 * value16	- 2 bytes error code (always 0)
+	 * value16	- 2 bytes count
+	 * value32	- 4 bytes handle
+	 * [ value32 ]
+	 */
+
+	entries = calloc(count, sizeof(entries[0]));
+	if (entries == NULL)
+		return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+
+	for (i = 0, ptr = req; i < count; i ++) {
+		SDP_GET16(uuid, ptr);
+		bdaddr = (bdaddr_p) ptr;
+		ptr += sizeof(*bdaddr);
+		SDP_GET16(datalen, ptr);
+
+		entries[i].profile = profile_get_descriptor(uuid);
+		entries[i].bdaddr = bdaddr;
+		entries[i].data = ptr;
+		entries[i].datalen = datalen;
+
+		ptr += datalen;
+	}
+
+	/* Out of memory. Nothing has been registered */
+	if (provider_register_batch(fd, entries, count) < 0) {
+		free(entries);
+		return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+	}
+
+	SDP_PUT16(0, rsp);
+	SDP_PUT16(count, rsp);
+
+	for (i = 0; i < count; i ++)
+		SDP_PUT32(entries[i].provider->handle, rsp);
+
+	free(entries);
+
+	/* Set reply size */
+	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t);
+	srv->fdidx[fd].rsp_size = rsp - srv->fdidx[fd].rsp;
+	srv->fdidx[fd].rsp_cs = 0;
+
+	return (0);
+}
+
+/*
+ * Prepare Service Unregister Batch response
+ */
+
+int32_t
+server_prepare_service_unregister_batch_response(server_p srv, int32_t fd)
+{
+	uint8_t const	*req = srv->req + sizeof(sdp_pdu_t);
+	uint8_t const	*req_end = req + ((sdp_pdu_p)(srv->req))->len;
+	uint8_t		*rsp = srv->fdidx[fd].rsp;
+
+	uint8_t const	*ptr = NULL;
+	provider_p	 provider = NULL;
+	int32_t		 count, i;
+	uint32_t	 handle;
+
+	/*
+	 * Minimal Service Unregister Batch Request
+	 *
+	 * value16	- count 2 bytes
+	 *	value32	- handle 4 bytes
+	 *	[ value32 ]
+	 */
+
+	if (!srv->fdidx[fd].control ||
+	    !srv->fdidx[fd].priv || req_end - req < 6)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	SDP_GET16(count, req);
+	if (count == 0 || req_end - req != 4 * count)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	/* Check every handle first */
+	for (i = 0, ptr = req; i < count; i ++) {
+		SDP_GET32(handle, ptr);
+
+		provider = provider_by_handle(handle);
+		if (provider == NULL || provider->fd != fd)
+			return (SDP_ERROR_CODE_INVALID_SERVICE_RECORD_HANDLE);
+	}
+
+	provider_batch_begin();
+
+	for (i = 0, ptr = req; i < count; i ++) {
+		SDP_GET32(handle, ptr);
+
+		/* Same handle could be listed more than once */
+		provider = provider_by_handle(handle);
+		if (provider != NULL)
+			provider_unregister(provider);
+	}
+
+	provider_batch_end();
+
+	SDP_PUT16(0, rsp);
+
+	/* Set reply size */
+	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t);
+	srv->fdidx[fd].rsp_size = rsp - srv->fdidx[fd].rsp;
+	srv->fdidx[fd].rsp_cs = 0;
+
+	return (0);
+}
+
+/*
+ * Prepare Service Change Batch response. All entries are validated and
+ * memory for the new data is allocated before any record is changed.
+ */
+
+int32_t
+server_prepare_service_change_batch_response(server_p srv, int32_t fd)
+{
+	uint8_t const	*req = srv->req + sizeof(sdp_pdu_t);
+	uint8_t const	*req_end = req + ((sdp_pdu_p)(srv->req))->len;
+	uint8_t		*rsp = srv->fdidx[fd].rsp;
+
+	uint8_t const	*ptr = NULL;
+	provider_p	 provider = NULL;
+	provider_entry_p entries = NULL;
+	int32_t		 count, i, datalen;
+	uint32_t	 handle;
+
+	/*
+	 * Minimal Service Change Batch Request
+	 *
+	 * value16	- count 2 bytes
+	 *	value32	- handle 4 bytes
+	 *	value16	- data length 2 bytes
+	 *	data	- data length bytes
+	 *	[ handle length data ]
+	 */
+
+	if (!srv->fdidx[fd].control ||
+	    !srv->fdidx[fd].priv || req_end - req < 8)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	SDP_GET16(count, req);
+	if (count == 0)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	/* Check every entry first */
+	for (i = 0, ptr = req; i < count; i ++) {
+		if (req_end - ptr < 6)
+			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+		SDP_GET32(handle, ptr);
+		SDP_GET16(datalen, ptr);
+		if (req_end - ptr < datalen)
+			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+		provider = provider_by_handle(handle);
+		if (provider == NULL || provider->fd != fd)
+			return (SDP_ERROR_CODE_INVALID_SERVICE_RECORD_HANDLE);
+
+		if (datalen < provider->profile->dsize ||
+		    provider->profile->valid == NULL ||
+		    (provider->profile->valid)(ptr, datalen) == 0)
+			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+		ptr += datalen;
+	}
+	if (ptr != req_end)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	entries = calloc(count, sizeof(entries[0]));
+	if (entries == NULL)
+		return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+
+	for (i = 0, ptr = req; i < count; i ++) {
+		SDP_GET32(handle, ptr);
+		SDP_GET16(datalen, ptr);
+
+		entries[i].provider = provider_by_handle(handle);
+		entries[i].data = ptr;
+		entries[i].datalen = datalen;
+
+		ptr += datalen;
+	}
+
+	i = provider_update_batch(entries, count);
+	free(entries);
+
+	if (i < 0)
+		return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+
+	SDP_PUT16(0, rsp);
+
+	/* Set reply size */
+	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t);
+	srv->fdidx[fd].rsp_size = rsp - srv->fdidx[fd].rsp;
+	srv->fdidx[fd].rsp_cs = 0;
+
+	return (0);
+}
+
@@ -0,0 +1,392 @@
+/*
+ * sdpshm.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sdp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sdpshm.h"
+
+/*
+ * Reader of the service database published by sdpd (see sdpshm.h).
+ * Nothing read from a buffer is trusted until its sequence number is
+ * checked, so everything is bounds checked first.
+ */
+
+struct sdpshm
+{
+	char		*path;		/* published file */
+	uint8_t		*base;		/* mapped file */
+	uint32_t	 size;		/* mapped size */
+};
+
+static int32_t	sdpshm_map	(sdpshm_p shm);
+static void	sdpshm_unmap	(sdpshm_p shm);
+static uint8_t const *
+		sdpshm_begin	(sdpshm_p shm, uint32_t *b, uint32_t *seq);
+static int32_t	sdpshm_end	(sdpshm_p shm, uint32_t b, uint32_t seq);
+static int32_t	sdpshm_find	(uint8_t const *buf, uint32_t size,
+				 uint16_t uuid, uint32_t *handles,
+				 int32_t max);
+static int32_t	sdpshm_get	(uint8_t const *buf, uint32_t size,
+				 uint32_t handle, uint8_t *attrs,
+				 int32_t max);
+
+/*
+ * Open published service database. NULL path means SDPSHM_PATH.
+ */
+
+sdpshm_p
+sdpshm_open(char const *path)
+{
+	sdpshm_p	shm = NULL;
+
+	shm = (sdpshm_p) calloc(1, sizeof(*shm));
+	if (shm == NULL)
+		return (NULL);
+
+	shm->path = strdup((path != NULL)? path : SDPSHM_PATH);
+	if (shm->path == NULL || sdpshm_map(shm) < 0) {
+		free(shm->path);
+		free(shm);
+		return (NULL);
+	}
+
+	return (shm);
+}
+
+/*
+ * Close published service database
+ */
+
+void
+sdpshm_close(sdpshm_p shm)
+{
+	if (shm == NULL)
+		return;
+
+	sdpshm_unmap(shm);
+	free(shm->path);
+	free(shm);
+}
+
+/*
+ * Search for records of the profile, public browse group matches every
+ * record. Returns number of record handles stored (up to max) or -1.
+ * Database state the handles were taken from is stored in state.
+ */
+
+int32_t
+sdpshm_search(sdpshm_p shm, uint16_t uuid, uint32_t *handles, int32_t max,
+		uint32_t *state)
+{
+	struct sdpshm_db const	*db = NULL;
+	uint8_t const		*buf = NULL;
+	uint32_t		 b, seq, st;
+	int32_t			 i, n;
+
+	for (i = 0; i < SDPSHM_RETRIES; i ++) {
+		buf = sdpshm_begin(shm, &b, &seq);
+		if (buf == NULL) {
+			if (shm->base == NULL)
+				return (-1);
+			continue;
+		}
+
+		db = (struct sdpshm_db const *) buf;
+		n = sdpshm_find(buf, ((struct sdpshm_hdr *) shm->base)->buf_size,
+				uuid, handles, max);
+		st = db->change_state;
+
+		if (sdpshm_end(shm, b, seq) && n >= 0) {
+			if (state != NULL)
+				*state = st;
+
+			return (n);
+		}
+	}
+
+	errno = EAGAIN;
+
+	return (-1);
+}
+
+/*
+ * Copy attribute list of the record (sequence of all attribute ID and
+ * value pairs, as in Service Attribute Response) into buf. Returns size
+ * of the list or -1.
+ */
+
+int32_t
+sdpshm_attrs(sdpshm_p shm, uint32_t handle, uint8_t *buf, int32_t size,
+		uint32_t *state)
+{
+	struct sdpshm_db const	*db = NULL;
+	uint8_t const		*data = NULL;
+	uint32_t		 b, seq, st;
+	int32_t			 i, n;
+
+	for (i = 0; i < SDPSHM_RETRIES; i ++) {
+		data = sdpshm_begin(shm, &b, &seq);
+		if (data == NULL) {
+			if (shm->base == NULL)
+				return (-1);
+			continue;
+		}
+
+		db = (struct sdpshm_db const *) data;
+		n = sdpshm_get(data, ((struct sdpshm_hdr *) shm->base)->buf_size,
+				handle, buf, size);
+		st = db->change_state;
+
+		if (sdpshm_end(shm, b, seq)) {
+			if (n == -1) {
+				errno = ENOENT;
+				return (-1);
+			}
+			if (n == -2) {
+				errno = ENOSPC;
+				return (-1);
+			}
+			if (n >= 0) {
+				if (state != NULL)
+					*state = st;
+
+				return (n);
+			}
+		}
+	}
+
+	errno = EAGAIN;
+
+	return (-1);
+}
+
+/*
+ * Map the file and check the header
+ */
+
+static int32_t
+sdpshm_map(sdpshm_p shm)
+{
+	struct sdpshm_hdr const	*hdr = NULL;
+	struct stat		 st;
+	int32_t			 fd, i;
+
+	fd = open(shm->path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return (-1);
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr) ||
+	    st.st_size > UINT32_MAX) {
+		close(fd);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	shm->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shm->base == MAP_FAILED) {
+		shm->base = NULL;
+		return (-1);
+	}
+
+	shm->size = st.st_size;
+	hdr = (struct sdpshm_hdr const *) shm->base;
+
+	if (memcmp(hdr->magic, SDPSHM_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != SDPSHM_VERSION || hdr->size != shm->size ||
+	    hdr->buf_size < sizeof(struct sdpshm_db))
+		goto fail;
+
+	for (i = 0; i < 2; i ++)
+		if (hdr->buf_off[i] < sizeof(*hdr) ||
+		    hdr->buf_off[i] % sizeof(uint64_t) != 0 ||
+		    hdr->buf_off[i] > shm->size ||
+		    hdr->buf_size > shm->size - hdr->buf_off[i])
+			goto fail;
+
+	return (0);
+fail:
+	sdpshm_unmap(shm);
+	errno = EINVAL;
+
+	return (-1);
+}
+
+static void
+sdpshm_unmap(sdpshm_p shm)
+{
+	if (shm->base != NULL)
+		munmap(shm->base, shm->size);
+
+	shm->base = NULL;
+	shm->size = 0;
+}
+
+/*
+ * Start reading. Returns current buffer or NULL if it is being written
+ * (or the file could not be mapped, then base is NULL).
+ */
+
+static uint8_t const *
+sdpshm_begin(sdpshm_p shm, uint32_t *b, uint32_t *seq)
+{
+	struct sdpshm_hdr	*hdr = (struct sdpshm_hdr *) shm->base;
+
+	if (hdr == NULL ||
+	    atomic_load_explicit(&hdr->moved, memory_order_acquire)) {
+		sdpshm_unmap(shm);
+		if (sdpshm_map(shm) < 0)
+			return (NULL);
+
+		hdr = (struct sdpshm_hdr *) shm->base;
+	}
+
+	*b = atomic_load_explicit(&hdr->current, memory_order_acquire) & 1;
+	*seq = atomic_load_explicit(&hdr->seq[*b], memory_order_acquire);
+	if (*seq & 1)
+		return (NULL);
+
+	return (shm->base + hdr->buf_off[*b]);
+}
+
+/*
+ * Check that the buffer has not changed while it was read
+ */
+
+static int32_t
+sdpshm_end(sdpshm_p shm, uint32_t b, uint32_t seq)
+{
+	struct sdpshm_hdr	*hdr = (struct sdpshm_hdr *) shm->base;
+
+	atomic_thread_fence(memory_order_acquire);
+
+	return (atomic_load_explicit(&hdr->seq[b], memory_order_relaxed)
+			== seq);
+}
+
+/*
+ * Find records of the profile in the buffer
+ */
+
+static int32_t
+sdpshm_find(uint8_t const *buf, uint32_t size, uint16_t uuid,
+		uint32_t *handles, int32_t max)
+{
+	struct sdpshm_db const	*db = (struct sdpshm_db const *) buf;
+	struct sdpshm_rec const	*recs = (struct sdpshm_rec const *) (db + 1);
+	uint32_t const		*idx = NULL;
+	uint32_t		 nrecs = db->nrecs, lo, hi, mid;
+	int32_t			 n = 0;
+
+	if (nrecs > (size - sizeof(*db)) / (sizeof(*recs) + sizeof(*idx)))
+		return (-1);
+
+	idx = (uint32_t const *) (recs + nrecs);
+
+	if (uuid == SDP_SERVICE_CLASS_PUBLIC_BROWSE_GROUP) {
+		for (lo = 0; lo < nrecs && n < max; lo ++)
+			handles[n ++] = recs[lo].handle;
+
+		return (n);
+	}
+
+	/* First record of the profile */
+	for (lo = 0, hi = nrecs; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (idx[mid] >= nrecs)
+			return (-1);
+
+		if (recs[idx[mid]].uuid < uuid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < nrecs && n < max; lo ++) {
+		if (idx[lo] >= nrecs)
+			return (-1);
+		if (recs[idx[lo]].uuid != uuid)
+			break;
+
+		handles[n ++] = recs[idx[lo]].handle;
+	}
+
+	return (n);
+}
+
+/*
+ * Copy attribute list of the record from the buffer. Returns size of
+ * the list, -1 if there is no such record, -2 if it does not fit or
+ * -3 if the buffer is not consistent.
+ */
+
+static int32_t
+sdpshm_get(uint8_t const *buf, uint32_t size, uint32_t handle,
+		uint8_t *attrs, int32_t max)
+{
+	struct sdpshm_db const	*db = (struct sdpshm_db const *) buf;
+	struct sdpshm_rec const	*recs = (struct sdpshm_rec const *) (db + 1);
+	struct sdpshm_rec const	*rec = NULL;
+	uint32_t		 nrecs = db->nrecs, lo, hi, mid;
+
+	if (nrecs > (size - sizeof(*db)) / (sizeof(*recs) + sizeof(uint32_t)))
+		return (-3);
+
+	for (lo = 0, hi = nrecs; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (recs[mid].handle < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == nrecs || recs[lo].handle != handle)
+		return (-1);
+
+	rec = &recs[lo];
+	if (rec->off > size || rec->len > size - rec->off)
+		return (-3);
+	if (rec->len > max)
+		return (-2);
+
+	memcpy(attrs, buf + rec->off, rec->len);
+
+	return (rec->len);
+}
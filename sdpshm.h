@@ -0,0 +1,108 @@
+/*
+ * sdpshm.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _SDPSHM_H_
+#define _SDPSHM_H_
+
+/*
+ * Service database published by sdpd in a shared file, so local
+ * clients can search it and read records without a round trip over the
+ * control socket. Include <stdint.h> and <stdatomic.h> first.
+ *
+ * The file has a header and two buffers. The server writes a complete
+ * copy of the database into the buffer readers are not told to use,
+ * then makes it current. Every buffer has a sequence number that is odd
+ * while the buffer is being written; readers copy what they need and
+ * check that the sequence number has not changed. When the file has to
+ * grow, or the server restarts, a new file replaces the old one and the
+ * old one is marked moved, so readers open the path again.
+ *
+ * The file is in host byte order and is only meant to be read on the
+ * same machine.
+ */
+
+#define	SDPSHM_MAGIC		"sdpdshm"	/* incl. '\0' */
+#define	SDPSHM_VERSION		1
+#define	SDPSHM_PATH		"/var/run/sdp.shm"
+#define	SDPSHM_RETRIES		1000		/* reads before giving up */
+
+struct sdpshm_hdr
+{
+	uint8_t			magic[8];	/* SDPSHM_MAGIC */
+	uint32_t		version;	/* SDPSHM_VERSION */
+	uint32_t		size;		/* file size */
+	uint32_t		buf_off[2];	/* buffers */
+	uint32_t		buf_size;	/* size of each buffer */
+	_Atomic uint32_t	moved;		/* open the path again */
+	_Atomic uint32_t	current;	/* buffer to read */
+	_Atomic uint32_t	seq[2];		/* odd while being written */
+};
+
+/*
+ * Buffer: sdpshm_db, then nrecs records sorted by handle, then nrecs
+ * record indexes sorted by profile UUID and handle, then attribute
+ * lists. Offsets are from the start of the buffer.
+ */
+
+struct sdpshm_db
+{
+	uint32_t		gen;		/* publish generation */
+	uint32_t		change_state;	/* ServiceDatabaseState */
+	uint32_t		nrecs;		/* number of records */
+	uint32_t		used;		/* bytes used */
+};
+
+struct sdpshm_rec
+{
+	uint32_t		handle;		/* record handle */
+	uint16_t		uuid;		/* profile UUID */
+	uint16_t		pad;
+	uint32_t		off;		/* attribute list */
+	uint32_t		len;		/* attribute list size */
+	uint64_t		key;		/* packed BD_ADDR, 0 - any */
+};
+
+/*
+ * Reader
+ */
+
+struct sdpshm;
+typedef struct sdpshm	sdpshm_t;
+typedef struct sdpshm *	sdpshm_p;
+
+sdpshm_p	sdpshm_open	(char const *path);
+void		sdpshm_close	(sdpshm_p shm);
+int32_t		sdpshm_search	(sdpshm_p shm, uint16_t uuid,
+				 uint32_t *handles, int32_t max,
+				 uint32_t *state);
+int32_t		sdpshm_attrs	(sdpshm_p shm, uint32_t handle,
+				 uint8_t *buf, int32_t size,
+				 uint32_t *state);
+
+#endif /* ndef _SDPSHM_H_ */
@@ -0,0 +1,256 @@
+/*
+ * sdr.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <sdp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "profile.h"
+#include "provider.h"
+#include "timer.h"
+#include "server.h"
+
+/* from sar.c */
+int32_t server_prepare_attr_list(provider_p const provider,
+		uint8_t const *req, uint8_t const * const req_end,
+		uint8_t *rsp, uint8_t const * const rsp_end);
+
+/*
+ * Prepare Service Dump response. Nothing to prepare really, records are
+ * encoded one by one while they are sent.
+ */
+
+int32_t
+server_prepare_service_dump_response(server_p srv, int32_t fd)
+{
+	/*
+	 * Service Dump Request has no parameters
+	 */
+
+	if (!srv->fdidx[fd].control || !srv->fdidx[fd].priv ||
+	    ((sdp_pdu_p)(srv->req))->len != 0)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	srv->fdidx[fd].rsp_cs = 0;
+	srv->fdidx[fd].rsp_size = 0;
+	srv->fdidx[fd].rsp_limit = 0;
+
+	return (0);
+}
+
+/*
+ * Service Dump in progress. Handles of the records are taken when the
+ * dump starts, records are looked up and encoded one by one as the
+ * client reads them, so a slow client does not hold the server.
+ */
+
+struct server_dump
+{
+	uint16_t	tid;		/* request transaction ID */
+	uint8_t		done;		/* terminator is in buf */
+	uint32_t	count;		/* records sent */
+	uint32_t	next;		/* next record in handles */
+	uint32_t	nhandles;	/* number of records */
+	uint32_t	off;		/* sent part of buf */
+	uint32_t	len;		/* size of buf */
+	uint8_t		buf[sizeof(sdp_pdu_t) + NG_L2CAP_MTU_MAXIMUM];
+	uint32_t	handles[];	/* records to send */
+};
+
+/*
+ * Put next Service Dump response PDU in the buffer. Every record goes
+ * out in its own PDU
+ *
+ * value8	- 1 byte, 1 - record follows
+ * value32	- 4 bytes record handle
+ * bdaddr	- 6 bytes record BD_ADDR
+ * seq16 len16	- 3 bytes
+ *	attr value	- 3+ bytes AttributeList
+ *
+ * and the stream is terminated with
+ *
+ * value8	- 1 byte, 0 - no more records
+ * value32	- 4 bytes number of records sent
+ *
+ * Records removed since the dump has started are skipped.
+ */
+
+static int32_t
+server_dump_next(struct server_dump *d)
+{
+	static uint8_t const	all_attrs[] = {
+		SDP_DATA_UINT32, 0x00, 0x00, 0xff, 0xff
+	};
+
+	sdp_pdu_p	 pdu = (sdp_pdu_p) d->buf;
+	uint8_t		*rsp = d->buf + sizeof(*pdu);
+	uint8_t const	*rsp_end = d->buf + sizeof(d->buf);
+	uint8_t		*ptr = rsp;
+	provider_p	 provider = NULL;
+	int32_t		 len;
+
+	while (d->next < d->nhandles && provider == NULL)
+		provider = provider_by_handle(d->handles[d->next ++]);
+
+	if (provider != NULL) {
+		SDP_PUT8(1, ptr);
+		SDP_PUT32(provider->handle, ptr);
+		memcpy(ptr, &provider->bdaddr, sizeof(bdaddr_t));
+		ptr += sizeof(bdaddr_t);
+
+		len = server_prepare_attr_list(provider, all_attrs,
+			all_attrs + sizeof(all_attrs), ptr, rsp_end);
+		if (len < 0)
+			return (-1);
+
+		ptr += len;
+		d->count ++;
+	} else {
+		SDP_PUT8(0, ptr);
+		SDP_PUT32(d->count, ptr);
+		d->done = 1;
+	}
+
+	pdu->pid = SDP_PDU_SERVICE_DUMP_RESPONSE;
+	pdu->tid = d->tid;
+	pdu->len = htons(ptr - rsp);
+
+	d->off = 0;
+	d->len = ptr - d->buf;
+
+	return (0);
+}
+
+/*
+ * Start Service Dump. Client is not read until the dump is complete.
+ */
+
+int32_t
+server_send_service_dump_response(server_p srv, int32_t fd)
+{
+	struct server_dump	*d = NULL;
+	provider_p		 provider = NULL;
+	uint32_t		 n = 0;
+
+	for (provider = provider_get_first();
+	     provider != NULL;
+	     provider = provider_get_next(provider))
+		n ++;
+
+	d = calloc(1, sizeof(*d) + n * sizeof(d->handles[0]));
+	if (d == NULL)
+		return (ENOMEM);
+
+	d->tid = ((sdp_pdu_p)(srv->req))->tid;
+
+	for (provider = provider_get_first();
+	     provider != NULL;
+	     provider = provider_get_next(provider))
+		d->handles[d->nhandles ++] = provider->handle;
+
+	srv->fdidx[fd].dump = d;
+	FD_CLR(fd, &srv->fdset);
+	FD_CLR(fd, &srv->ctlset);
+
+	return ((server_flush_dump(srv, fd, 0) < 0)? errno : 0);
+}
+
+/*
+ * Send as much of the dump as the client takes. Unless asked to wait,
+ * never block. Whatever could not be sent is left for later and the
+ * descriptor is added to the write set. When the dump is complete the
+ * client is read again. Returns -1 and errno if the dump has failed.
+ */
+
+int32_t
+server_flush_dump(server_p srv, int32_t fd, int32_t wait)
+{
+	struct server_dump	*d = srv->fdidx[fd].dump;
+	struct iovec		 iov;
+	int32_t			 size;
+
+	if (d == NULL)
+		return (0);
+
+	for (;;) {
+		if (d->off == d->len) {
+			if (d->done)
+				break;
+
+			if (server_dump_next(d) < 0) {
+				errno = ENOBUFS;
+				return (-1);
+			}
+		}
+
+		/* PDU is captured once, when it starts to go out */
+		if (d->off == 0) {
+			iov.iov_base = d->buf;
+			iov.iov_len = d->len;
+
+			size = server_sendv(srv, fd, &iov, 1,
+					wait? 0 : MSG_DONTWAIT);
+		} else {
+			do {
+				size = send(fd, d->buf + d->off,
+					d->len - d->off,
+					wait? 0 : MSG_DONTWAIT);
+			} while (size < 0 && errno == EINTR);
+		}
+
+		if (size < 0) {
+			if (errno == EAGAIN) {
+				FD_SET(fd, &srv->wfdset);
+				return (0);
+			}
+
+			return (-1);
+		}
+
+		d->off += size;
+	}
+
+	free(d);
+	srv->fdidx[fd].dump = NULL;
+
+	FD_CLR(fd, &srv->wfdset);
+	FD_SET(fd, &srv->fdset);
+	FD_SET(fd, &srv->ctlset);
+
+	return (0);
+}
@@ -31,15 +31,19 @@
 
 #include <sys/param.h>
 #include <sys/select.h>
+#include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
 #include <sys/ucred.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <bluetooth.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <pwd.h>
 #include <sdp.h>
 #include <stdio.h>
@@ -47,36 +51,66 @@
 #include <string.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <time.h>
+#include "capture.h"
+#include "handoff.h"
 #include "log.h"
+#include "match.h"
+#include "peer.h"
+#include "plan.h"
+#include "probes.h"
 #include "profile.h"
 #include "provider.h"
+#include "publish.h"
+#include "snapshot.h"
+#include "timer.h"
 #include "server.h"
 
 static void	server_accept_client		(server_p srv, int32_t fd);
+static void	server_add_client		(server_p srv, int32_t fd,
+						 int32_t cfd);
+static int32_t	server_open_control		(char const *control,
+						 int32_t backlog);
+static int32_t	server_open_l2cap		(int32_t backlog);
 static int32_t	server_process_request		(server_p srv, int32_t fd);
+static int32_t	server_process_buffer		(server_p srv, int32_t fd);
+static void	server_resume_dump		(server_p srv, int32_t fd);
+static int32_t	server_process_pdu		(server_p srv, int32_t fd,
+						 int32_t len);
 static int32_t	server_send_error_response	(server_p srv, int32_t fd,
 						 uint16_t error);
 static void	server_close_fd			(server_p srv, int32_t fd);
+static void	server_touch			(server_p srv, int32_t fd);
+static void	server_serve_class		(server_p srv, fd_set *fdset,
+						 int32_t control, int32_t start,
+						 int32_t nfds, uint64_t ready);
+static int32_t	server_serve_fd			(server_p srv, int32_t fd,
+						 uint64_t ready);
+static void	server_poll_control		(server_p srv);
+static uint64_t	server_usec			(void);
+static void	server_capture			(server_p srv, int32_t fd,
+						 int32_t recv,
+						 struct iovec const *iov,
+						 int32_t iovcnt);
+static int32_t	server_may_serve		(server_p srv, int32_t fd);
+static void	server_charge			(server_p srv, int32_t fd,
+						 uint32_t attrs, int32_t size);
+static timer_cb_t	server_idle_timeout;
+static timer_cb_t	server_cs_timeout;
+static timer_cb_t	server_defer_timeout;
+static timer_cb_t	server_compact_timeout;
+static timer_cb_t	server_orphans_timeout;
 
 /*
- * Initialize server
+ * Open control socket
  */
 
-int32_t
-server_init(server_p srv, char const *control)
+static int32_t
+server_open_control(char const *control, int32_t backlog)
 {
 	struct sockaddr_un	un;
-	struct sockaddr_l2cap	l2;
-	int32_t			unsock, l2sock;
-	socklen_t		size;
-	uint16_t		imtu;
-
-	assert(srv != NULL);
-	assert(control != NULL);
+	int32_t			unsock;
 
-	memset(srv, 0, sizeof(*srv));
-
-	/* Open control socket */
 	if (unlink(control) < 0 && errno != ENOENT) {
 		log_crit("Could not unlink(%s). %s (%d)",
 			control, strerror(errno), errno);
@@ -109,31 +143,34 @@ server_init(server_p srv, char const *control)
 		return (-1);
 	}
 
-	if (listen(unsock, 10) < 0) {
+	if (listen(unsock, backlog) < 0 ||
+	    fcntl(unsock, F_SETFL, O_NONBLOCK) < 0) {
 		log_crit("Could not listen on control socket. %s (%d)",
 			strerror(errno), errno);
 		close(unsock);
 		return (-1);
 	}
 
-	/* Open L2CAP socket */
+	return (unsock);
+}
+
+/*
+ * Open L2CAP socket
+ */
+
+static int32_t
+server_open_l2cap(int32_t backlog)
+{
+	struct sockaddr_l2cap	l2;
+	int32_t			l2sock;
+
 	l2sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BLUETOOTH_PROTO_L2CAP);
 	if (l2sock < 0) {
 		log_crit("Could not create L2CAP socket. %s (%d)",
 			strerror(errno), errno);
-		close(unsock);
 		return (-1);
 	}
 
-	size = sizeof(imtu);
-        if (getsockopt(l2sock, SOL_L2CAP, SO_L2CAP_IMTU, &imtu, &size) < 0) {
-		log_crit("Could not get L2CAP IMTU. %s (%d)",
-			strerror(errno), errno);
-		close(unsock);
-		close(l2sock);
-		return (-1);
-        }
-
 	memset(&l2, 0, sizeof(l2));
 	l2.l2cap_len = sizeof(l2);
 	l2.l2cap_family = AF_BLUETOOTH;
@@ -143,19 +180,56 @@ server_init(server_p srv, char const *control)
 	if (bind(l2sock, (struct sockaddr *) &l2, sizeof(l2)) < 0) {
 		log_crit("Could not bind L2CAP socket. %s (%d)",
 			strerror(errno), errno);
-		close(unsock);
 		close(l2sock);
 		return (-1);
 	}
 
-	if (listen(l2sock, 10) < 0) {
+	if (listen(l2sock, backlog) < 0 ||
+	    fcntl(l2sock, F_SETFL, O_NONBLOCK) < 0) {
 		log_crit("Could not listen on L2CAP socket. %s (%d)",
 			strerror(errno), errno);
-		close(unsock);
 		close(l2sock);
 		return (-1);
 	}
 
+	return (l2sock);
+}
+
+/*
+ * Initialize server. Listening sockets passed by the service manager
+ * are used as they are, the others (-1) are opened here.
+ */
+
+int32_t
+server_init(server_p srv, char const *control, int32_t backlog,
+		int32_t unsock, int32_t l2sock)
+{
+	socklen_t		size;
+	uint16_t		imtu;
+
+	assert(srv != NULL);
+	assert(control != NULL);
+
+	memset(srv, 0, sizeof(*srv));
+	srv->start = server_usec();
+
+	if (unsock < 0 && (unsock = server_open_control(control, backlog)) < 0)
+		return (-1);
+
+	if (l2sock < 0 && (l2sock = server_open_l2cap(backlog)) < 0) {
+		close(unsock);
+		return (-1);
+	}
+
+	size = sizeof(imtu);
+        if (getsockopt(l2sock, SOL_L2CAP, SO_L2CAP_IMTU, &imtu, &size) < 0) {
+		log_crit("Could not get L2CAP IMTU. %s (%d)",
+			strerror(errno), errno);
+		close(unsock);
+		close(l2sock);
+		return (-1);
+        }
+
 	/* Allocate incoming buffer */
 	srv->imtu = (imtu > SDP_LOCAL_MTU)? imtu : SDP_LOCAL_MTU;
 	srv->req = (uint8_t *) calloc(srv->imtu, sizeof(srv->req[0]));
@@ -191,10 +265,23 @@ server_init(server_p srv, char const *control)
 	 * to the index.
 	 */
 
+	timer_wheel_init(&srv->timers);
+	srv->control_idle = 0;
+	srv->l2cap_idle = SERVER_L2CAP_IDLE;
+	srv->cs_idle = SERVER_CS_IDLE;
+	srv->peer_rate = SERVER_PEER_RATE;
+	srv->peer_burst = SERVER_PEER_BURST;
+
+	timer_init(&srv->compact, server_compact_timeout, srv);
+	timer_add(&srv->timers, &srv->compact, SERVER_COMPACT_INTERVAL * 1000);
+
 	FD_ZERO(&srv->fdset);
+	FD_ZERO(&srv->wfdset);
+	FD_ZERO(&srv->ctlset);
 	srv->maxfd = (unsock > l2sock)? unsock : l2sock;
 	
 	FD_SET(unsock, &srv->fdset);
+	FD_SET(unsock, &srv->ctlset);
 	srv->fdidx[unsock].valid = 1;
 	srv->fdidx[unsock].server = 1;
 	srv->fdidx[unsock].control = 1;
@@ -216,9 +303,273 @@ server_init(server_p srv, char const *control)
 	srv->fdidx[l2sock].omtu = 0; /* unknown */
 	srv->fdidx[l2sock].rsp = NULL;
 
+	/* Tell subscribers about changes in service database */
+	provider_set_notify(server_notify, srv);
+
+	return (0);
+}
+
+/*
+ * Initialize server for replay. There are no sockets, clients are added
+ * with server_replay_client() and requests are fed with
+ * server_replay_pdu(). Responses are counted and dropped.
+ */
+
+int32_t
+server_init_replay(server_p srv)
+{
+	assert(srv != NULL);
+
+	memset(srv, 0, sizeof(*srv));
+
+	srv->replay = 1;
+	srv->imtu = NG_L2CAP_MTU_MAXIMUM;
+	srv->req = (uint8_t *) calloc(srv->imtu, sizeof(srv->req[0]));
+	if (srv->req == NULL) {
+		log_crit("Could not allocate request buffer");
+		return (-1);
+	}
+
+	srv->fdidx = (fd_idx_p) calloc(FD_SETSIZE, sizeof(srv->fdidx[0]));
+	if (srv->fdidx == NULL) {
+		log_crit("Could not allocate fd index");
+		free(srv->req);
+		return (-1);
+	}
+
+	/* Nobody owns Service Discovery profile */
+	if (provider_register_sd(-1) < 0) {
+		log_crit("Could not register Service Discovery profile");
+		free(srv->fdidx);
+		free(srv->req);
+		return (-1);
+	}
+
+	timer_wheel_init(&srv->timers);
+	srv->control_idle = 0;
+	srv->l2cap_idle = 0;
+	srv->cs_idle = 0;
+	srv->peer_rate = 0;
+	srv->peer_burst = 0;
+	srv->maxfd = -1;
+
+	FD_ZERO(&srv->fdset);
+	FD_ZERO(&srv->wfdset);
+	FD_ZERO(&srv->ctlset);
+
+	provider_set_notify(server_notify, srv);
+
+	return (0);
+}
+
+/*
+ * Initialize server for handoff. Descriptors and records come from the
+ * old process, see handoff.c. Descriptors are added with
+ * server_adopt_fd().
+ */
+
+int32_t
+server_init_handoff(server_p srv, uint32_t imtu)
+{
+	assert(srv != NULL);
+
+	memset(srv, 0, sizeof(*srv));
+
+	srv->start = server_usec();
+	srv->handoff = 1;
+	srv->imtu = (imtu > SDP_LOCAL_MTU)? imtu : SDP_LOCAL_MTU;
+	srv->req = (uint8_t *) calloc(srv->imtu, sizeof(srv->req[0]));
+	if (srv->req == NULL) {
+		log_crit("Could not allocate request buffer");
+		return (-1);
+	}
+
+	srv->fdidx = (fd_idx_p) calloc(FD_SETSIZE, sizeof(srv->fdidx[0]));
+	if (srv->fdidx == NULL) {
+		log_crit("Could not allocate fd index");
+		free(srv->req);
+		return (-1);
+	}
+
+	timer_wheel_init(&srv->timers);
+	srv->control_idle = 0;
+	srv->l2cap_idle = SERVER_L2CAP_IDLE;
+	srv->cs_idle = SERVER_CS_IDLE;
+	srv->peer_rate = SERVER_PEER_RATE;
+	srv->peer_burst = SERVER_PEER_BURST;
+	srv->maxfd = -1;
+
+	timer_init(&srv->compact, server_compact_timeout, srv);
+	timer_add(&srv->timers, &srv->compact, SERVER_COMPACT_INTERVAL * 1000);
+
+	FD_ZERO(&srv->fdset);
+	FD_ZERO(&srv->wfdset);
+	FD_ZERO(&srv->ctlset);
+
+	/* Records are put back before anybody is told about changes */
+	provider_set_notify(NULL, NULL);
+
+	return (0);
+}
+
+/*
+ * Add descriptor handed over by the old process to the index. Pending
+ * continuation and partially received request go with it.
+ */
+
+int32_t
+server_adopt_fd(server_p srv, int32_t fd, struct handoff_fd const *h,
+		uint8_t const *ibuf, uint8_t const *rsp)
+{
+	fd_idx_p	idx = NULL;
+
+	assert(srv->handoff);
+
+	if (fd < 0 || fd >= FD_SETSIZE || srv->fdidx[fd].valid ||
+	    h->ilen > srv->imtu || h->rsp_size > NG_L2CAP_MTU_MAXIMUM)
+		return (-1);
+
+	idx = &srv->fdidx[fd];
+
+	if (h->flags & HANDOFF_FD_SERVER) {
+		/* Service Discovery profile is attached to control socket */
+		if ((h->flags & HANDOFF_FD_CONTROL) &&
+		    provider_register_sd(fd) < 0) {
+			log_crit("Could not register Service Discovery " \
+				"profile");
+			return (-1);
+		}
+	} else {
+		idx->peer = peer_get(h->key, srv->peer_burst);
+		if (idx->peer == NULL)
+			goto fail;
+
+		if (h->flags & HANDOFF_FD_CONTROL) {
+			idx->ibuf = (uint8_t *) calloc(srv->imtu,
+						sizeof(idx->ibuf[0]));
+			if (idx->ibuf == NULL)
+				goto fail;
+
+			memcpy(idx->ibuf, ibuf, h->ilen);
+			idx->ilen = h->ilen;
+		}
+
+		if (h->rsp_size > 0) {
+			idx->rsp = (uint8_t *) calloc(NG_L2CAP_MTU_MAXIMUM,
+						sizeof(idx->rsp[0]));
+			if (idx->rsp == NULL)
+				goto fail;
+
+			memcpy(idx->rsp, rsp, h->rsp_size);
+			idx->rsp_size = h->rsp_size;
+			idx->rsp_limit = h->rsp_limit;
+			idx->rsp_cs = h->rsp_cs;
+		}
+
+		if ((h->flags & HANDOFF_FD_EVENTS) &&
+		    server_subscribe(srv, fd) < 0)
+			goto fail;
+	}
+
+	FD_SET(fd, &srv->fdset);
+	if (h->flags & HANDOFF_FD_CONTROL)
+		FD_SET(fd, &srv->ctlset);
+	if (srv->maxfd < fd)
+		srv->maxfd = fd;
+	idx->valid = 1;
+	idx->server = ((h->flags & HANDOFF_FD_SERVER) != 0);
+	idx->control = ((h->flags & HANDOFF_FD_CONTROL) != 0);
+	idx->priv = ((h->flags & HANDOFF_FD_PRIV) != 0);
+	idx->omtu = h->omtu;
+	idx->local = h->local;
+
+	if (idx->server)
+		return (0);
+
+	timer_init(&idx->idle, server_idle_timeout, srv);
+	timer_init(&idx->cs_timer, server_cs_timeout, srv);
+	timer_init(&idx->defer, server_defer_timeout, srv);
+	server_touch(srv, fd);
+
+	if (idx->rsp_size > 0 && srv->cs_idle > 0)
+		timer_add(&srv->timers, &idx->cs_timer, srv->cs_idle * 1000);
+
+	return (0);
+fail:
+	log_crit("Could not allocate memory for handed over descriptor");
+
+	free(idx->events);
+	free(idx->rsp);
+	free(idx->ibuf);
+	if (idx->peer != NULL)
+		peer_put(idx->peer, srv->peer_rate, srv->peer_burst);
+
+	memset(idx, 0, sizeof(*idx));
+
+	return (-1);
+}
+
+/*
+ * Restore service database from the snapshot and keep the snapshot up
+ * to date from now on. Restored records wait for their owners to
+ * register again for grace seconds (0 - forever). Records handed over
+ * by the old process are already in place, the snapshot is only
+ * rewritten from them.
+ */
+
+int32_t
+server_restore(server_p srv, char const *path, int32_t grace)
+{
+	int32_t	n;
+
+	n = srv->handoff? snapshot_keep(path) : snapshot_open(path);
+	if (n < 0)
+		return (-1);
+
+	if (n > 0 && grace > 0) {
+		timer_init(&srv->orphans, server_orphans_timeout, srv);
+		timer_add(&srv->timers, &srv->orphans, grace * 1000);
+	}
+
 	return (0);
 }
 
+/*
+ * Warm up before serving. Pick the UUID matcher and compile
+ * AttributeIDList that asks for every attribute, with the views of the
+ * profiles in the database, so they are in the plan cache when the
+ * first dump or search asks for everything.
+ */
+
+void
+server_warm_up(server_p srv)
+{
+	static uint8_t const	 all[] = {
+		SDP_DATA_UINT32, 0x00, 0x00, 0xff, 0xff
+	};
+
+	provider_p		 provider = NULL;
+	plan_p			 plan = NULL;
+	uint64_t		 start = server_usec();
+	int32_t			 n = 0;
+
+	match_init();
+
+	plan = plan_get(all, all + sizeof(all));
+	if (plan != NULL) {
+		for (provider = provider_get_first();
+		     provider != NULL;
+		     provider = provider_get_next(provider)) {
+			plan_view(plan, provider->profile);
+			n ++;
+		}
+	}
+
+	log_info("Warmed up %d records in %llu usec, ready %llu usec " \
+		"after start", n, (unsigned long long) (server_usec() - start),
+		(unsigned long long) (server_usec() - srv->start));
+}
+
 /*
  * Shutdown server
  */
@@ -230,6 +581,11 @@ server_shutdown(server_p srv)
 
 	assert(srv != NULL);
 
+	/* Services go away with the server, not for good */
+	provider_set_notify(NULL, NULL);
+	snapshot_close();
+	publish_close();
+
 	for (fd = 0; fd < srv->maxfd + 1; fd ++)
 		if (srv->fdidx[fd].valid)
 			server_close_fd(srv, fd);
@@ -247,14 +603,25 @@ server_shutdown(server_p srv)
 int32_t
 server_do(server_p srv)
 {
-	fd_set	fdset;
-	int32_t	n, fd;
+	struct timeval	tv, *tvp = NULL;
+	fd_set		fdset, wfdset;
+	uint64_t	ready;
+	int32_t		n, fd, nfds, start;
 
 	assert(srv != NULL);
 
-	/* Copy cached version of the fd set and call select */
+	/* Wake up in time for the next timer. Do not wait if requests left */
+	n = srv->again? 0 : timer_next(&srv->timers);
+	if (n >= 0) {
+		tv.tv_sec = n / 1000;
+		tv.tv_usec = (n % 1000) * 1000;
+		tvp = &tv;
+	}
+
+	/* Copy cached version of the fd sets and call select */
 	memcpy(&fdset, &srv->fdset, sizeof(fdset));
-	n = select(srv->maxfd + 1, &fdset, NULL, NULL, NULL);
+	memcpy(&wfdset, &srv->wfdset, sizeof(wfdset));
+	n = select(srv->maxfd + 1, &fdset, &wfdset, NULL, tvp);
 	if (n < 0) {
 		if (errno == EINTR)
 			return (0);
@@ -265,62 +632,171 @@ server_do(server_p srv)
 		return (-1);
 	}
 
-	/* Process  descriptors */
-	for (fd = 0; fd < srv->maxfd + 1 && n > 0; fd ++) {
-		if (!FD_ISSET(fd, &fdset))
-			continue;
+	ready = server_usec();
 
-		assert(srv->fdidx[fd].valid);
-		n --;
+	/*
+	 * Process descriptors. Start from a different descriptor every
+	 * time, so low numbered descriptors do not always go first, and
+	 * serve at most one request per peer per pass.
+	 */
 
-		if (srv->fdidx[fd].server)
-			server_accept_client(srv, fd);
-		else if (server_process_request(srv, fd) != 0)
-			server_close_fd(srv, fd);
+	nfds = srv->maxfd + 1;
+	start = srv->next % nfds;
+	srv->next = start + 1;
+	srv->pass ++;
+	srv->again = 0;
+
+	for (fd = 0; fd < nfds; fd ++) {
+		if (FD_ISSET(fd, &wfdset)) {
+			assert(srv->fdidx[fd].valid);
+			if (srv->fdidx[fd].dump != NULL)
+				server_resume_dump(srv, fd);
+			else
+				server_flush_events(srv, fd, 0);
+		}
 	}
 
+	/*
+	 * Local services can not be reached until their records are
+	 * registered, so control socket goes before remote discovery.
+	 */
+
+	server_serve_class(srv, &fdset, 1, start, nfds, ready);
+	server_serve_class(srv, &fdset, 0, start, nfds, ready);
+
+	/*
+	 * Fire expired timers. Records removed by timers (i.e. expired
+	 * leases) all go in one change.
+	 */
+
+	provider_batch_begin();
+	timer_run(&srv->timers);
+	provider_batch_end();
+
+	/* Readers of the published database see this iteration at once */
+	publish_flush();
+
+	/* Push out change events generated during this iteration */
+	for (fd = 0; fd < srv->maxfd + 1; fd ++)
+		if (srv->fdidx[fd].valid && srv->fdidx[fd].events != NULL &&
+		    !FD_ISSET(fd, &srv->wfdset))
+			server_flush_events(srv, fd, 0);
+
 	return (0);
 	
 }
 
 /*
- * Accept new client connection and register it with index
+ * Accept new client connections. Listening sockets are non-blocking, so
+ * keep accepting until the queue is empty, but no more than
+ * SERVER_ACCEPT_BUDGET connections at a time, so clients that are
+ * already connected do not have to wait too long.
  */
 
 static void
 server_accept_client(server_p srv, int32_t fd)
 {
-	uint8_t		*rsp = NULL;
-	int32_t		 cfd, priv;
-	uint16_t	 omtu;
-	socklen_t	 size;
+	int32_t		n, cfd;
+#ifdef SO_LISTENQLEN
+	int32_t		qlen, qlimit;
+	socklen_t	size;
+#endif
+
+	for (n = 0; n < SERVER_ACCEPT_BUDGET; ) {
+		cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			srv->stats[SERVER_STAT_ACCEPT_ERRORS] ++;
+
+			/* Peer gave up while waiting in the queue */
+			if (errno == ECONNABORTED)
+				continue;
+
+			log_err("Could not accept connection on %s socket. " \
+				"%s (%d)",
+				srv->fdidx[fd].control? "control" : "L2CAP",
+				strerror(errno), errno);
+			return;
+		}
 
-	do {
-		cfd = accept(fd, NULL, NULL);
-	} while (cfd < 0 && errno == EINTR);
+		if (cfd >= FD_SETSIZE) {
+			log_err("Too many connections. Dropping connection " \
+				"on %s socket",
+				srv->fdidx[fd].control? "control" : "L2CAP");
+			srv->stats[SERVER_STAT_ACCEPT_REJECTED] ++;
+			close(cfd);
+			continue;
+		}
 
-	if (cfd < 0) {
-		log_err("Could not accept connection on %s socket. %s (%d)",
-			srv->fdidx[fd].control? "control" : "L2CAP",
-			strerror(errno), errno);
-		return;
+		server_add_client(srv, fd, cfd);
+		n ++;
 	}
 
+	/* Ran out of budget. Check if the listen queue has overflowed */
+	srv->stats[SERVER_STAT_ACCEPT_BUDGET_EXHAUSTED] ++;
+
+#ifdef SO_LISTENQLEN
+	size = sizeof(qlen);
+	if (getsockopt(fd, SOL_SOCKET, SO_LISTENQLEN, &qlen, &size) < 0)
+		return;
+
+	size = sizeof(qlimit);
+	if (getsockopt(fd, SOL_SOCKET, SO_LISTENQLIMIT, &qlimit, &size) < 0)
+		return;
+
+	if (qlen >= qlimit)
+		srv->stats[SERVER_STAT_BACKLOG_FULL] ++;
+#endif
+}
+
+/*
+ * Register accepted client connection with index
+ */
+
+static void
+server_add_client(server_p srv, int32_t fd, int32_t cfd)
+{
+	uint8_t		*ibuf = NULL;
+	peer_p		 peer = NULL;
+	uint64_t	 key, local;
+	int32_t		 priv;
+	uint16_t	 omtu;
+	socklen_t	 size;
+
 	assert(!FD_ISSET(cfd, &srv->fdset));
 	assert(!srv->fdidx[cfd].valid);
 
 	priv = 0;
 
 	if (!srv->fdidx[fd].control) {
+		struct sockaddr_l2cap	pa;
+
+		/* Get remote BD_ADDR */
+		size = sizeof(pa);
+		if (getpeername(cfd, (struct sockaddr *) &pa, &size) < 0) {
+			log_err("Could not get remote BD_ADDR. %s (%d)",
+				strerror(errno), errno);
+			close(cfd);
+			return;
+		}
+
+		key = provider_bdaddr_key(&pa.l2cap_bdaddr);
+
 		/* Get local BD_ADDR */
-		size = sizeof(srv->req_sa);
-		if (getsockname(cfd,(struct sockaddr*)&srv->req_sa,&size) < 0) {
+		size = sizeof(pa);
+		if (getsockname(cfd, (struct sockaddr *) &pa, &size) < 0) {
 			log_err("Could not get local BD_ADDR. %s (%d)",
 				strerror(errno), errno);
 			close(cfd);
 			return;
 		}
 
+		local = provider_bdaddr_key(&pa.l2cap_bdaddr);
+
 		/* Get outgoing MTU */
 		size = sizeof(omtu);
 	        if (getsockopt(cfd,SOL_L2CAP,SO_L2CAP_OMTU,&omtu,&size) < 0) {
@@ -366,59 +842,399 @@ server_accept_client(server_p srv, int32_t fd)
 			log_warning("Could not verify credentials for uid %d",
 				cr.cr_uid);
 
-		memcpy(&srv->req_sa.l2cap_bdaddr, NG_HCI_BDADDR_ANY,
-			sizeof(srv->req_sa.l2cap_bdaddr));
+		local = PROVIDER_KEY_ANY;
+
+		key = PEER_KEY_UID | cr.cr_uid;
 
 		omtu = srv->fdidx[fd].omtu;
 	}
 
-	/*
-	 * Allocate buffer. This is an overkill, but we can not know how 
-	 * big our reply is going to be.
-	 */
-
-	rsp = (uint8_t *) calloc(NG_L2CAP_MTU_MAXIMUM, sizeof(rsp[0]));
-	if (rsp == NULL) {
-		log_crit("Could not allocate response buffer");
+	/* All connections from the same peer share one budget */
+	peer = peer_get(key, srv->peer_burst);
+	if (peer == NULL) {
+		log_crit("Could not allocate peer");
 		close(cfd);
 		return;
 	}
 
+	/* Control socket is a stream, so we need to reassemble requests */
+	if (srv->fdidx[fd].control) {
+		ibuf = (uint8_t *) calloc(srv->imtu, sizeof(ibuf[0]));
+		if (ibuf == NULL) {
+			log_crit("Could not allocate request buffer");
+			peer_put(peer, srv->peer_rate, srv->peer_burst);
+			close(cfd);
+			return;
+		}
+	}
+
 	/* Add client descriptor to the index */
 	FD_SET(cfd, &srv->fdset);
+	if (srv->fdidx[fd].control)
+		FD_SET(cfd, &srv->ctlset);
 	if (srv->maxfd < cfd)
 		srv->maxfd = cfd;
 	srv->fdidx[cfd].valid = 1;
 	srv->fdidx[cfd].server = 0;
 	srv->fdidx[cfd].control = srv->fdidx[fd].control;
 	srv->fdidx[cfd].priv = priv;
+	srv->fdidx[cfd].deferred = 0;
 	srv->fdidx[cfd].rsp_cs = 0;
 	srv->fdidx[cfd].rsp_size = 0;
 	srv->fdidx[cfd].rsp_limit = 0;
 	srv->fdidx[cfd].omtu = omtu;
-	srv->fdidx[cfd].rsp = rsp;
+	srv->fdidx[cfd].rsp = NULL; /* allocated on first request */
+	srv->fdidx[cfd].ibuf = ibuf;
+	srv->fdidx[cfd].ilen = 0;
+	srv->fdidx[cfd].events = NULL;
+	srv->fdidx[cfd].peer = peer;
+	srv->fdidx[cfd].local = local;
+
+	timer_init(&srv->fdidx[cfd].idle, server_idle_timeout, srv);
+	timer_init(&srv->fdidx[cfd].cs_timer, server_cs_timeout, srv);
+	timer_init(&srv->fdidx[cfd].defer, server_defer_timeout, srv);
+	server_touch(srv, cfd);
+
+	srv->stats[SERVER_STAT_ACCEPTED] ++;
+
+	SDPD_PROBE3(accept, cfd, srv->fdidx[cfd].control, omtu);
 }
 
 /*
- * Process request from the client
+ * (Re)start idle timer for the client connection
  */
 
-static int32_t
-server_process_request(server_p srv, int32_t fd)
+static void
+server_touch(server_p srv, int32_t fd)
 {
-	sdp_pdu_p	pdu = (sdp_pdu_p) srv->req;
-	int32_t		len, error;
+	int32_t	timeout = srv->fdidx[fd].control?
+				srv->control_idle : srv->l2cap_idle;
 
-	assert(srv->imtu > 0);
-	assert(srv->req != NULL);
-	assert(FD_ISSET(fd, &srv->fdset));
+	if (timeout > 0)
+		timer_add(&srv->timers, &srv->fdidx[fd].idle, timeout * 1000);
+}
+
+/*
+ * Client connection has been idle for too long. Close it.
+ */
+
+static void
+server_idle_timeout(timer_p t, void *arg)
+{
+	server_p	srv = (server_p) arg;
+	int32_t		fd = (fd_idx_p) ((uint8_t *) t -
+				offsetof(fd_idx_t, idle)) - srv->fdidx;
+
+	log_info("Closing idle connection on %s socket",
+		srv->fdidx[fd].control? "control" : "L2CAP");
+
+	srv->stats[SERVER_STAT_IDLE_CLOSED] ++;
+	server_close_fd(srv, fd);
+}
+
+/*
+ * Client did not come back for the rest of the response. Forget the
+ * response and release the buffer, but keep the connection.
+ */
+
+static void
+server_cs_timeout(timer_p t, void *arg)
+{
+	server_p	srv = (server_p) arg;
+	int32_t		fd = (fd_idx_p) ((uint8_t *) t -
+				offsetof(fd_idx_t, cs_timer)) - srv->fdidx;
+
+	free(srv->fdidx[fd].rsp);
+	srv->fdidx[fd].rsp = NULL;
+	srv->fdidx[fd].rsp_cs = 0;
+	srv->fdidx[fd].rsp_size = 0;
+	srv->fdidx[fd].rsp_limit = 0;
+
+	srv->stats[SERVER_STAT_CS_EXPIRED] ++;
+}
+
+/*
+ * Serve ready descriptors of one class. Before the first L2CAP request
+ * check control socket again, once per pass, but do not let it hold
+ * L2CAP requests for more than SERVER_CONTROL_BURST rounds.
+ */
+
+static void
+server_serve_class(server_p srv, fd_set *fdset, int32_t control,
+		int32_t start, int32_t nfds, uint64_t ready)
+{
+	int32_t	i, fd, polled = control;
+
+	for (i = 0; i < nfds; i ++) {
+		fd = (start + i) % nfds;
+
+		if (!FD_ISSET(fd, fdset) || srv->fdidx[fd].control != control)
+			continue;
+
+		/* Descriptor may be closed and reused while we are here */
+		FD_CLR(fd, fdset);
+		assert(srv->fdidx[fd].valid);
+
+		if (!polled) {
+			server_poll_control(srv);
+			polled = 1;
+		}
+
+		server_serve_fd(srv, fd, ready);
+	}
+}
+
+/*
+ * Serve control descriptors that became ready since select()
+ */
+
+static void
+server_poll_control(server_p srv)
+{
+	struct timeval	tv;
+	fd_set		fdset;
+	uint64_t	ready;
+	int32_t		fd, nfds, rounds, served;
+
+	/* Nothing to poll if there is no control socket */
+	for (fd = 0; fd < srv->maxfd + 1; fd ++)
+		if (FD_ISSET(fd, &srv->ctlset))
+			break;
+	if (fd == srv->maxfd + 1)
+		return;
+
+	for (rounds = 0; rounds < SERVER_CONTROL_BURST; rounds ++) {
+		memcpy(&fdset, &srv->ctlset, sizeof(fdset));
+		memset(&tv, 0, sizeof(tv));
+
+		nfds = srv->maxfd + 1;
+		if (select(nfds, &fdset, NULL, NULL, &tv) <= 0)
+			break;
+
+		ready = server_usec();
+		served = 0;
+
+		for (fd = 0; fd < nfds; fd ++)
+			if (FD_ISSET(fd, &fdset) && srv->fdidx[fd].valid)
+				served += server_serve_fd(srv, fd, ready);
+
+		/* Only peers that have already had their turn are left */
+		if (served == 0)
+			break;
+	}
+}
+
+/*
+ * Serve one ready descriptor. Account time it waited since select()
+ * has reported it ready. Returns 0 if descriptor has to wait.
+ */
+
+static int32_t
+server_serve_fd(server_p srv, int32_t fd, uint64_t ready)
+{
+	uint32_t	*stats;
+	uint32_t	 delay;
+
+	if (srv->fdidx[fd].server) {
+		server_accept_client(srv, fd);
+		return (1);
+	}
+
+	if (!server_may_serve(srv, fd))
+		return (0);
+
+	stats = srv->stats + (srv->fdidx[fd].control?
+			SERVER_STAT_CONTROL_SERVED : SERVER_STAT_L2CAP_SERVED);
+	delay = server_usec() - ready;
+
+	stats[0] ++;
+	stats[1] += delay;
+	if (stats[2] < delay)
+		stats[2] = delay;
+
+	if (server_process_request(srv, fd) != 0)
+		server_close_fd(srv, fd);
+
+	return (1);
+}
+
+/*
+ * Client has taken part of the service dump. Once the dump is complete,
+ * send events held back by it and serve requests that came after it.
+ */
+
+static void
+server_resume_dump(server_p srv, int32_t fd)
+{
+	if (server_flush_dump(srv, fd, 0) < 0) {
+		log_err("Could not send service dump to control socket. " \
+			"%s (%d)", strerror(errno), errno);
+		server_close_fd(srv, fd);
+		return;
+	}
+
+	if (srv->fdidx[fd].dump != NULL)
+		return;
+
+	server_flush_events(srv, fd, 0);
+
+	if (server_process_buffer(srv, fd) != 0)
+		server_close_fd(srv, fd);
+}
+
+/*
+ * Return monotonic time in microseconds
+ */
+
+static uint64_t
+server_usec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Give back memory freed by unregistered services and forget peers
+ * that have been idle long enough now and then
+ */
+
+static void
+server_compact_timeout(timer_p t, void *arg)
+{
+	server_p	srv = (server_p) arg;
+
+	provider_compact();
+	peer_expire();
+	timer_add(&srv->timers, t, SERVER_COMPACT_INTERVAL * 1000);
+}
+
+/*
+ * Owners of the restored records did not come back in time
+ */
+
+static void
+server_orphans_timeout(timer_p t, void *arg)
+{
+	int32_t	n = provider_expire_orphans();
+
+	if (n > 0)
+		log_info("Removed %d restored records nobody claimed", n);
+}
+
+/*
+ * Check if request from the client can be served in this pass. Peers
+ * take turns, one request per pass. Peer that has used up its budget
+ * is taken out of the descriptor set until the budget is restored, so
+ * its requests wait in the socket buffer.
+ */
+
+static int32_t
+server_may_serve(server_p srv, int32_t fd)
+{
+	peer_p	peer = srv->fdidx[fd].peer;
+	int32_t	wait;
+
+	if (srv->fdidx[fd].priv || peer == NULL)
+		return (1);
+
+	if (peer->pass == srv->pass) {
+		srv->again = 1;
+		return (0);
+	}
+
+	if (srv->peer_rate > 0) {
+		wait = peer_wait(peer, srv->peer_rate, srv->peer_burst);
+		if (wait > 0) {
+			FD_CLR(fd, &srv->fdset);
+			FD_CLR(fd, &srv->ctlset);
+			srv->fdidx[fd].deferred = 1;
+			timer_add(&srv->timers, &srv->fdidx[fd].defer, wait);
+
+			srv->stats[SERVER_STAT_DEFERRED] ++;
+
+			return (0);
+		}
+	}
+
+	peer->pass = srv->pass;
+
+	return (1);
+}
+
+/*
+ * Charge peer for the request: one unit for the request itself, one
+ * per attribute encoded and one per PEER_UNIT_BYTES of new response
+ */
+
+static void
+server_charge(server_p srv, int32_t fd, uint32_t attrs, int32_t size)
+{
+	peer_p	peer = srv->fdidx[fd].peer;
+
+	if (srv->fdidx[fd].priv || peer == NULL || srv->peer_rate <= 0)
+		return;
+
+	peer_charge(peer, 1 + (server_attrs_encoded - attrs) +
+			size / PEER_UNIT_BYTES);
+}
+
+/*
+ * Deferred client has its budget back. Listen to it again.
+ */
+
+static void
+server_defer_timeout(timer_p t, void *arg)
+{
+	server_p	srv = (server_p) arg;
+	int32_t		fd = (fd_idx_p) ((uint8_t *) t -
+				offsetof(fd_idx_t, defer)) - srv->fdidx;
+
+	assert(srv->fdidx[fd].deferred);
+
+	FD_SET(fd, &srv->fdset);
+	if (srv->fdidx[fd].control)
+		FD_SET(fd, &srv->ctlset);
+	srv->fdidx[fd].deferred = 0;
+}
+
+/*
+ * Process request from the client
+ */
+
+static int32_t
+server_process_request(server_p srv, int32_t fd)
+{
+	uint8_t		*ibuf = srv->fdidx[fd].ibuf;
+	uint8_t		*buf = NULL;
+	int32_t		 len, size;
+
+	assert(srv->imtu > 0);
+	assert(srv->req != NULL);
+	assert(FD_ISSET(fd, &srv->fdset));
 	assert(srv->fdidx[fd].valid);
 	assert(!srv->fdidx[fd].server);
-	assert(srv->fdidx[fd].rsp != NULL);
 	assert(srv->fdidx[fd].omtu >= NG_L2CAP_MTU_MINIMUM);
+	assert(!srv->fdidx[fd].control || ibuf != NULL);
+
+	/*
+	 * L2CAP socket preserves message boundaries, so we get exactly one
+	 * PDU per read. Control socket is a stream, read whatever is there
+	 * after the data we kept from the last time.
+	 */
+
+	if (srv->fdidx[fd].control) {
+		buf = ibuf + srv->fdidx[fd].ilen;
+		size = srv->imtu - srv->fdidx[fd].ilen;
+	} else {
+		buf = srv->req;
+		size = srv->imtu;
+	}
 
 	do {
-		len = read(fd, srv->req, srv->imtu);
+		len = read(fd, buf, size);
 	} while (len < 0 && errno == EINTR);
 
 	if (len < 0) {
@@ -433,8 +1249,111 @@ server_process_request(server_p srv, int32_t fd)
 		return (-1);
 	}
 
+	server_touch(srv, fd);
+
+	if (!srv->fdidx[fd].control)
+		return (server_process_pdu(srv, fd, len));
+
+	srv->fdidx[fd].ilen += len;
+
+	return (server_process_buffer(srv, fd));
+}
+
+/*
+ * Process every complete PDU in the control socket buffer, in order.
+ * Responses are written synchronously, so they go out in the same
+ * order. Service dump is the exception, PDUs after it wait until it
+ * is complete.
+ */
+
+static int32_t
+server_process_buffer(server_p srv, int32_t fd)
+{
+	uint8_t		*ibuf = srv->fdidx[fd].ibuf;
+	sdp_pdu_p	 pdu = NULL;
+	int32_t		 len, off, size, error;
+
+	for (off = 0, error = 0;
+	     error == 0 && srv->fdidx[fd].dump == NULL;
+	     off += len) {
+		size = srv->fdidx[fd].ilen - off;
+		if (size < sizeof(*pdu))
+			break;
+
+		pdu = (sdp_pdu_p) (ibuf + off);
+		len = sizeof(*pdu) + ntohs(pdu->len);
+
+		if (len > srv->imtu) {
+			/* PDU will never fit. Can not resync the stream */
+			log_err("SDP request from control socket is too big, " \
+				"pdu->pid=%d, pdu->tid=%d, len=%d",
+				pdu->pid, ntohs(pdu->tid), len);
+
+			memcpy(srv->req, pdu, sizeof(*pdu));
+			server_send_error_response(srv, fd,
+				SDP_ERROR_CODE_INVALID_PDU_SIZE);
+
+			return (-1);
+		}
+
+		if (size < len)
+			break;
+
+		memcpy(srv->req, ibuf + off, len);
+		error = server_process_pdu(srv, fd, len);
+	}
+
+	/* Keep partial PDU (if any) for the next read */
+	srv->fdidx[fd].ilen -= off;
+	memmove(ibuf, ibuf + off, srv->fdidx[fd].ilen);
+
+	return (error);
+}
+
+/*
+ * Process one complete request PDU in the request buffer
+ */
+
+static int32_t
+server_process_pdu(server_p srv, int32_t fd, int32_t len)
+{
+	sdp_pdu_p	pdu = (sdp_pdu_p) srv->req;
+	uint32_t	attrs = server_attrs_encoded;
+	int32_t		fresh = (srv->fdidx[fd].rsp_size == 0);
+	int32_t		error;
+	uint64_t	start = SDPD_PROBE_ENABLED? server_usec() : 0;
+	struct iovec	iov;
+
+	if (capture_on) {
+		iov.iov_base = srv->req;
+		iov.iov_len = len;
+		server_capture(srv, fd, 1, &iov, 1);
+	}
+
+	/*
+	 * Allocate buffer. This is an overkill, but we can not know how 
+	 * big our reply is going to be. The buffer is released if client
+	 * abandons continuation.
+	 */
+
+	if (srv->fdidx[fd].rsp == NULL) {
+		srv->fdidx[fd].rsp = (uint8_t *) calloc(NG_L2CAP_MTU_MAXIMUM,
+						sizeof(srv->fdidx[fd].rsp[0]));
+		if (srv->fdidx[fd].rsp == NULL) {
+			log_crit("Could not allocate response buffer");
+			return (-1);
+		}
+	}
+
+	/* Do not interleave our reply with partially sent change event */
+	if (srv->fdidx[fd].events != NULL)
+		server_flush_events(srv, fd, 1);
+
 	if (len >= sizeof(*pdu) &&
 	    sizeof(*pdu) + (pdu->len = ntohs(pdu->len)) == len) {
+		SDPD_PROBE4(request, fd, pdu->pid, ntohs(pdu->tid), pdu->len);
+		SDPD_PROBE3(handler__entry, fd, pdu->pid, ntohs(pdu->tid));
+
 		switch (pdu->pid) {
 		case SDP_PDU_SERVICE_SEARCH_REQUEST:
 			//syslog(LOG_ERR,"SDP_PDU_SERVICE_SEARCH_REQUEST");
@@ -466,6 +1385,42 @@ server_process_request(server_p srv, int32_t fd)
 			error = server_prepare_service_change_response(srv, fd);
 			break;
 
+		case SDP_PDU_SERVICE_REGISTER_BATCH_REQUEST:
+			error = server_prepare_service_register_batch_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_UNREGISTER_BATCH_REQUEST:
+			error = server_prepare_service_unregister_batch_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_CHANGE_BATCH_REQUEST:
+			error = server_prepare_service_change_batch_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_SUBSCRIBE_REQUEST:
+			error = server_prepare_service_subscribe_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_SYNC_REQUEST:
+			error = server_prepare_service_sync_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_DUMP_REQUEST:
+			error = server_prepare_service_dump_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_MULTI_REQUEST:
+			error = server_prepare_service_multi_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVER_STATS_REQUEST:
+			error = server_prepare_server_stats_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_LEASE_REQUEST:
+			error = server_prepare_service_lease_response(srv, fd);
+			break;
+
 		default:
 			//syslog(LOG_ERR,"SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX");
 			error = SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX;
@@ -474,6 +1429,10 @@ server_process_request(server_p srv, int32_t fd)
 	} else
 		error = SDP_ERROR_CODE_INVALID_PDU_SIZE;
 
+	/* Continuation only sends what was produced before */
+	server_charge(srv, fd, attrs, (error == 0 && fresh)?
+			srv->fdidx[fd].rsp_size : 0);
+
 	if (error == 0) {
 		switch (pdu->pid) {
 		case SDP_PDU_SERVICE_SEARCH_REQUEST:
@@ -506,6 +1465,42 @@ server_process_request(server_p srv, int32_t fd)
 			error = server_send_service_change_response(srv, fd);
 			break;
 
+		case SDP_PDU_SERVICE_REGISTER_BATCH_REQUEST:
+			error = server_send_service_register_batch_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_UNREGISTER_BATCH_REQUEST:
+			error = server_send_service_unregister_batch_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_CHANGE_BATCH_REQUEST:
+			error = server_send_service_change_batch_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_SUBSCRIBE_REQUEST:
+			error = server_send_service_subscribe_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_SYNC_REQUEST:
+			error = server_send_service_sync_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_DUMP_REQUEST:
+			error = server_send_service_dump_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_MULTI_REQUEST:
+			error = server_send_service_multi_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVER_STATS_REQUEST:
+			error = server_send_server_stats_response(srv, fd);
+			break;
+
+		case SDP_PDU_SERVICE_LEASE_REQUEST:
+			error = server_send_service_lease_response(srv, fd);
+			break;
+
 		default:
 			//syslog(LOG_ERR,"SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX");
 			error = SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX;
@@ -532,6 +1527,10 @@ server_process_request(server_p srv, int32_t fd)
 				pdu->pid, ntohs(pdu->tid), error);
 	}
 
+	SDPD_PROBE5(handler__exit, fd, pdu->pid, error,
+		srv->fdidx[fd].rsp_size,
+		SDPD_PROBE_ENABLED? server_usec() - start : 0);
+
 	/* On error forget response (if any) */ 
 	if (error != 0) {
 		srv->fdidx[fd].rsp_cs = 0;
@@ -539,6 +1538,13 @@ server_process_request(server_p srv, int32_t fd)
 		srv->fdidx[fd].rsp_limit = 0;
 	}
 
+	/* Expect client to come back for the rest of the response soon */
+	if (srv->fdidx[fd].rsp_size > 0 && srv->cs_idle > 0)
+		timer_add(&srv->timers, &srv->fdidx[fd].cs_timer,
+			srv->cs_idle * 1000);
+	else
+		timer_del(&srv->timers, &srv->fdidx[fd].cs_timer);
+
 	return (error);
 }
 
@@ -549,7 +1555,8 @@ server_process_request(server_p srv, int32_t fd)
 static int32_t
 server_send_error_response(server_p srv, int32_t fd, uint16_t error)
 {
-	int32_t	size;
+	struct iovec	iov;
+	int32_t		size;
 
 	struct {
 		sdp_pdu_t		pdu;
@@ -562,11 +1569,87 @@ server_send_error_response(server_p srv, int32_t fd, uint16_t error)
 	rsp.pdu.len = htons(sizeof(rsp.error));
 	rsp.error   = htons(error);
 
+	iov.iov_base = &rsp;
+	iov.iov_len = sizeof(rsp);
+
+	size = server_writev(srv, fd, &iov, 1);
+
+	return ((size < 0)? errno : 0);
+}
+
+/*
+ * Write response to the client. When replaying, count it instead.
+ * Returns number of bytes written or -1 and errno.
+ */
+
+int32_t
+server_writev(server_p srv, int32_t fd, struct iovec const *iov,
+		int32_t iovcnt)
+{
+	return (server_sendv(srv, fd, iov, iovcnt, 0));
+}
+
+/*
+ * Same as server_writev(), but with send(2) flags, i.e. MSG_DONTWAIT
+ */
+
+int32_t
+server_sendv(server_p srv, int32_t fd, struct iovec const *iov,
+		int32_t iovcnt, int32_t flags)
+{
+	struct msghdr	msg;
+	int32_t		size, i;
+
+	if (srv->replay) {
+		for (i = 0, size = 0; i < iovcnt; i ++)
+			size += iov[i].iov_len;
+
+		srv->sink += size;
+
+		return (size);
+	}
+
+	if (flags != 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec *) iov;
+		msg.msg_iovlen = iovcnt;
+	}
+
 	do {
-		size = write(fd, &rsp, sizeof(rsp));
+		size = (flags != 0)? sendmsg(fd, &msg, flags) :
+				writev(fd, iov, iovcnt);
 	} while (size < 0 && errno == EINTR);
 
-	return ((size < 0)? errno : 0);
+	if (capture_on && size > 0)
+		server_capture(srv, fd, 0, iov, iovcnt);
+
+	/* Time to first response is logged once */
+	if (srv->start != 0 && size > 0) {
+		log_info("First response sent %llu usec after start",
+			(unsigned long long) (server_usec() - srv->start));
+		srv->start = 0;
+	}
+
+	SDPD_PROBE3(response, fd, ((sdp_pdu_p) srv->req)->pid, size);
+
+	return (size);
+}
+
+/*
+ * Capture PDU received from or sent to the client
+ */
+
+static void
+server_capture(server_p srv, int32_t fd, int32_t recv,
+		struct iovec const *iov, int32_t iovcnt)
+{
+	fd_idx_p	idx = &srv->fdidx[fd];
+
+	capture_pdu(recv, (idx->peer != NULL)? idx->peer->key : 0,
+		idx->local, idx->omtu,
+		(idx->control? CAPTURE_PKT_CONTROL : 0) |
+		(idx->priv? CAPTURE_PKT_PRIV : 0),
+		iov, iovcnt);
 }
 
 /*
@@ -578,18 +1661,40 @@ server_close_fd(server_p srv, int32_t fd)
 {
 	provider_p	provider = NULL, provider_next = NULL;
 
-	assert(FD_ISSET(fd, &srv->fdset));
+	assert(FD_ISSET(fd, &srv->fdset) || srv->fdidx[fd].deferred ||
+	    srv->fdidx[fd].dump != NULL);
 	assert(srv->fdidx[fd].valid);
 
-	close(fd);
+	SDPD_PROBE2(close, fd, srv->fdidx[fd].control);
+
+	if (!srv->replay)
+		close(fd);
 
 	FD_CLR(fd, &srv->fdset);
+	FD_CLR(fd, &srv->wfdset);
+	FD_CLR(fd, &srv->ctlset);
+	timer_del(&srv->timers, &srv->fdidx[fd].idle);
+	timer_del(&srv->timers, &srv->fdidx[fd].cs_timer);
+	timer_del(&srv->timers, &srv->fdidx[fd].defer);
 	if (fd == srv->maxfd)
 		srv->maxfd --;
 
 	if (srv->fdidx[fd].rsp != NULL)
 		free(srv->fdidx[fd].rsp);
 
+	if (srv->fdidx[fd].ibuf != NULL)
+		free(srv->fdidx[fd].ibuf);
+
+	if (srv->fdidx[fd].events != NULL)
+		free(srv->fdidx[fd].events);
+
+	if (srv->fdidx[fd].dump != NULL)
+		free(srv->fdidx[fd].dump);
+
+	if (srv->fdidx[fd].peer != NULL)
+		peer_put(srv->fdidx[fd].peer, srv->peer_rate,
+			srv->peer_burst);
+
 	memset(&srv->fdidx[fd], 0, sizeof(srv->fdidx[fd]));
 
 	for (provider = provider_get_first();
@@ -602,3 +1707,69 @@ server_close_fd(server_p srv, int32_t fd)
 	}
 }
 
+/*
+ * Add replay client. Descriptor is only a slot in the index.
+ */
+
+int32_t
+server_replay_client(server_p srv, int32_t fd, int32_t control,
+		int32_t priv, uint64_t local, uint16_t omtu)
+{
+	assert(srv->replay);
+
+	if (fd < 0 || fd >= FD_SETSIZE || srv->fdidx[fd].valid)
+		return (-1);
+
+	if (omtu < NG_L2CAP_MTU_MINIMUM)
+		omtu = NG_L2CAP_MTU_MINIMUM;
+
+	if (control) {
+		srv->fdidx[fd].ibuf = (uint8_t *) calloc(srv->imtu,
+						sizeof(srv->fdidx[fd].ibuf[0]));
+		if (srv->fdidx[fd].ibuf == NULL)
+			return (-1);
+
+		FD_SET(fd, &srv->ctlset);
+	}
+
+	FD_SET(fd, &srv->fdset);
+	if (srv->maxfd < fd)
+		srv->maxfd = fd;
+	srv->fdidx[fd].valid = 1;
+	srv->fdidx[fd].control = (control != 0);
+	srv->fdidx[fd].priv = (priv != 0);
+	srv->fdidx[fd].omtu = omtu;
+	srv->fdidx[fd].local = control? PROVIDER_KEY_ANY : local;
+
+	timer_init(&srv->fdidx[fd].idle, server_idle_timeout, srv);
+	timer_init(&srv->fdidx[fd].cs_timer, server_cs_timeout, srv);
+	timer_init(&srv->fdidx[fd].defer, server_defer_timeout, srv);
+
+	return (0);
+}
+
+/*
+ * Feed one request PDU from replay client through the server
+ */
+
+int32_t
+server_replay_pdu(server_p srv, int32_t fd, uint8_t const *pdu, int32_t len)
+{
+	int32_t	error;
+
+	assert(srv->replay);
+	assert(srv->fdidx[fd].valid);
+
+	if (len < sizeof(sdp_pdu_t) || len > srv->imtu)
+		return (-1);
+
+	memcpy(srv->req, pdu, len);
+	error = server_process_pdu(srv, fd, len);
+
+	/* Push out change events, there is no select() loop */
+	for (fd = 0; fd < srv->maxfd + 1; fd ++)
+		if (srv->fdidx[fd].valid && srv->fdidx[fd].events != NULL)
+			server_flush_events(srv, fd, 0);
+
+	return (error);
+}
@@ -32,6 +32,12 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+struct server_events;
+struct server_dump;
+struct peer;
+struct iovec;
+struct handoff_fd;
+
 /*
  * File descriptor index entry
  */
@@ -42,17 +48,67 @@ struct fd_idx
 	unsigned	 server   : 1;	/* descriptor is listening */
 	unsigned	 control  : 1;	/* descriptor is a control socket */
 	unsigned	 priv     : 1;	/* descriptor is privileged */
-	unsigned	 reserved : 1;
+	unsigned	 deferred : 1;	/* descriptor is out of budget */
 	unsigned	 rsp_cs   : 11; /* response continuation state */
 	uint16_t	 rsp_size;	/* response size */
 	uint16_t	 rsp_limit;	/* response limit */
 	uint16_t	 omtu;		/* outgoing MTU */
 	uint8_t		*rsp;		/* outgoing buffer */
+	uint16_t	 ilen;		/* incoming data size */
+	uint8_t		*ibuf;		/* incoming buffer (control) */
+	struct server_events *events;	/* change notifications */
+	struct server_dump *dump;	/* service dump in progress */
+	struct peer	*peer;		/* remote device or user */
+	uint64_t	 local;		/* local BD_ADDR (packed) */
+	struct timer	 idle;		/* idle connection timer */
+	struct timer	 cs_timer;	/* continuation state timer */
+	struct timer	 defer;		/* deferred descriptor timer */
 };
 
 typedef struct fd_idx	fd_idx_t;
 typedef struct fd_idx *	fd_idx_p;
 
+/*
+ * Server statistics. Counters are reported in this order by
+ * SDP_PDU_SERVER_STATS_REQUEST, new counters must be added at the end.
+ */
+
+#define	SERVER_STAT_ACCEPTED			0  /* connections accepted */
+#define	SERVER_STAT_ACCEPT_ERRORS		1  /* accept() failures */
+#define	SERVER_STAT_ACCEPT_REJECTED		2  /* no room in the index */
+#define	SERVER_STAT_ACCEPT_BUDGET_EXHAUSTED	3  /* more to accept later */
+#define	SERVER_STAT_BACKLOG_FULL		4  /* listen queue was full */
+#define	SERVER_STAT_IDLE_CLOSED			5  /* idle connections closed */
+#define	SERVER_STAT_CS_EXPIRED			6  /* continuations dropped */
+#define	SERVER_STAT_DEFERRED			7  /* peers out of budget */
+#define	SERVER_STAT_CONTROL_SERVED		8  /* control reads served */
+#define	SERVER_STAT_CONTROL_DELAY		9  /* total delay (usec) */
+#define	SERVER_STAT_CONTROL_DELAY_MAX		10 /* max. delay (usec) */
+#define	SERVER_STAT_L2CAP_SERVED		11 /* L2CAP requests served */
+#define	SERVER_STAT_L2CAP_DELAY			12 /* total delay (usec) */
+#define	SERVER_STAT_L2CAP_DELAY_MAX		13 /* max. delay (usec) */
+#define	SERVER_STAT_RECORDS			14 /* records registered */
+#define	SERVER_STAT_RECORD_SLOTS		15 /* record table size */
+#define	SERVER_STAT_DATA_BYTES			16 /* profile data size */
+#define	SERVER_STAT_ARENA_BYTES			17 /* profile data memory */
+#define	SERVER_STAT_MAX				18
+
+/* Max. number of connections accepted from one socket per iteration */
+#define	SERVER_ACCEPT_BUDGET			16
+
+/* Max. number of control socket rounds between two L2CAP requests */
+#define	SERVER_CONTROL_BURST			8
+
+/* Default timeouts (in seconds) */
+#define	SERVER_L2CAP_IDLE			60
+#define	SERVER_CS_IDLE				10
+#define	SERVER_COMPACT_INTERVAL			300
+#define	SERVER_ORPHAN_GRACE			30
+
+/* Default per-peer work budget (see peer.h) */
+#define	SERVER_PEER_RATE			2000	/* units/sec */
+#define	SERVER_PEER_BURST			4000	/* units */
+
 /*
  * SDP server
  */
@@ -63,20 +119,82 @@ struct server
 	uint8_t			*req;		/* incoming buffer */
 	int32_t			 maxfd;		/* max. descriptor is the set */
 	fd_set			 fdset;		/* current descriptor set */
+	fd_set			 wfdset;	/* descriptors to write */
+	fd_set			 ctlset;	/* control descriptors to read */
 	fd_idx_p		 fdidx;		/* descriptor index */
-	struct sockaddr_l2cap	 req_sa;	/* local address */
+	uint32_t		 stats[SERVER_STAT_MAX]; /* statistics */
+	struct timer_wheel	 timers;	/* timers */
+	struct timer		 compact;	/* memory compaction */
+	struct timer		 orphans;	/* restored records expiry */
+	int32_t			 control_idle;	/* control idle timeout */
+	int32_t			 l2cap_idle;	/* L2CAP idle timeout */
+	int32_t			 cs_idle;	/* continuation timeout */
+	int32_t			 peer_rate;	/* per-peer work rate */
+	int32_t			 peer_burst;	/* per-peer work burst */
+	uint32_t		 pass;		/* select() pass counter */
+	int32_t			 next;		/* start next pass from here */
+	int32_t			 again;		/* requests were left unread */
+	int32_t			 replay;	/* replaying capture, no I/O */
+	uint64_t		 sink;		/* bytes not written (replay) */
+	int32_t			 handoff;	/* state came from old process */
+	uint64_t		 start;		/* init time, until 1st response */
 };
 
 typedef struct server	server_t;
 typedef struct server *	server_p;
 
+/*
+ * Local extensions to the SDP PDU set. These are only accepted on the
+ * control socket.
+ */
+
+#define	SDP_PDU_SERVICE_REGISTER_BATCH_REQUEST		0x84
+#define	SDP_PDU_SERVICE_UNREGISTER_BATCH_REQUEST	0x85
+#define	SDP_PDU_SERVICE_CHANGE_BATCH_REQUEST		0x86
+#define	SDP_PDU_SERVICE_SUBSCRIBE_REQUEST		0x87
+#define	SDP_PDU_SERVICE_CHANGE_EVENT			0x88
+#define	SDP_PDU_SERVICE_SYNC_REQUEST			0x89
+#define	SDP_PDU_SERVICE_DUMP_REQUEST			0x8a
+#define	SDP_PDU_SERVICE_DUMP_RESPONSE			0x8b
+#define	SDP_PDU_SERVICE_MULTI_REQUEST			0x8c
+#define	SDP_PDU_SERVER_STATS_REQUEST			0x8d
+#define	SDP_PDU_SERVICE_LEASE_REQUEST			0x8e
+
+/*
+ * Events in SDP_PDU_SERVICE_CHANGE_EVENT. Added, removed and updated
+ * match PROVIDER_EVENT_xxx. Resync means that too many changes were
+ * coalesced and the subscriber should re-read the database.
+ */
+
+#define	SDP_SERVICE_EVENT_ADDED				1
+#define	SDP_SERVICE_EVENT_REMOVED			2
+#define	SDP_SERVICE_EVENT_UPDATED			3
+#define	SDP_SERVICE_EVENT_RESYNC			4
+
 /*
  * External API
  */
 
-int32_t	server_init(server_p srv, const char *control);
+int32_t	server_init(server_p srv, const char *control, int32_t backlog,
+		int32_t unsock, int32_t l2sock);
 void	server_shutdown(server_p srv);
 int32_t	server_do(server_p srv);
+int32_t	server_restore(server_p srv, char const *path, int32_t grace);
+void	server_warm_up(server_p srv);
+int32_t	server_writev(server_p srv, int32_t fd, struct iovec const *iov,
+		int32_t iovcnt);
+int32_t	server_sendv(server_p srv, int32_t fd, struct iovec const *iov,
+		int32_t iovcnt, int32_t flags);
+
+int32_t	server_init_handoff(server_p srv, uint32_t imtu);
+int32_t	server_adopt_fd(server_p srv, int32_t fd, struct handoff_fd const *h,
+		uint8_t const *ibuf, uint8_t const *rsp);
+
+int32_t	server_init_replay(server_p srv);
+int32_t	server_replay_client(server_p srv, int32_t fd, int32_t control,
+		int32_t priv, uint64_t local, uint16_t omtu);
+int32_t	server_replay_pdu(server_p srv, int32_t fd, uint8_t const *pdu,
+		int32_t len);
 
 int32_t	server_prepare_service_search_response(server_p srv, int32_t fd);
 int32_t	server_send_service_search_response(server_p srv, int32_t fd);
@@ -99,4 +217,47 @@ int32_t	server_prepare_service_change_response(server_p srv, int32_t fd);
 #define	server_send_service_change_response \
 	server_send_service_register_response
 
+int32_t	server_prepare_service_register_batch_response(server_p srv, int32_t fd);
+#define	server_send_service_register_batch_response \
+	server_send_service_register_response
+
+int32_t	server_prepare_service_unregister_batch_response(server_p srv, int32_t fd);
+#define	server_send_service_unregister_batch_response \
+	server_send_service_register_response
+
+int32_t	server_prepare_service_change_batch_response(server_p srv, int32_t fd);
+#define	server_send_service_change_batch_response \
+	server_send_service_register_response
+
+int32_t	server_prepare_service_subscribe_response(server_p srv, int32_t fd);
+#define	server_send_service_subscribe_response \
+	server_send_service_register_response
+
+int32_t	server_prepare_service_sync_response(server_p srv, int32_t fd);
+#define	server_send_service_sync_response \
+	server_send_service_register_response
+
+int32_t	server_prepare_service_dump_response(server_p srv, int32_t fd);
+int32_t	server_send_service_dump_response(server_p srv, int32_t fd);
+
+int32_t	server_prepare_service_multi_response(server_p srv, int32_t fd);
+#define	server_send_service_multi_response \
+	server_send_service_register_response
+
+int32_t	server_prepare_service_lease_response(server_p srv, int32_t fd);
+#define	server_send_service_lease_response \
+	server_send_service_register_response
+
+int32_t	server_prepare_server_stats_response(server_p srv, int32_t fd);
+#define	server_send_server_stats_response \
+	server_send_service_register_response
+
+extern uint32_t	server_attrs_encoded;
+
+void	server_notify(int32_t event, uint32_t handle, void *arg);
+void	server_flush_events(server_p srv, int32_t fd, int32_t wait);
+int32_t	server_flush_dump(server_p srv, int32_t fd, int32_t wait);
+int32_t	server_subscribe(server_p srv, int32_t fd);
+void	server_unsubscribe(server_p srv, int32_t fd);
+
 #endif /* ndef _SERVER_H_ */
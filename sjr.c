@@ -0,0 +1,160 @@
+/*
+ * sjr.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <sdp.h>
+#include <string.h>
+#include "profile.h"
+#include "provider.h"
+#include "timer.h"
+#include "server.h"
+
+/* from sar.c */
+int32_t server_prepare_attr_list(provider_p const provider,
+		uint8_t const *req, uint8_t const * const req_end,
+		uint8_t *rsp, uint8_t const * const rsp_end);
+
+/*
+ * Prepare Service Sync response. Send client everything that changed
+ * after the given ServiceDatabaseState, or tell it to start over if
+ * the journal does not go back that far.
+ */
+
+int32_t
+server_prepare_service_sync_response(server_p srv, int32_t fd)
+{
+	static uint8_t const	all_attrs[] = {
+		SDP_DATA_UINT32, 0x00, 0x00, 0xff, 0xff
+	};
+
+	uint8_t const	*req = srv->req + sizeof(sdp_pdu_t);
+	uint8_t const	*req_end = req + ((sdp_pdu_p)(srv->req))->len;
+	uint8_t		*rsp = srv->fdidx[fd].rsp;
+	uint8_t const	*rsp_end = rsp + NG_L2CAP_MTU_MAXIMUM - 1;
+
+	provider_change_t	 changes[PROVIDER_JOURNAL_SIZE];
+	provider_p		 provider = NULL;
+	uint8_t			*ptr = NULL, *cptr = NULL;
+	uint32_t		 state;
+	int32_t			 n, i, j, count, len;
+
+	/*
+	 * Service Sync Request
+	 *
+	 * value32	- 4 bytes ServiceDatabaseState known to client
+	 */
+
+	if (!srv->fdidx[fd].control || req_end - req != 4)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	SDP_GET32(state, req);
+
+	/*
+	 * Service Sync Response format
+	 *
+	 * value16	- 2 bytes error code (always 0)
+	 * value32	- 4 bytes current ServiceDatabaseState
+	 * value8	- 1 byte 0 - changes follow, 1 - resync required
+	 * value16	- 2 bytes count
+	 *	value8	- 1 byte event
+	 *	value32	- 4 bytes record handle
+	 *	[ bdaddr	- 6 bytes record BD_ADDR
+	 *	  seq16 len16	- 3 bytes
+	 *		attr value	- 3+ bytes AttributeList ]
+	 *	[ event handle [ bdaddr attr list ] ]
+	 *
+	 * BD_ADDR and AttributeList are only present for added and
+	 * updated records.
+	 */
+
+	SDP_PUT16(0, rsp);
+	SDP_PUT32(provider_get_change_state(), rsp);
+	ptr = rsp;
+	SDP_PUT8(0, rsp);
+	cptr = rsp;
+	SDP_PUT16(0, rsp);
+
+	n = provider_get_changes(state, changes, PROVIDER_JOURNAL_SIZE);
+
+	/* Newest change wins, so walk journal backwards */
+	for (i = n - 1, count = 0; i >= 0; i --) {
+		for (j = n - 1; j > i; j --)
+			if (changes[j].handle == changes[i].handle)
+				break;
+		if (j > i)
+			continue;
+
+		if (rsp + 5 > rsp_end)
+			break;
+
+		provider = provider_by_handle(changes[i].handle);
+		if (provider == NULL)
+			changes[i].event = PROVIDER_EVENT_REMOVED;
+		else if (changes[i].event == PROVIDER_EVENT_REMOVED)
+			changes[i].event = PROVIDER_EVENT_UPDATED;
+
+		SDP_PUT8(changes[i].event, rsp);
+		SDP_PUT32(changes[i].handle, rsp);
+
+		if (provider != NULL) {
+			if (rsp + sizeof(bdaddr_t) > rsp_end)
+				break;
+
+			memcpy(rsp, &provider->bdaddr, sizeof(bdaddr_t));
+			rsp += sizeof(bdaddr_t);
+
+			len = server_prepare_attr_list(provider, all_attrs,
+				all_attrs + sizeof(all_attrs), rsp, rsp_end);
+			if (len < 0)
+				break;
+
+			rsp += len;
+		}
+
+		count ++;
+	}
+
+	if (n < 0 || i >= 0) {
+		/* Journal is too short or reply is too big */
+		rsp = ptr;
+		SDP_PUT8(1, rsp);
+		SDP_PUT16(0, rsp);
+	} else
+		SDP_PUT16(count, cptr);
+
+	/* Set reply size */
+	srv->fdidx[fd].rsp_limit = NG_L2CAP_MTU_MAXIMUM;
+	srv->fdidx[fd].rsp_size = rsp - srv->fdidx[fd].rsp;
+	srv->fdidx[fd].rsp_cs = 0;
+
+	return (0);
+}
+
@@ -0,0 +1,115 @@
+/*
+ * slr.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <sdp.h>
+#include <string.h>
+#include "lease.h"
+#include "profile.h"
+#include "provider.h"
+#include "timer.h"
+#include "server.h"
+
+/*
+ * Prepare Service Lease response. Sets, renews or cancels lease of the
+ * records owned by the session. Registration is not changed, so a
+ * service that wants its records to expire sends this right after it
+ * registers them and then again, as keepalive, before the lease runs
+ * out.
+ */
+
+int32_t
+server_prepare_service_lease_response(server_p srv, int32_t fd)
+{
+	uint8_t const	*req = srv->req + sizeof(sdp_pdu_t);
+	uint8_t const	*req_end = req + ((sdp_pdu_p)(srv->req))->len;
+	uint8_t		*rsp = srv->fdidx[fd].rsp;
+
+	uint8_t const	*ptr = NULL;
+	provider_p	 provider = NULL;
+	int32_t		 ttl, count, i;
+	uint32_t	 handle;
+
+	/*
+	 * Minimal Service Lease Request
+	 *
+	 * value16	- ttl 2 bytes (seconds, 0 - no lease)
+	 * value16	- count 2 bytes (0 - all records of the session)
+	 *	value32	- handle 4 bytes
+	 *	[ handle ]
+	 */
+
+	if (!srv->fdidx[fd].control ||
+	    !srv->fdidx[fd].priv || req_end - req < 4)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	SDP_GET16(ttl, req);
+	SDP_GET16(count, req);
+	if (req_end - req != 4 * count)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	/* Check every handle first */
+	for (i = 0, ptr = req; i < count; i ++) {
+		SDP_GET32(handle, ptr);
+
+		provider = provider_by_handle(handle);
+		if (provider == NULL || provider->fd != fd)
+			return (SDP_ERROR_CODE_INVALID_SERVICE_RECORD_HANDLE);
+	}
+
+	if (count > 0) {
+		for (i = 0, ptr = req; i < count; i ++) {
+			SDP_GET32(handle, ptr);
+
+			if (lease_set(&srv->timers, handle, ttl) < 0)
+				return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+		}
+	} else {
+		for (provider = provider_get_first();
+		     provider != NULL;
+		     provider = provider_get_next(provider)) {
+			if (provider->fd != fd)
+				continue;
+
+			if (lease_set(&srv->timers, provider->handle, ttl) < 0)
+				return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+		}
+	}
+
+	SDP_PUT16(0, rsp);
+
+	/* Set reply size */
+	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t);
+	srv->fdidx[fd].rsp_size = rsp - srv->fdidx[fd].rsp;
+	srv->fdidx[fd].rsp_cs = 0;
+
+	return (0);
+}
@@ -0,0 +1,244 @@
+/*
+ * smr.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <bluetooth.h>
+#include <sdp.h>
+#include "de.h"
+#include "plan.h"
+#include "profile.h"
+#include "provider.h"
+#include "timer.h"
+#include "server.h"
+
+/* from sar.c */
+int32_t server_prepare_attr_list_plan(provider_p const provider, plan_p plan,
+		uint8_t *rsp, uint8_t const * const rsp_end);
+
+/* from ssr.c */
+int32_t server_prepare_handle_list(server_p srv, int32_t fd,
+		uint8_t const *ssp, uint8_t const *ssp_end, int32_t limit,
+		uint8_t *rsp, uint8_t const * const rsp_end);
+
+/* from ssar.c */
+int32_t server_prepare_attr_lists(server_p srv, int32_t fd, plan_p plan,
+		uint8_t const *ssp, uint8_t const *ssp_end,
+		uint8_t *rsp, uint8_t const * const rsp_end);
+
+/*
+ * Run one sub-request and put its response into rsp. Sub-request that
+ * can not be served gets Error Response in its place. Returns number of
+ * bytes used or -1 if rsp is too small.
+ *
+ * There is no continuation here, so ContinuationState of the sub-request
+ * must be empty and the whole AttributeList(s) must fit into
+ * MaximumAttributeByteCount.
+ */
+
+static int32_t
+server_prepare_sub_response(server_p srv, int32_t fd, int32_t pid,
+		uint8_t const *req, uint8_t const *req_end,
+		uint8_t *rsp, uint8_t const * const rsp_end)
+{
+	uint8_t const	*end = rsp_end;
+	uint8_t		*ptr = NULL;
+	provider_p	 provider = NULL;
+	plan_p		 plan = NULL;
+	int32_t		 len, error;
+	de_req_t	 r;
+
+	if (rsp + 7 > rsp_end)
+		return (-1);
+
+	error = de_parse(pid, req, req_end, &r);
+	if (error == 0 && r.cslen != 0)
+		error = SDP_ERROR_CODE_INVALID_CONTINUATION_STATE;
+	if (error != 0)
+		goto fail;
+
+	if (pid == SDP_PDU_SERVICE_SEARCH_REQUEST) {
+		len = server_prepare_handle_list(srv, fd, r.ssp, r.ssp_end,
+				r.limit, rsp + 7, rsp_end);
+
+		/* Total- and CurrentServiceRecordCount */
+		ptr = rsp + 3;
+		SDP_PUT16(len / 4, ptr);
+		SDP_PUT16(len / 4, ptr);
+
+		len += 4;
+		pid = SDP_PDU_SERVICE_SEARCH_RESPONSE;
+	} else {
+		if (pid == SDP_PDU_SERVICE_ATTRIBUTE_REQUEST &&
+		    (provider = provider_by_handle(r.handle)) == NULL) {
+			error = SDP_ERROR_CODE_INVALID_SERVICE_RECORD_HANDLE;
+			goto fail;
+		}
+
+		if ((plan = plan_get(r.aid, r.aid_end)) == NULL) {
+			error = SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX;
+			goto fail;
+		}
+
+		if (r.limit < rsp_end - (rsp + 5))
+			end = rsp + 5 + r.limit;
+
+		if (provider != NULL)
+			len = server_prepare_attr_list_plan(provider, plan,
+					rsp + 5, end);
+		else
+			len = server_prepare_attr_lists(srv, fd, plan,
+					r.ssp, r.ssp_end, rsp + 5, end);
+
+		if (len < 0) {
+			if (end == rsp_end)
+				return (-1);
+
+			error = SDP_ERROR_CODE_INSUFFICIENT_RESOURCES;
+			goto fail;
+		}
+
+		/* AttributeListByteCount */
+		ptr = rsp + 3;
+		SDP_PUT16(len, ptr);
+
+		len += 2;
+		pid = (provider != NULL)?
+			SDP_PDU_SERVICE_ATTRIBUTE_RESPONSE :
+			SDP_PDU_SERVICE_SEARCH_ATTRIBUTE_RESPONSE;
+	}
+
+	SDP_PUT8(pid, rsp);
+	SDP_PUT16(len, rsp);
+
+	return (3 + len);
+fail:
+	SDP_PUT8(SDP_PDU_ERROR_RESPONSE, rsp);
+	SDP_PUT16(2, rsp);
+	SDP_PUT16(error, rsp);
+
+	return (5);
+}
+
+/*
+ * Prepare Service Multi response. Run a number of Service Search,
+ * Service Attribute and Service Search Attribute requests and return
+ * all results at once. Nothing can change the service database while
+ * we are here, so all requests see the same records.
+ */
+
+int32_t
+server_prepare_service_multi_response(server_p srv, int32_t fd)
+{
+	uint8_t const	*req = srv->req + sizeof(sdp_pdu_t);
+	uint8_t const	*req_end = req + ((sdp_pdu_p)(srv->req))->len;
+	uint8_t		*rsp = srv->fdidx[fd].rsp;
+	uint8_t const	*rsp_end = rsp + NG_L2CAP_MTU_MAXIMUM - 1;
+
+	uint8_t const	*ptr = NULL;
+	int32_t		 count, i, pid, len, n;
+
+	/*
+	 * Minimal Service Multi Request
+	 *
+	 * value16	- 2 bytes count
+	 *	value8	- 1 byte PDU ID
+	 *	value16	- 2 bytes parameter length
+	 *	params	- parameter length bytes (same as in the
+	 *		  standalone request, ContinuationState must
+	 *		  be empty)
+	 *	[ pid length params ]
+	 */
+
+	if (!srv->fdidx[fd].control || req_end - req < 5)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	SDP_GET16(count, req);
+	if (count == 0)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	/* Check framing of every sub-request first */
+	for (i = 0, ptr = req; i < count; i ++) {
+		if (req_end - ptr < 3)
+			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+		SDP_GET8(pid, ptr);
+		SDP_GET16(len, ptr);
+		if (req_end - ptr < len)
+			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+		switch (pid) {
+		case SDP_PDU_SERVICE_SEARCH_REQUEST:
+		case SDP_PDU_SERVICE_ATTRIBUTE_REQUEST:
+		case SDP_PDU_SERVICE_SEARCH_ATTRIBUTE_REQUEST:
+			break;
+
+		default:
+			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+		}
+
+		ptr += len;
+	}
+	if (ptr != req_end)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	/*
+	 * Service Multi Response format
+	 *
+	 * value16	- 2 bytes error code (always 0)
+	 * value16	- 2 bytes count
+	 *	value8	- 1 byte PDU ID of the response
+	 *	value16	- 2 bytes parameter length
+	 *	params	- parameter length bytes, same as in the
+	 *		  standalone response without ContinuationState
+	 *	[ pid length params ]
+	 */
+
+	SDP_PUT16(0, rsp);
+	SDP_PUT16(count, rsp);
+
+	for (i = 0; i < count; i ++) {
+		SDP_GET8(pid, req);
+		SDP_GET16(len, req);
+
+		n = server_prepare_sub_response(srv, fd, pid,
+				req, req + len, rsp, rsp_end);
+		if (n < 0)
+			return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+
+		req += len;
+		rsp += n;
+	}
+
+	/* Set reply size */
+	srv->fdidx[fd].rsp_limit = NG_L2CAP_MTU_MAXIMUM;
+	srv->fdidx[fd].rsp_size = rsp - srv->fdidx[fd].rsp;
+	srv->fdidx[fd].rsp_cs = 0;
+
+	return (0);
+}
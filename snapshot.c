@@ -0,0 +1,506 @@
+/*
+ * snapshot.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sdp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "profile.h"
+#include "provider.h"
+#include "snapshot.h"
+
+#define	snapshot_align(n)	(((n) + 7) & ~7)
+
+struct snapshot_ent
+{
+	uint32_t	handle;		/* record handle, 0 - empty */
+	uint32_t	off;		/* record offset in the file */
+};
+
+static struct {
+	char			*path;		/* snapshot file */
+	int32_t			 fd;		/* open snapshot file */
+	uint8_t			*base;		/* mapped file */
+	uint32_t		 size;		/* mapped size */
+	struct snapshot_ent	*hash;		/* live records by handle */
+	uint32_t		 hash_size;	/* power of 2 */
+	uint32_t		 hash_count;
+} snap = { NULL, -1, NULL, 0, NULL, 0, 0 };
+
+#define	snapshot_hdr()	((struct snapshot_hdr *) snap.base)
+
+/*
+ * Record offsets by handle. Open addressing, deleted entries are
+ * closed up by moving the following entries back.
+ */
+
+static struct snapshot_ent *
+snapshot_find(uint32_t handle)
+{
+	uint32_t	i = handle & (snap.hash_size - 1);
+
+	while (snap.hash[i].handle != 0 && snap.hash[i].handle != handle)
+		i = (i + 1) & (snap.hash_size - 1);
+
+	return (&snap.hash[i]);
+}
+
+static int32_t
+snapshot_hash_put(uint32_t handle, uint32_t off)
+{
+	struct snapshot_ent	*old = snap.hash, *e = NULL;
+	uint32_t		 size = snap.hash_size, i;
+
+	if ((snap.hash_count + 1) * 2 > snap.hash_size) {
+		snap.hash_size = (size > 0)? size * 2 : 64;
+		snap.hash = calloc(snap.hash_size, sizeof(snap.hash[0]));
+		if (snap.hash == NULL) {
+			snap.hash = old;
+			snap.hash_size = size;
+			return (-1);
+		}
+
+		for (i = 0; i < size; i ++)
+			if (old[i].handle != 0)
+				*snapshot_find(old[i].handle) = old[i];
+
+		free(old);
+	}
+
+	e = snapshot_find(handle);
+	if (e->handle == 0)
+		snap.hash_count ++;
+
+	e->handle = handle;
+	e->off = off;
+
+	return (0);
+}
+
+static uint32_t
+snapshot_hash_del(uint32_t handle)
+{
+	struct snapshot_ent	*e = NULL;
+	uint32_t		 i, j, k, off;
+
+	if (snap.hash_size == 0)
+		return (0);
+
+	e = snapshot_find(handle);
+	if (e->handle == 0)
+		return (0);
+
+	off = e->off;
+	snap.hash_count --;
+
+	for (i = e - snap.hash, j = i; ; ) {
+		snap.hash[i].handle = 0;
+
+		do {
+			j = (j + 1) & (snap.hash_size - 1);
+			if (snap.hash[j].handle == 0)
+				return (off);
+
+			k = snap.hash[j].handle & (snap.hash_size - 1);
+		} while (i <= j? (i < k && k <= j) : (i < k || k <= j));
+
+		snap.hash[i] = snap.hash[j];
+		i = j;
+	}
+}
+
+/*
+ * Map snapshot file with at least given size
+ */
+
+static int32_t
+snapshot_map(uint32_t size)
+{
+	uint8_t	*base = NULL;
+
+	if (size <= snap.size)
+		return (0);
+
+	if (ftruncate(snap.fd, size) < 0) {
+		log_err("Could not grow snapshot %s. %s (%d)",
+			snap.path, strerror(errno), errno);
+		return (-1);
+	}
+
+	base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, snap.fd, 0);
+	if (base == MAP_FAILED) {
+		log_err("Could not mmap snapshot %s. %s (%d)",
+			snap.path, strerror(errno), errno);
+		return (-1);
+	}
+
+	if (snap.base != NULL)
+		munmap(snap.base, snap.size);
+
+	snap.base = base;
+	snap.size = size;
+
+	return (0);
+}
+
+/*
+ * Append record for the provider
+ */
+
+static int32_t
+snapshot_append(provider_p provider)
+{
+	struct snapshot_rec	*rec = NULL;
+	uint32_t		 off = snapshot_hdr()->used;
+	uint32_t		 need, size;
+
+	need = snapshot_align(sizeof(*rec) + provider->datalen);
+
+	for (size = snap.size; off + need > size; size *= 2)
+		;
+
+	if (snapshot_map(size) < 0 ||
+	    snapshot_hash_put(provider->handle, off) < 0)
+		return (-1);
+
+	rec = (struct snapshot_rec *) (snap.base + off);
+	memset(rec, 0, need);
+	rec->size = need;
+	rec->handle = provider->handle;
+	rec->datalen = provider->datalen;
+	rec->uuid = provider->profile->uuid;
+	memcpy(&rec->bdaddr, &provider->bdaddr, sizeof(rec->bdaddr));
+	memcpy(rec + 1, provider->data, provider->datalen);
+	rec->live = 1;
+
+	snapshot_hdr()->used = off + need;
+
+	return (0);
+}
+
+/*
+ * Mark record of the provider dead
+ */
+
+static void
+snapshot_kill(uint32_t handle)
+{
+	struct snapshot_rec	*rec = NULL;
+	uint32_t		 off = snapshot_hash_del(handle);
+
+	if (off == 0)
+		return;
+
+	rec = (struct snapshot_rec *) (snap.base + off);
+	rec->live = 0;
+	snapshot_hdr()->dead += rec->size;
+}
+
+/*
+ * Write new snapshot of the whole database and make it current. New
+ * file replaces the old one only when it is complete.
+ */
+
+static int32_t
+snapshot_write(void)
+{
+	struct snapshot_hdr	*hdr = NULL;
+	provider_p		 provider = NULL;
+	char			 tmp[PATH_MAX];
+
+	snprintf(tmp, sizeof(tmp), "%s.new", snap.path);
+
+	if (snap.base != NULL)
+		munmap(snap.base, snap.size);
+	if (snap.fd >= 0)
+		close(snap.fd);
+
+	snap.base = NULL;
+	snap.size = 0;
+	snap.hash_count = 0;
+	if (snap.hash != NULL)
+		memset(snap.hash, 0, snap.hash_size * sizeof(snap.hash[0]));
+
+	snap.fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (snap.fd < 0) {
+		log_err("Could not create snapshot %s. %s (%d)",
+			tmp, strerror(errno), errno);
+		return (-1);
+	}
+
+	if (snapshot_map(SNAPSHOT_MIN_SIZE) < 0)
+		goto fail;
+
+	hdr = snapshot_hdr();
+	memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->change_state = provider_get_change_state();
+	hdr->used = snapshot_align(sizeof(*hdr));
+	hdr->dead = 0;
+
+	/* Service Discovery records belong to the server itself */
+	for (provider = provider_get_first();
+	     provider != NULL;
+	     provider = provider_get_next(provider))
+		if (provider->handle > 1 && snapshot_append(provider) < 0)
+			goto fail;
+
+	if (rename(tmp, snap.path) < 0) {
+		log_err("Could not rename snapshot %s. %s (%d)",
+			tmp, strerror(errno), errno);
+		goto fail;
+	}
+
+	return (0);
+fail:
+	unlink(tmp);
+	snapshot_close();
+
+	return (-1);
+}
+
+/*
+ * Check records of the mapped snapshot. Returns number of live records
+ * or -1 if snapshot can not be used.
+ */
+
+static int32_t
+snapshot_check(uint8_t const *base, uint32_t size)
+{
+	struct snapshot_hdr const	*hdr = (struct snapshot_hdr const *) base;
+	struct snapshot_rec const	*rec = NULL;
+	uint32_t			 off;
+	int32_t				 n;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != SNAPSHOT_VERSION ||
+	    hdr->used > size || hdr->used < snapshot_align(sizeof(*hdr)))
+		return (-1);
+
+	for (off = snapshot_align(sizeof(*hdr)), n = 0;
+	     off < hdr->used;
+	     off += rec->size) {
+		rec = (struct snapshot_rec const *) (base + off);
+
+		if (hdr->used - off < sizeof(*rec) ||
+		    rec->size < sizeof(*rec) || rec->size % 8 != 0 ||
+		    rec->size > hdr->used - off ||
+		    rec->datalen > rec->size - sizeof(*rec))
+			return (-1);
+
+		if (!rec->live)
+			continue;
+
+		if (rec->handle <= 1 ||
+		    profile_get_descriptor(rec->uuid) == NULL)
+			return (-1);
+
+		n ++;
+	}
+
+	return (n);
+}
+
+/*
+ * Open snapshot file, restore records from it and start keeping it up
+ * to date. Restored records have no owner. Returns number of restored
+ * records or -1.
+ */
+
+int32_t
+snapshot_open(char const *path)
+{
+	struct snapshot_hdr const	*hdr = NULL;
+	struct snapshot_rec const	*rec = NULL;
+	struct stat			 st;
+	uint8_t				*base = NULL;
+	uint32_t			 off;
+	int32_t				 fd, n = 0;
+
+	snap.path = strdup(path);
+	if (snap.path == NULL) {
+		log_err("Could not allocate snapshot path");
+		return (-1);
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0 &&
+	    st.st_size <= UINT32_MAX &&
+	    (base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+			!= MAP_FAILED) {
+		n = snapshot_check(base, st.st_size);
+		if (n < 0) {
+			log_warning("Snapshot %s is not valid, ignored", path);
+			n = 0;
+		} else {
+			hdr = (struct snapshot_hdr const *) base;
+
+			provider_batch_begin();
+
+			for (off = snapshot_align(sizeof(*hdr)), n = 0;
+			     off < hdr->used;
+			     off += rec->size) {
+				rec = (struct snapshot_rec const *)
+						(base + off);
+				if (!rec->live)
+					continue;
+
+				if (provider_restore(
+						profile_get_descriptor(rec->uuid),
+						(bdaddr_p) &rec->bdaddr,
+						PROVIDER_FD_ORPHAN,
+						rec->handle,
+						(uint8_t const *) (rec + 1),
+						rec->datalen) == NULL) {
+					log_warning("Could not restore record " \
+						"0x%x", rec->handle);
+					continue;
+				}
+
+				n ++;
+			}
+
+			provider_batch_end();
+
+			/* Restart is a change, cached states are stale */
+			provider_set_change_state(hdr->change_state + 1);
+		}
+
+		munmap(base, st.st_size);
+	} else if (fd < 0 && errno != ENOENT)
+		log_warning("Could not open snapshot %s. %s (%d)",
+			path, strerror(errno), errno);
+
+	if (fd >= 0)
+		close(fd);
+
+	if (snapshot_write() < 0)
+		return (-1);
+
+	log_info("Restored %d records from snapshot %s", n, path);
+
+	return (n);
+}
+
+/*
+ * Start keeping snapshot of the records already in the database (i.e.
+ * handed over by the old process). Returns number of records without
+ * owner or -1.
+ */
+
+int32_t
+snapshot_keep(char const *path)
+{
+	provider_p	provider = NULL;
+	int32_t		n = 0;
+
+	snap.path = strdup(path);
+	if (snap.path == NULL) {
+		log_err("Could not allocate snapshot path");
+		return (-1);
+	}
+
+	if (snapshot_write() < 0)
+		return (-1);
+
+	for (provider = provider_get_first();
+	     provider != NULL;
+	     provider = provider_get_next(provider))
+		if (provider->fd == PROVIDER_FD_ORPHAN)
+			n ++;
+
+	return (n);
+}
+
+/*
+ * Stop keeping snapshot
+ */
+
+void
+snapshot_close(void)
+{
+	if (snap.base != NULL)
+		munmap(snap.base, snap.size);
+	if (snap.fd >= 0)
+		close(snap.fd);
+
+	free(snap.hash);
+	free(snap.path);
+
+	memset(&snap, 0, sizeof(snap));
+	snap.fd = -1;
+}
+
+/*
+ * Apply database change to the snapshot
+ */
+
+void
+snapshot_changed(int32_t event, uint32_t handle)
+{
+	provider_p	provider = NULL;
+
+	if (snap.base == NULL || handle <= 1)
+		return;
+
+	switch (event) {
+	case PROVIDER_EVENT_UPDATED:
+	case PROVIDER_EVENT_REMOVED:
+		snapshot_kill(handle);
+		if (event == PROVIDER_EVENT_REMOVED)
+			break;
+		/* FALLTHROUGH */
+
+	case PROVIDER_EVENT_ADDED:
+		provider = provider_by_handle(handle);
+		if (provider != NULL && snapshot_append(provider) < 0) {
+			log_err("Could not update snapshot %s, " \
+				"rewriting it", snap.path);
+			snapshot_write();
+			return;
+		}
+		break;
+	}
+
+	snapshot_hdr()->change_state = provider_get_change_state();
+
+	if (snapshot_hdr()->dead > SNAPSHOT_COMPACT_MIN &&
+	    snapshot_hdr()->dead > snapshot_hdr()->used / 2)
+		snapshot_write();
+}
@@ -0,0 +1,76 @@
+/*
+ * snapshot.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+/*
+ * Service database snapshot. The file is mapped and every change to the
+ * database is applied to it right away: new and updated records are
+ * appended, removed records are marked dead. When dead records take
+ * more than half of the file, the file is rewritten. On restart records
+ * are restored from the file before the server starts serving.
+ *
+ * The file is in host byte order and is only meant to be read by the
+ * same build on the same machine.
+ */
+
+#define	SNAPSHOT_MAGIC		"sdpdsnap"	/* 8 bytes, no '\0' */
+#define	SNAPSHOT_VERSION	1
+#define	SNAPSHOT_MIN_SIZE	(16 * 1024)	/* initial file size */
+#define	SNAPSHOT_COMPACT_MIN	(4 * 1024)	/* min. dead bytes to compact */
+
+struct snapshot_hdr
+{
+	uint8_t		magic[8];	/* SNAPSHOT_MAGIC */
+	uint32_t	version;	/* SNAPSHOT_VERSION */
+	uint32_t	change_state;	/* database change state */
+	uint32_t	used;		/* bytes used, incl. header */
+	uint32_t	dead;		/* bytes in dead records */
+};
+
+struct snapshot_rec
+{
+	uint32_t	size;		/* record size, incl. header and pad */
+	uint32_t	handle;		/* record handle */
+	uint32_t	datalen;	/* profile data size */
+	uint16_t	uuid;		/* profile UUID */
+	uint8_t		live;		/* record is live */
+	uint8_t		reserved;
+	bdaddr_t	bdaddr;		/* provider's BD_ADDR */
+	uint16_t	pad;
+	/* profile data follows */
+};
+
+int32_t	snapshot_open		(char const *path);
+int32_t	snapshot_keep		(char const *path);
+void	snapshot_close		(void);
+void	snapshot_changed	(int32_t event, uint32_t handle);
+
+#endif /* ndef _SNAPSHOT_H_ */
@@ -0,0 +1,288 @@
+/*
+ * snr.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <sdp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lease.h"
+#include "log.h"
+#include "profile.h"
+#include "provider.h"
+#include "publish.h"
+#include "snapshot.h"
+#include "timer.h"
+#include "server.h"
+
+/*
+ * Pending change notifications for one subscriber. Events for the same
+ * record are merged while they wait to be sent. If the queue fills up
+ * everything is replaced with a single resync event.
+ */
+
+#define	SERVER_EVENTS_MAX	32
+
+struct server_event
+{
+	uint8_t		event;		/* SDP_SERVICE_EVENT_xxx */
+	uint32_t	handle;		/* record handle */
+};
+
+struct server_events
+{
+	int32_t			count;	/* number of queued events */
+	struct server_event	queue[SERVER_EVENTS_MAX];
+	uint16_t		off;	/* sent part of buf */
+	uint16_t		len;	/* size of buf */
+	uint8_t			buf[sizeof(sdp_pdu_t) + 6 + 5 * SERVER_EVENTS_MAX];
+};
+
+/*
+ * Prepare Service Subscribe response
+ */
+
+int32_t
+server_prepare_service_subscribe_response(server_p srv, int32_t fd)
+{
+	uint8_t const	*req = srv->req + sizeof(sdp_pdu_t);
+	uint8_t const	*req_end = req + ((sdp_pdu_p)(srv->req))->len;
+	uint8_t		*rsp = srv->fdidx[fd].rsp;
+	int32_t		 enable;
+
+	/*
+	 * Service Subscribe Request
+	 *
+	 * value8	- 1 byte, 1 to subscribe, 0 to unsubscribe
+	 */
+
+	if (!srv->fdidx[fd].control || req_end - req != 1)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	SDP_GET8(enable, req);
+
+	if (enable) {
+		if (server_subscribe(srv, fd) < 0)
+			return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+	} else
+		server_unsubscribe(srv, fd);
+
+	/*
+	 * Service Subscribe Response format
+	 *
+	 * value16	- 2 bytes error code (always 0)
+	 * value32	- 4 bytes current ServiceDatabaseState
+	 */
+
+	SDP_PUT16(0, rsp);
+	SDP_PUT32(provider_get_change_state(), rsp);
+
+	/* Set reply size */
+	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t);
+	srv->fdidx[fd].rsp_size = rsp - srv->fdidx[fd].rsp;
+	srv->fdidx[fd].rsp_cs = 0;
+
+	return (0);
+}
+
+/*
+ * Queue event for every subscriber. Called by provider code on every
+ * service database change.
+ */
+
+void
+server_notify(int32_t event, uint32_t handle, void *arg)
+{
+	server_p		 srv = (server_p) arg;
+	struct server_events	*ev = NULL;
+	int32_t			 fd, i;
+
+	snapshot_changed(event, handle);
+	publish_changed();
+
+	if (event == PROVIDER_EVENT_REMOVED)
+		lease_drop(&srv->timers, handle);
+
+	for (fd = 0; fd < srv->maxfd + 1; fd ++) {
+		if (!srv->fdidx[fd].valid ||
+		    (ev = srv->fdidx[fd].events) == NULL)
+			continue;
+
+		if (ev->count == 1 &&
+		    ev->queue[0].event == SDP_SERVICE_EVENT_RESYNC)
+			continue;
+
+		for (i = 0; i < ev->count; i ++)
+			if (ev->queue[i].handle == handle)
+				break;
+
+		if (i < ev->count) {
+			/* Record was added since last notification */
+			if (ev->queue[i].event == SDP_SERVICE_EVENT_ADDED &&
+			    event == SDP_SERVICE_EVENT_UPDATED)
+				continue;
+
+			ev->queue[i].event = event;
+		} else if (ev->count < SERVER_EVENTS_MAX) {
+			ev->queue[ev->count].event = event;
+			ev->queue[ev->count].handle = handle;
+			ev->count ++;
+		} else {
+			ev->queue[0].event = SDP_SERVICE_EVENT_RESYNC;
+			ev->queue[0].handle = 0;
+			ev->count = 1;
+		}
+	}
+}
+
+/*
+ * Send queued events to the subscriber. Unless asked to wait, never
+ * block. Whatever could not be sent is left for later and the
+ * descriptor is added to the write set.
+ */
+
+void
+server_flush_events(server_p srv, int32_t fd, int32_t wait)
+{
+	struct server_events	*ev = srv->fdidx[fd].events;
+	uint8_t			*ptr = NULL;
+	int32_t			 size, i;
+
+	/* Events wait until service dump is complete */
+	if (ev == NULL || srv->fdidx[fd].dump != NULL)
+		return;
+
+	for (;;) {
+		if (ev->off == ev->len) {
+			if (ev->count == 0)
+				break;
+
+			/*
+			 * Service Change Event format
+			 *
+			 * value32	- 4 bytes ServiceDatabaseState
+			 * value16	- 2 bytes event count
+			 *	value8	- 1 byte event
+			 *	value32	- 4 bytes record handle
+			 *	[ event handle ]
+			 */
+
+			ptr = ev->buf;
+			SDP_PUT8(SDP_PDU_SERVICE_CHANGE_EVENT, ptr);
+			SDP_PUT16(0, ptr);
+			SDP_PUT16(6 + 5 * ev->count, ptr);
+			SDP_PUT32(provider_get_change_state(), ptr);
+			SDP_PUT16(ev->count, ptr);
+
+			for (i = 0; i < ev->count; i ++) {
+				SDP_PUT8(ev->queue[i].event, ptr);
+				SDP_PUT32(ev->queue[i].handle, ptr);
+			}
+
+			ev->off = 0;
+			ev->len = ptr - ev->buf;
+			ev->count = 0;
+		}
+
+		if (srv->replay) {
+			size = ev->len - ev->off;
+			srv->sink += size;
+		} else {
+			do {
+				size = send(fd, ev->buf + ev->off,
+					ev->len - ev->off,
+					wait? 0 : MSG_DONTWAIT);
+			} while (size < 0 && errno == EINTR);
+		}
+
+		if (size < 0) {
+			if (errno == EAGAIN) {
+				FD_SET(fd, &srv->wfdset);
+				return;
+			}
+
+			/* Client is gone. Reader will notice and close */
+			log_err("Could not send change event. %s (%d)",
+				strerror(errno), errno);
+
+			ev->off = ev->len = ev->count = 0;
+			break;
+		}
+
+		ev->off += size;
+	}
+
+	FD_CLR(fd, &srv->wfdset);
+}
+
+/*
+ * Start sending change events to the descriptor
+ */
+
+int32_t
+server_subscribe(server_p srv, int32_t fd)
+{
+	if (srv->fdidx[fd].events == NULL) {
+		srv->fdidx[fd].events = calloc(1, sizeof(struct server_events));
+		if (srv->fdidx[fd].events == NULL)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Drop subscription. Finish partially sent event first, so the stream
+ * stays in sync.
+ */
+
+void
+server_unsubscribe(server_p srv, int32_t fd)
+{
+	struct server_events	*ev = srv->fdidx[fd].events;
+
+	if (ev == NULL)
+		return;
+
+	if (ev->off < ev->len) {
+		ev->count = 0;
+		server_flush_events(srv, fd, 1);
+	}
+
+	FD_CLR(fd, &srv->wfdset);
+	free(ev);
+	srv->fdidx[fd].events = NULL;
+}
+
@@ -40,6 +40,7 @@
 #include <string.h>
 #include "profile.h"
 #include "provider.h"
+#include "timer.h"
 #include "server.h"
 #include <syslog.h>
 
@@ -132,9 +133,7 @@ server_send_service_register_response(server_p srv, int32_t fd)
 	iov[1].iov_base = srv->fdidx[fd].rsp;
 	iov[1].iov_len = srv->fdidx[fd].rsp_size;
 
-	do {
-		size = writev(fd, (struct iovec const *) &iov, sizeof(iov)/sizeof(iov[0]));
-	} while (size < 0 && errno == EINTR);
+	size = server_writev(srv, fd, iov, sizeof(iov)/sizeof(iov[0]));
 
 	srv->fdidx[fd].rsp_cs = 0;
 	srv->fdidx[fd].rsp_size = 0;
@@ -33,17 +33,79 @@
 #include <bluetooth.h>
 #include <sdp.h>
 #include <string.h>
+#include "de.h"
+#include "plan.h"
 #include "profile.h"
 #include "provider.h"
+#include "timer.h"
 #include "server.h"
 #include "uuid-private.h"
 #include <syslog.h>
 
 /* from sar.c */
-int32_t server_prepare_attr_list(provider_p const provider,
-		uint8_t const *req, uint8_t const * const req_end,
+int32_t server_prepare_attr_list_plan(provider_p const provider, plan_p plan,
 		uint8_t *rsp, uint8_t const * const rsp_end);
 
+/*
+ * Put AttributeLists of the records that match ServiceSearchPattern
+ * into rsp. Returns number of bytes used or -1 if rsp is too small.
+ *
+ * seq16 value16	- 3 bytes
+ *	attr list	- 3+ bytes
+ *	[ attr list ]
+ */
+
+int32_t
+server_prepare_attr_lists(server_p srv, int32_t fd, plan_p plan,
+		uint8_t const *ssp, uint8_t const *ssp_end,
+		uint8_t *rsp, uint8_t const * const rsp_end)
+{
+	uint8_t const	*req = NULL;
+	uint8_t		*ptr = rsp + 3;
+	provider_t	*provider = NULL;
+	int32_t		 cs;
+	uint128_t	 uuid;
+
+	if (ptr > rsp_end)
+		return (-1);
+
+	for (req = ssp; req < ssp_end; ) {
+		de_get_uuid(&req, &uuid);
+
+		for (provider = provider_get_first_on(srv->fdidx[fd].local);
+		     provider != NULL;
+		     provider = provider_get_next_on(provider,
+				srv->fdidx[fd].local)) {
+			//syslog(LOG_ERR,"%d",provider->profile->uuid);
+
+			/*
+			 * This conditional is preventing response to services query.
+			 * 
+			if (memcmp(&uuid, &puuid, sizeof(uuid)) != 0 &&
+			    memcmp(&uuid, &uuid_public_browse_group, sizeof(uuid)) != 0)
+				continue;
+*/
+			cs = server_prepare_attr_list_plan(provider, plan,
+				ptr, rsp_end);
+			//syslog(LOG_ERR,"cs %i",cs);
+			if (cs < 0)
+				return (-1);
+
+			ptr += cs;
+		}
+	}
+
+	cs = ptr - rsp;
+
+	/* Fix AttributeLists sequence header */
+	ptr = rsp;
+	SDP_PUT8(SDP_DATA_SEQ16, ptr);
+	SDP_PUT16(cs - 3, ptr);
+
+	//syslog(LOG_ERR,"rsp size %d",cs - 3);
+	return (cs);
+}
+
 /*
  * Prepare SDP Service Search Attribute Response
  */
@@ -56,15 +118,12 @@ server_prepare_service_search_attribute_response(server_p srv, int32_t fd)
 	uint8_t		*rsp = srv->fdidx[fd].rsp;
 	uint8_t const	*rsp_end = rsp + NG_L2CAP_MTU_MAXIMUM;
 
-	uint8_t const	*sspptr = NULL, *aidptr = NULL;
-	uint8_t		*ptr = NULL;
-
-	provider_t	*provider = NULL;
-	int32_t		 type, rsp_limit, ssplen, aidlen, cslen, cs;
-	uint128_t	 uuid, puuid;
+	plan_p		 plan = NULL;
+	int32_t		 cs, error;
+	de_req_t	 r;
 
 	/*
-	 * Minimal Service Search Attribute Request request
+	 * Service Search Attribute Request
 	 *
 	 * seq8 len8		- 2 bytes
 	 *	uuid16 value16  - 3 bytes ServiceSearchPattern
@@ -74,91 +133,13 @@ server_prepare_service_search_attribute_response(server_p srv, int32_t fd)
 	 * value8		- 1 byte  ContinuationState
 	 */
 
-	if (req_end - req < 13)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	/* Get size of ServiceSearchPattern */
-	ssplen = 0;
-	SDP_GET8(type, req);
-	switch (type) {
-	case SDP_DATA_SEQ8:
-		//syslog(LOG_ERR,"SDP_DATA_SEQ8");
-		SDP_GET8(ssplen, req);
-		break;
-
-	case SDP_DATA_SEQ16:
-		//syslog(LOG_ERR,"SDP_DATA_SEQ16");
-		SDP_GET16(ssplen, req);
-		break;
-
-	case SDP_DATA_SEQ32:
-		//syslog(LOG_ERR,"SDP_DATA_SEQ32");
-		SDP_GET32(ssplen, req);
-		break;
-	}
-	if (ssplen <= 0)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	sspptr = req;
-	req += ssplen;
-
-	/* Get MaximumAttributeByteCount */
-	if (req + 2 > req_end)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	SDP_GET16(rsp_limit, req);
-	if (rsp_limit <= 0)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	/* Get size of AttributeIDList */
-	if (req + 1 > req_end)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	aidlen = 0;
-	SDP_GET8(type, req);
-	switch (type) {
-	case SDP_DATA_SEQ8:
-		if (req + 1 > req_end)
-			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-		SDP_GET8(aidlen, req);
-		break;
-
-	case SDP_DATA_SEQ16:
-		if (req + 2 > req_end)
-			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-		SDP_GET16(aidlen, req);
-		break;
-
-	case SDP_DATA_SEQ32:
-		if (req + 4 > req_end)
-			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-		SDP_GET32(aidlen, req);
-		break;
-	}
-	if (aidlen <= 0)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	aidptr = req;
-	req += aidlen;
-
-	/* Get ContinuationState */
-	if (req + 1 > req_end)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	SDP_GET8(cslen, req);
-	if (cslen != 0) {
-		if (cslen != 2 || req_end - req != 2)
-			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-		SDP_GET16(cs, req);
-	} else
-		cs = 0;
+	error = de_parse(SDP_PDU_SERVICE_SEARCH_ATTRIBUTE_REQUEST,
+			req, req_end, &r);
+	if (error != 0)
+		return (error);
 
 	/* Process the request. First, check continuation state */
-	if (srv->fdidx[fd].rsp_cs != cs)
+	if (srv->fdidx[fd].rsp_cs != r.cs)
 		return (SDP_ERROR_CODE_INVALID_CONTINUATION_STATE);
 	if (srv->fdidx[fd].rsp_size > 0)
 		return (0);
@@ -172,94 +153,23 @@ server_prepare_service_search_attribute_response(server_p srv, int32_t fd)
 	 *	[ attr list ]
 	 */
 
-	ptr = rsp + 3;
-
-	while (ssplen > 0) {
-		SDP_GET8(type, sspptr);
-		ssplen --;
-
-		switch (type) {
-		case SDP_DATA_UUID16:
-			//syslog(LOG_ERR,"SDP_DATA_UUID16 type");
-			if (ssplen < 2)
-				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-			memcpy(&uuid, &uuid_base, sizeof(uuid));
-			uuid.b[2] = *sspptr ++;
-			uuid.b[3] = *sspptr ++;
-			ssplen -= 2;
-			break;
-
-		case SDP_DATA_UUID32:
-			if (ssplen < 4)
-				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-			memcpy(&uuid, &uuid_base, sizeof(uuid));
-			uuid.b[0] = *sspptr ++;
-			uuid.b[1] = *sspptr ++;
-			uuid.b[2] = *sspptr ++;
-			uuid.b[3] = *sspptr ++;
-			ssplen -= 4;
-			break;
-
-		case SDP_DATA_UUID128:
-			if (ssplen < 16)
-				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-			memcpy(uuid.b, sspptr, 16);
-			sspptr += 16;	
-			ssplen -= 16; 
-			break;
-
-		default:
-			//syslog(LOG_ERR,"SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX");
-			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-			/* NOT REACHED */
-		}
-
-		for (provider = provider_get_first();
-		     provider != NULL;
-		     provider = provider_get_next(provider)) {
-			//syslog(LOG_ERR,"%d",provider->profile->uuid);
-			if (!provider_match_bdaddr(provider, &srv->req_sa.l2cap_bdaddr))
-				continue;
-
-			memcpy(&puuid, &uuid_base, sizeof(puuid));
-			puuid.b[2] = provider->profile->uuid >> 8;
-			puuid.b[3] = provider->profile->uuid;
-			//syslog(LOG_ERR,"p %d",provider->profile->uuid);
-
-			/*
-			 * This conditional is preventing response to services query.
-			 * 
-			if (memcmp(&uuid, &puuid, sizeof(uuid)) != 0 &&
-			    memcmp(&uuid, &uuid_public_browse_group, sizeof(uuid)) != 0)
-				continue;
-*/
-			cs = server_prepare_attr_list(provider,
-				aidptr, aidptr + aidlen, ptr, rsp_end);
-			//syslog(LOG_ERR,"cs %i",cs);
-			if (cs < 0)
-				return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
+	plan = plan_get(r.aid, r.aid_end);
+	if (plan == NULL)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
 
-			ptr += cs;
-		}
-	}
+	cs = server_prepare_attr_lists(srv, fd, plan, r.ssp, r.ssp_end,
+			rsp, rsp_end);
+	if (cs < 0)
+		return (SDP_ERROR_CODE_INSUFFICIENT_RESOURCES);
 
 	/* Set reply size (not counting PDU header and continuation state) */
 	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t) - 2;
-	if (srv->fdidx[fd].rsp_limit > rsp_limit)
-		srv->fdidx[fd].rsp_limit = rsp_limit;
+	if (srv->fdidx[fd].rsp_limit > r.limit)
+		srv->fdidx[fd].rsp_limit = r.limit;
 
-	srv->fdidx[fd].rsp_size = ptr - rsp;
+	srv->fdidx[fd].rsp_size = cs;
 	srv->fdidx[fd].rsp_cs = 0;
 
-	/* Fix AttributeLists sequence header */
-	ptr = rsp;
-	SDP_PUT8(SDP_DATA_SEQ16, ptr);
-	SDP_PUT16(srv->fdidx[fd].rsp_size - 3, ptr);
-
-	//syslog(LOG_ERR,"rsp size %d",srv->fdidx[fd].rsp_size - 3);
 	return (0);
 }
 
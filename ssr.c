@@ -38,11 +38,67 @@
 #include <errno.h>
 #include <sdp.h>
 #include <string.h>
+#include "de.h"
 #include "profile.h"
 #include "provider.h"
+#include "timer.h"
 #include "server.h"
 #include "uuid-private.h"
 
+/*
+ * Put handles of the records that match ServiceSearchPattern into rsp,
+ * at most limit of them. Returns number of bytes used.
+ */
+
+int32_t
+server_prepare_handle_list(server_p srv, int32_t fd,
+		uint8_t const *ssp, uint8_t const *ssp_end, int32_t limit,
+		uint8_t *rsp, uint8_t const * const rsp_end)
+{
+	uint8_t const	*req = NULL;
+	uint8_t		*ptr = rsp;
+	provider_t	*provider = NULL;
+	int32_t		 rcount, slot;
+	uint32_t	 id;
+	uint128_t	 uuid;
+
+	/*
+	 * Calculate how many record handles we can fit 
+	 * in our reply buffer and adjust limit.
+	 */
+
+	rcount = (rsp_end - ptr) / 4;
+	if (rcount < limit)
+		limit = rcount;
+
+	/* Look for the record handles */
+	for (rcount = 0, req = ssp; req < ssp_end && rcount < limit; ) {
+		de_get_uuid(&req, &uuid);
+
+		/*
+		 * Every record is in the public browse group. UUID that
+		 * was never interned does not belong to any record.
+		 */
+
+		if (memcmp(&uuid, &uuid_public_browse_group,
+				sizeof(uuid)) == 0)
+			id = PROVIDER_UUID_ANY;
+		else if ((id = uuid_lookup(&uuid)) == UUID_ID_NONE)
+			continue;
+
+		for (slot = 0; rcount < limit; rcount ++) {
+			provider = provider_scan(srv->fdidx[fd].local,
+					id, &slot);
+			if (provider == NULL)
+				break;
+
+			SDP_PUT32(provider->handle, ptr);
+		}
+	}
+
+	return (ptr - rsp);
+}
+
 /*
  * Prepare SDP Service Search Response
  */
@@ -55,13 +111,11 @@ server_prepare_service_search_response(server_p srv, int32_t fd)
 	uint8_t		*rsp = srv->fdidx[fd].rsp;
 	uint8_t const	*rsp_end = rsp + NG_L2CAP_MTU_MAXIMUM;
 
-	uint8_t		*ptr = NULL;
-	provider_t	*provider = NULL;
-	int32_t		 type, ssplen, rsp_limit, rcount, cslen, cs;
-	uint128_t	 uuid, puuid;
+	int32_t		 error;
+	de_req_t	 r;
 
 	/*
-	 * Minimal SDP Service Search Request
+	 * SDP Service Search Request
 	 *
 	 * seq8 len8		- 2 bytes
 	 *	uuid16 value16	- 3 bytes ServiceSearchPattern
@@ -69,53 +123,12 @@ server_prepare_service_search_response(server_p srv, int32_t fd)
 	 * value8		- 1 byte  ContinuationState
 	 */
 
-	if (req_end - req < 8)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	/* Get size of ServiceSearchPattern */
-	ssplen = 0;
-	SDP_GET8(type, req);
-	switch (type) {
-	case SDP_DATA_SEQ8:
-		SDP_GET8(ssplen, req);
-		break;
-
-	case SDP_DATA_SEQ16:
-		SDP_GET16(ssplen, req);
-		break;
-
-	case SDP_DATA_SEQ32:
-		SDP_GET32(ssplen, req);
-		break;
-	}
-	if (ssplen <= 0)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	ptr = (uint8_t *) req + ssplen;
-
-	/* Get MaximumServiceRecordCount */
-	if (ptr + 2 > req_end)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-	
-	SDP_GET16(rsp_limit, ptr);
-	if (rsp_limit <= 0)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	/* Get ContinuationState */
-	if (ptr + 1 > req_end)
-		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-	SDP_GET8(cslen, ptr);
-	if (cslen != 0) {
-		if (cslen != 2 || req_end - ptr != 2)
-			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-		SDP_GET16(cs, ptr);
-	} else
-		cs = 0;
+	error = de_parse(SDP_PDU_SERVICE_SEARCH_REQUEST, req, req_end, &r);
+	if (error != 0)
+		return (error);
 
 	/* Process the request. First, check continuation state */
-	if (srv->fdidx[fd].rsp_cs != cs)
+	if (srv->fdidx[fd].rsp_cs != r.cs)
 		return (SDP_ERROR_CODE_INVALID_CONTINUATION_STATE);
 	if (srv->fdidx[fd].rsp_size > 0)
 		return (0);
@@ -127,79 +140,12 @@ server_prepare_service_search_response(server_p srv, int32_t fd)
 	 * value16	- 2 bytes CurrentServiceRecordCount (not incl.)
 	 * value32	- 4 bytes handle
 	 * [ value32 ]
-	 *
-	 * Calculate how many record handles we can fit 
-	 * in our reply buffer and adjust rlimit.
 	 */
 
-	ptr = rsp;
-	rcount = (rsp_end - ptr) / 4;
-	if (rcount < rsp_limit)
-		rsp_limit = rcount;
-
-	/* Look for the record handles */
-	for (rcount = 0; ssplen > 0 && rcount < rsp_limit; ) {
-		SDP_GET8(type, req);
-		ssplen --;
-
-		switch (type) {
-		case SDP_DATA_UUID16:
-			if (ssplen < 2)
-				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-			memcpy(&uuid, &uuid_base, sizeof(uuid));
-			uuid.b[2] = *req ++;
-			uuid.b[3] = *req ++;
-			ssplen -= 2;
-			break;
-
-		case SDP_DATA_UUID32:
-			if (ssplen < 4)
-				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-			memcpy(&uuid, &uuid_base, sizeof(uuid));
-			uuid.b[0] = *req ++;
-			uuid.b[1] = *req ++;
-			uuid.b[2] = *req ++;
-			uuid.b[3] = *req ++;
-			ssplen -= 4;
-			break;
-
-		case SDP_DATA_UUID128:
-			if (ssplen < 16)
-				return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-
-			memcpy(uuid.b, req, 16);
-			req += 16;
-			ssplen -= 16; 
-			break;
-
-		default:
-			return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
-			/* NOT REACHED */
-		}
-
-		for (provider = provider_get_first();
-		     provider != NULL && rcount < rsp_limit;
-		     provider = provider_get_next(provider)) {
-			if (!provider_match_bdaddr(provider, &srv->req_sa.l2cap_bdaddr))
-				continue;
-
-			memcpy(&puuid, &uuid_base, sizeof(puuid));
-			puuid.b[2] = provider->profile->uuid >> 8;
-			puuid.b[3] = provider->profile->uuid;
-
-			if (memcmp(&uuid, &puuid, sizeof(uuid)) == 0 ||
-			    memcmp(&uuid, &uuid_public_browse_group, sizeof(uuid)) == 0) {
-				SDP_PUT32(provider->handle, ptr);
-				rcount ++;
-			}
-		}
-	}
-
 	/* Set reply size (not counting PDU header and continuation state) */
 	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t) - 4;
-	srv->fdidx[fd].rsp_size = ptr - rsp;
+	srv->fdidx[fd].rsp_size = server_prepare_handle_list(srv, fd,
+			r.ssp, r.ssp_end, r.limit, rsp, rsp_end);
 	srv->fdidx[fd].rsp_cs = 0;
 
 	return (0);
@@ -266,9 +212,7 @@ server_send_service_search_response(server_p srv, int32_t fd)
 	iov[3].iov_base = cs;
 	iov[3].iov_len = 1 + cs[0];
 
-	do {
-		size = writev(fd, (struct iovec const *) &iov, sizeof(iov)/sizeof(iov[0]));
-	} while (size < 0 && errno == EINTR);
+	size = server_writev(srv, fd, iov, sizeof(iov)/sizeof(iov[0]));
 
 	/* Check if we have sent (or failed to sent) last response chunk */
 	if (srv->fdidx[fd].rsp_cs == srv->fdidx[fd].rsp_size) {
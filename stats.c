@@ -0,0 +1,86 @@
+/*
+ * stats.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <bluetooth.h>
+#include <errno.h>
+#include <sdp.h>
+#include <string.h>
+#include "profile.h"
+#include "provider.h"
+#include "timer.h"
+#include "server.h"
+
+/*
+ * Prepare Server Statistics response
+ */
+
+int32_t
+server_prepare_server_stats_response(server_p srv, int32_t fd)
+{
+	uint8_t		*rsp = srv->fdidx[fd].rsp;
+	provider_memory_t memory;
+	int32_t		 i;
+
+	/*
+	 * Server Statistics Request has no parameters
+	 */
+
+	if (!srv->fdidx[fd].control || ((sdp_pdu_p)(srv->req))->len != 0)
+		return (SDP_ERROR_CODE_INVALID_REQUEST_SYNTAX);
+
+	/*
+	 * Server Statistics Response format
+	 *
+	 * value16	- 2 bytes error code (always 0)
+	 * value16	- 2 bytes number of counters
+	 *	value32	- 4 bytes counter (SERVER_STAT_xxx order)
+	 *	[ value32 ]
+	 */
+
+	provider_get_memory(&memory);
+	srv->stats[SERVER_STAT_RECORDS] = memory.records;
+	srv->stats[SERVER_STAT_RECORD_SLOTS] = memory.slots;
+	srv->stats[SERVER_STAT_DATA_BYTES] = memory.data;
+	srv->stats[SERVER_STAT_ARENA_BYTES] = memory.arena;
+
+	SDP_PUT16(0, rsp);
+	SDP_PUT16(SERVER_STAT_MAX, rsp);
+
+	for (i = 0; i < SERVER_STAT_MAX; i ++)
+		SDP_PUT32(srv->stats[i], rsp);
+
+	/* Set reply size */
+	srv->fdidx[fd].rsp_limit = srv->fdidx[fd].omtu - sizeof(sdp_pdu_t);
+	srv->fdidx[fd].rsp_size = rsp - srv->fdidx[fd].rsp;
+	srv->fdidx[fd].rsp_cs = 0;
+
+	return (0);
+}
+
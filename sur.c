@@ -36,6 +36,7 @@
 #include <string.h>
 #include "profile.h"
 #include "provider.h"
+#include "timer.h"
 #include "server.h"
 
 /*
@@ -0,0 +1,224 @@
+/*
+ * timer.c
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/queue.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "timer.h"
+
+static void	timer_insert	(timer_wheel_p w, timer_p t);
+
+/*
+ * Return current time in ticks
+ */
+
+uint64_t
+timer_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) /
+			TIMER_TICK_MS);
+}
+
+/*
+ * Initialize timer wheel
+ */
+
+void
+timer_wheel_init(timer_wheel_p w)
+{
+	int32_t	l, s;
+
+	memset(w, 0, sizeof(*w));
+
+	for (l = 0; l < TIMER_WHEEL_LEVELS; l ++)
+		for (s = 0; s < TIMER_WHEEL_SLOTS; s ++)
+			LIST_INIT(&w->slots[l][s]);
+
+	w->now = timer_now();
+}
+
+/*
+ * Initialize timer
+ */
+
+void
+timer_init(timer_p t, timer_cb_p cb, void *arg)
+{
+	memset(t, 0, sizeof(*t));
+	t->cb = cb;
+	t->arg = arg;
+}
+
+/*
+ * Put timer into the slot that matches its expiration time
+ */
+
+static void
+timer_insert(timer_wheel_p w, timer_p t)
+{
+	uint64_t	delta = t->expires - w->now;
+	int32_t		level;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level ++)
+		if (delta < ((uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+
+	LIST_INSERT_HEAD(&w->slots[level][(t->expires >>
+		(TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], t, timer_next);
+}
+
+/*
+ * Arm (or re-arm) timer to fire in given number of milliseconds
+ */
+
+void
+timer_add(timer_wheel_p w, timer_p t, uint32_t ms)
+{
+	uint64_t	ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	uint64_t	max = ((uint64_t) 1 <<
+				(TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+	if (t->pending)
+		timer_del(w, t);
+
+	/* Never fire in the current tick, it might be running right now */
+	if (ticks == 0)
+		ticks = 1;
+	if (ticks > max)
+		ticks = max;
+
+	/*
+	 * Wheel time only moves in timer_run(), after select() returns, so
+	 * it may be behind. Count from the current time, or timers armed
+	 * after a long sleep would fire early.
+	 */
+
+	t->expires = timer_now() + ticks;
+	t->pending = 1;
+	timer_insert(w, t);
+	w->count ++;
+}
+
+/*
+ * Disarm timer
+ */
+
+void
+timer_del(timer_wheel_p w, timer_p t)
+{
+	if (!t->pending)
+		return;
+
+	LIST_REMOVE(t, timer_next);
+	t->pending = 0;
+	w->count --;
+}
+
+/*
+ * Fire all expired timers. Callbacks are free to add and delete timers.
+ */
+
+void
+timer_run(timer_wheel_p w)
+{
+	struct timer_list	 list;
+	timer_p			 t = NULL;
+	uint64_t		 now = timer_now();
+	int32_t			 level, slot;
+
+	/* Step one tick at a time while timers are armed */
+	for (; w->now < now && w->count > 0; ) {
+		w->now ++;
+
+		/* Level below wrapped around, move timers down */
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level ++) {
+			if ((w->now & (((uint64_t) 1 << (TIMER_WHEEL_BITS *
+					level)) - 1)) != 0)
+				break;
+
+			slot = (w->now >> (TIMER_WHEEL_BITS * level)) &
+					TIMER_WHEEL_MASK;
+
+			LIST_INIT(&list);
+			while ((t = LIST_FIRST(&w->slots[level][slot])) != NULL) {
+				LIST_REMOVE(t, timer_next);
+				LIST_INSERT_HEAD(&list, t, timer_next);
+			}
+			while ((t = LIST_FIRST(&list)) != NULL) {
+				LIST_REMOVE(t, timer_next);
+				timer_insert(w, t);
+			}
+		}
+
+		slot = w->now & TIMER_WHEEL_MASK;
+		while ((t = LIST_FIRST(&w->slots[0][slot])) != NULL) {
+			assert(t->expires <= w->now);
+
+			timer_del(w, t);
+			(*t->cb)(t, t->arg);
+		}
+	}
+
+	/* Always catch up, timers are only armed relative to timer_now() */
+	w->now = now;
+}
+
+/*
+ * Return number of milliseconds until next timer fires, or -1 if there
+ * are no timers. For timers further away than one turn of the first
+ * level, return time until the first level wraps around.
+ */
+
+int32_t
+timer_next(timer_wheel_p w)
+{
+	uint64_t	now = timer_now();
+	int32_t		i;
+
+	if (w->count == 0)
+		return (-1);
+	if (now > w->now)
+		return (0);
+
+	for (i = 1; i <= TIMER_WHEEL_SLOTS; i ++) {
+		if (!LIST_EMPTY(&w->slots[0][(w->now + i) & TIMER_WHEEL_MASK]))
+			return (i * TIMER_TICK_MS);
+		if (((w->now + i) & TIMER_WHEEL_MASK) == 0)
+			break;
+	}
+
+	return (i * TIMER_TICK_MS);
+}
+
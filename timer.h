@@ -0,0 +1,82 @@
+/*
+ * timer.h
+ *
+ * Copyright (c) 2004 Maksim Yevmenkin <m_evmenkin@yahoo.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/*
+ * Hierarchical timer wheel. Time is counted in ticks of TIMER_TICK_MS
+ * milliseconds. Level 0 has one slot per tick, every next level has one
+ * slot per full turn of the level below. Timers are moved down a level
+ * when the level below wraps around.
+ */
+
+#define	TIMER_TICK_MS		100
+#define	TIMER_WHEEL_BITS	6
+#define	TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define	TIMER_WHEEL_MASK	(TIMER_WHEEL_SLOTS - 1)
+#define	TIMER_WHEEL_LEVELS	4
+
+struct timer;
+
+typedef void	(timer_cb_t)(struct timer *t, void *arg);
+typedef timer_cb_t *	timer_cb_p;
+
+struct timer
+{
+	uint64_t		 expires;	/* tick to fire at */
+	timer_cb_p		 cb;		/* callback */
+	void			*arg;		/* callback argument */
+	int32_t			 pending;	/* timer is armed */
+	LIST_ENTRY(timer)	 timer_next;	/* timers in the slot */
+};
+
+typedef struct timer *	timer_p;
+
+LIST_HEAD(timer_list, timer);
+
+struct timer_wheel
+{
+	uint64_t		 now;		/* current tick */
+	int32_t			 count;		/* number of armed timers */
+	struct timer_list	 slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+typedef struct timer_wheel	timer_wheel_t;
+typedef struct timer_wheel *	timer_wheel_p;
+
+uint64_t	timer_now	(void);
+void		timer_wheel_init(timer_wheel_p w);
+void		timer_init	(timer_p t, timer_cb_p cb, void *arg);
+void		timer_add	(timer_wheel_p w, timer_p t, uint32_t ms);
+void		timer_del	(timer_wheel_p w, timer_p t);
+void		timer_run	(timer_wheel_p w);
+int32_t		timer_next	(timer_wheel_p w);
+
+#endif /* ndef _TIMER_H_ */
@@ -35,5 +35,18 @@
 extern	uint128_t	uuid_base;
 extern	uint128_t	uuid_public_browse_group;
 
+/*
+ * UUID interning. Every UUID known to the server gets a small dense id,
+ * so UUIDs are matched by comparing integers. Ids are never reused. Ids
+ * are only created for UUIDs of registered services; UUIDs that come
+ * with requests are only looked up.
+ */
+
+#define	UUID_ID_NONE		0		/* no such UUID */
+
+uint32_t	uuid_intern		(uint128_t const *uuid);
+uint32_t	uuid_intern16		(uint16_t uuid);
+uint32_t	uuid_lookup		(uint128_t const *uuid);
+
 #endif /* ndef _UUID_PRIVATE_H_ */
 
@@ -31,6 +31,8 @@
 
 #include <bluetooth.h>
 #include <sdp.h>
+#include <stdlib.h>
+#include <string.h>
 #include <uuid.h>
 #include "uuid-private.h"
 
@@ -54,3 +56,123 @@ uint128_t	uuid_public_browse_group = {
 	}
 };
 
+/*
+ * Interned UUIDs. The hash is open addressed and holds ids, uuids[id]
+ * is the UUID. Hash is kept at most half full.
+ */
+
+static uint128_t	*uuids = NULL;
+static uint32_t		 uuids_count = 0;	/* ids in use (incl. NONE) */
+static uint32_t		*uuids_hash = NULL;
+static uint32_t		 uuids_hash_size = 0;	/* power of 2 */
+
+static uint32_t
+uuid_hash(uint128_t const *uuid)
+{
+	uint32_t	h = 2166136261U;
+	int32_t		i;
+
+	for (i = 0; i < sizeof(uuid->b); i ++)
+		h = (h ^ uuid->b[i]) * 16777619U;
+
+	return (h);
+}
+
+/*
+ * Find slot in the hash for the UUID. Returns either the slot with the
+ * UUID or the empty slot where it would go.
+ */
+
+static uint32_t
+uuid_slot(uint128_t const *uuid)
+{
+	uint32_t	mask = uuids_hash_size - 1;
+	uint32_t	i = uuid_hash(uuid) & mask;
+
+	while (uuids_hash[i] != UUID_ID_NONE &&
+	       memcmp(&uuids[uuids_hash[i]], uuid, sizeof(*uuid)) != 0)
+		i = (i + 1) & mask;
+
+	return (i);
+}
+
+/*
+ * Double the hash and the id table
+ */
+
+static int32_t
+uuid_grow(void)
+{
+	uint32_t	 size = uuids_hash_size? uuids_hash_size * 2 : 64;
+	uint32_t	*hash = NULL;
+	uint128_t	*ids = NULL;
+	uint32_t	 id;
+
+	ids = (uint128_t *) realloc(uuids, size / 2 * sizeof(ids[0]));
+	if (ids == NULL)
+		return (-1);
+	uuids = ids;
+
+	hash = (uint32_t *) calloc(size, sizeof(hash[0]));
+	if (hash == NULL)
+		return (-1);
+
+	free(uuids_hash);
+	uuids_hash = hash;
+	uuids_hash_size = size;
+
+	if (uuids_count == 0)
+		uuids_count = 1; /* UUID_ID_NONE */
+
+	for (id = 1; id < uuids_count; id ++)
+		uuids_hash[uuid_slot(&uuids[id])] = id;
+
+	return (0);
+}
+
+/*
+ * Return id for the UUID, create new one if needed. Returns UUID_ID_NONE
+ * if out of memory.
+ */
+
+uint32_t
+uuid_intern(uint128_t const *uuid)
+{
+	uint32_t	i;
+
+	if (uuids_count + 1 > uuids_hash_size / 2 && uuid_grow() < 0)
+		return (UUID_ID_NONE);
+
+	i = uuid_slot(uuid);
+	if (uuids_hash[i] == UUID_ID_NONE) {
+		memcpy(&uuids[uuids_count], uuid, sizeof(*uuid));
+		uuids_hash[i] = uuids_count ++;
+	}
+
+	return (uuids_hash[i]);
+}
+
+uint32_t
+uuid_intern16(uint16_t uuid16)
+{
+	uint128_t	uuid;
+
+	memcpy(&uuid, &uuid_base, sizeof(uuid));
+	uuid.b[2] = uuid16 >> 8;
+	uuid.b[3] = uuid16;
+
+	return (uuid_intern(&uuid));
+}
+
+/*
+ * Return id for the UUID or UUID_ID_NONE if UUID is not known
+ */
+
+uint32_t
+uuid_lookup(uint128_t const *uuid)
+{
+	if (uuids_hash_size == 0)
+		return (UUID_ID_NONE);
+
+	return (uuids_hash[uuid_slot(uuid)]);
+}